@@ -0,0 +1,537 @@
+/*
+ * Copyright 2014 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/* Android-EMU: start of modification */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "drv.h"
+#include "drv_convert.h"
+#include "drv_formats.h"
+#include "helpers.h"
+#include "mock_drm.h"
+
+#define BENCH_MAX_FORMATS 16
+#define BENCH_MAX_SIZES 8
+#define BENCH_DEFAULT_ITERATIONS 200
+// the creates of the burst run, a few screens' worth of buffers in flight
+#define BENCH_BURST 32
+
+#define BENCH_USE_FLAGS (BO_USE_TEXTURE | BO_USE_SW_READ_OFTEN | BO_USE_SW_WRITE_OFTEN)
+
+#define BENCH_SW_MASK (BO_USE_SW_READ_OFTEN | BO_USE_SW_WRITE_OFTEN)
+
+struct bench_size {
+	uint32_t width;
+	uint32_t height;
+};
+
+struct bench_result {
+	double allocs_per_sec;
+	double burst_allocs_per_sec;
+	double map_unmap_us;
+	double flush_mb_per_sec;
+	double transferred_per_flush;
+	double readback_us;
+};
+
+static const uint32_t bench_default_formats[] = {
+	DRM_FORMAT_ABGR8888, DRM_FORMAT_XBGR8888, DRM_FORMAT_RGB565,
+	DRM_FORMAT_R8,	     DRM_FORMAT_NV12,	  DRM_FORMAT_YVU420_ANDROID,
+};
+
+static const struct bench_size bench_default_sizes[] = {
+	{ 256, 256 },
+	{ 1920, 1080 },
+};
+
+// the self-test walks every format of the table, with the virgl format it translates to
+struct bench_table_format {
+	uint32_t format;
+	uint32_t virgl_format;
+};
+
+#define BENCH_TABLE_FORMAT(fourcc, layout, virgl_format, stride_align, flags)                      \
+	{ fourcc, virgl_format },
+static const struct bench_table_format bench_table_formats[] = { DRV_FORMATS(BENCH_TABLE_FORMAT) };
+#undef BENCH_TABLE_FORMAT
+
+// the uses the backend registers combinations for, as columns of the report
+static const uint64_t bench_self_test_uses[] = {
+	BO_USE_TEXTURE | BENCH_SW_MASK,
+	BO_USE_RENDERING | BENCH_SW_MASK,
+	BO_USE_SCANOUT | BO_USE_RENDERING,
+};
+
+// an aligned size, and one odd in both dimensions to exercise subsampled planes
+static const struct bench_size bench_self_test_sizes[] = {
+	{ 64, 64 },
+	{ 33, 17 },
+};
+
+static uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static double bench_seconds(uint64_t start)
+{
+	return (bench_now_ns() - start) / 1e9;
+}
+
+static uint32_t bench_parse_format(const char *name)
+{
+	char code[4] = { ' ', ' ', ' ', ' ' };
+	size_t length = strlen(name);
+
+	if (!length || length > 4)
+		return 0;
+
+	memcpy(code, name, length);
+	return fourcc_code(code[0], code[1], code[2], code[3]);
+}
+
+static void bench_format_name(uint32_t format, char name[5])
+{
+	uint32_t i;
+
+	for (i = 0; i < 4; i++)
+		name[i] = (format >> (8 * i)) & 0xff;
+	name[4] = '\0';
+}
+
+static size_t bench_bo_size(struct bo *bo)
+{
+	size_t plane, size = 0;
+
+	for (plane = 0; plane < drv_bo_get_num_planes(bo); plane++) {
+		size_t end = drv_bo_get_plane_offset(bo, plane) + drv_bo_get_plane_size(bo, plane);
+		if (end > size)
+			size = end;
+	}
+
+	return size;
+}
+
+/**
+ * Android-EMU:
+ * allocations per second, both as create/destroy pairs, the pattern of
+ * transient buffers, and as bursts of creates followed by their destroys
+ */
+static int bench_alloc(struct driver *drv, uint32_t format, const struct bench_size *size,
+		       uint32_t iterations, struct bench_result *result)
+{
+	struct bo *bos[BENCH_BURST];
+	uint64_t start;
+	uint32_t i, j, rounds;
+
+	start = bench_now_ns();
+	for (i = 0; i < iterations; i++) {
+		bos[0] = drv_bo_create(drv, size->width, size->height, format, BENCH_USE_FLAGS);
+		if (!bos[0])
+			return -ENOMEM;
+		drv_bo_destroy(bos[0]);
+	}
+	result->allocs_per_sec = iterations / bench_seconds(start);
+
+	rounds = (iterations + BENCH_BURST - 1) / BENCH_BURST;
+	start = bench_now_ns();
+	for (i = 0; i < rounds; i++) {
+		for (j = 0; j < BENCH_BURST; j++) {
+			bos[j] = drv_bo_create(drv, size->width, size->height, format,
+					       BENCH_USE_FLAGS);
+			if (!bos[j]) {
+				while (j--)
+					drv_bo_destroy(bos[j]);
+				return -ENOMEM;
+			}
+		}
+		for (j = 0; j < BENCH_BURST; j++)
+			drv_bo_destroy(bos[j]);
+	}
+	result->burst_allocs_per_sec = rounds * BENCH_BURST / bench_seconds(start);
+
+	return 0;
+}
+
+/**
+ * Android-EMU:
+ * the latency of a map/unmap pair of the whole buffer, and the throughput of
+ * flushing it after rewriting all of it
+ */
+static int bench_map_flush(struct driver *drv, uint32_t format, const struct bench_size *size,
+			   uint32_t iterations, struct bench_result *result)
+{
+	struct rectangle rect = { 0, 0, size->width, size->height };
+	struct mock_drm_stats stats;
+	struct mapping *mapping;
+	struct bo *bo;
+	uint64_t start;
+	size_t length;
+	uint8_t *addr;
+	uint32_t i;
+	int ret = 0;
+
+	bo = drv_bo_create(drv, size->width, size->height, format, BENCH_USE_FLAGS);
+	if (!bo)
+		return -ENOMEM;
+
+	length = bench_bo_size(bo);
+
+	start = bench_now_ns();
+	for (i = 0; i < iterations; i++) {
+		if (!drv_bo_map(bo, &rect, BO_MAP_READ_WRITE, &mapping, 0)) {
+			ret = -EFAULT;
+			goto out;
+		}
+		drv_bo_unmap(bo, mapping);
+	}
+	result->map_unmap_us = bench_seconds(start) * 1e6 / iterations;
+
+	addr = drv_bo_map(bo, &rect, BO_MAP_READ_WRITE, &mapping, 0);
+	if (!addr) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	mock_drm_reset_stats();
+	start = bench_now_ns();
+	for (i = 0; i < iterations; i++) {
+		memset(addr, i & 0xff, length);
+		drv_bo_flush(bo, mapping);
+	}
+	result->flush_mb_per_sec = (double)length * iterations / bench_seconds(start) / 1e6;
+
+	mock_drm_get_stats(&stats);
+	result->transferred_per_flush = (double)stats.transferred_bytes / iterations;
+
+	drv_bo_unmap(bo, mapping);
+out:
+	drv_bo_destroy(bo);
+	return ret;
+}
+
+/**
+ * Android-EMU:
+ * the latency of reading the whole buffer back into a half-size RGBA copy,
+ * the shape of a test harness' screenshot; negative for formats without one
+ */
+static int bench_readback(struct driver *drv, uint32_t format, const struct bench_size *size,
+			  uint32_t iterations, struct bench_result *result)
+{
+	struct rectangle rect = { 0, 0, size->width, size->height };
+	uint32_t strides[DRV_MAX_PLANES] = { 0 }, offsets[DRV_MAX_PLANES] = { 0 };
+	uint32_t width = (size->width + 1) / 2, height = (size->height + 1) / 2;
+	struct drv_image image;
+	struct bo *bo;
+	uint64_t start;
+	uint8_t *pixels;
+	uint32_t i;
+	int ret = 0;
+
+	bo = drv_bo_create(drv, size->width, size->height, format,
+			   BENCH_USE_FLAGS | BO_USE_RENDERING);
+	if (!bo)
+		return -ENOMEM;
+
+	strides[0] = 4 * width;
+	pixels = malloc((size_t)strides[0] * height);
+	if (!pixels) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	drv_image_init(&image, DRM_FORMAT_ABGR8888, width, height, pixels, strides, offsets);
+
+	start = bench_now_ns();
+	for (i = 0; i < iterations && !ret; i++)
+		ret = drv_bo_readback(bo, &rect, &image);
+	result->readback_us = bench_seconds(start) * 1e6 / iterations;
+
+	// formats without an RGB conversion have no readback to measure
+	if (ret == -EINVAL && i == 1) {
+		result->readback_us = -1;
+		ret = 0;
+	}
+
+	free(pixels);
+out:
+	drv_bo_destroy(bo);
+	return ret;
+}
+
+static bool bench_caps_has_format(const struct virgl_supported_format_mask *supported,
+				  uint32_t virgl_format)
+{
+	return virgl_format && (supported->bitmask[virgl_format / 32] & (1u << (virgl_format % 32)));
+}
+
+/**
+ * Android-EMU:
+ * allocate a buffer of a supported combination, check its planes hold the
+ * layout of the format table and write all of them through a mapping
+ */
+static int bench_self_test_bo(struct driver *drv, uint32_t format, const struct bench_size *size,
+			      uint64_t use_flags)
+{
+	struct rectangle rect = { 0, 0, size->width, size->height };
+	struct mapping *mapping;
+	struct bo *bo;
+	uint8_t *addr;
+	size_t plane;
+	int ret = 0;
+
+	bo = drv_bo_create(drv, size->width, size->height, format, use_flags);
+	if (!bo)
+		return -ENOMEM;
+
+	for (plane = 0; plane < drv_bo_get_num_planes(bo); plane++) {
+		uint32_t stride = drv_bo_get_plane_stride(bo, plane);
+
+		if (stride < drv_stride_from_format(format, size->width, plane) ||
+		    stride % drv_stride_align_from_format(format, plane)) {
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	if (!(use_flags & BENCH_SW_MASK))
+		goto out;
+
+	addr = drv_bo_map(bo, &rect, BO_MAP_READ_WRITE, &mapping, 0);
+	if (!addr) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	addr -= drv_bo_get_plane_offset(bo, 0);
+	for (plane = 0; plane < drv_bo_get_num_planes(bo); plane++)
+		memset(addr + drv_bo_get_plane_offset(bo, plane), 0x5a,
+		       drv_bo_get_plane_size(bo, plane));
+
+	ret = drv_bo_flush(bo, mapping);
+	drv_bo_unmap(bo, mapping);
+out:
+	drv_bo_destroy(bo);
+	return ret;
+}
+
+/**
+ * Android-EMU:
+ * allocate every combination the backend registered for the formats of the
+ * table and, with a 3D host, check each against the host's capability
+ * bitmasks: render targets need the render bit of their virgl format, and
+ * textures without the sampler bit must be emulated by a conversion
+ */
+static int bench_self_test(struct driver *drv, const struct mock_drm_config *config)
+{
+	uint32_t f, u, s, num_combos = 0, num_failed = 0;
+
+	printf("%-6s %6s %-8s %-8s %-8s %s\n", "format", "virgl", "texture", "render", "scanout",
+	       "result");
+
+	for (f = 0; f < sizeof(bench_table_formats) / sizeof(bench_table_formats[0]); f++) {
+		const struct bench_table_format *entry = &bench_table_formats[f];
+		const char *columns[3];
+		bool failed = false;
+		char name[5];
+
+		for (u = 0; u < sizeof(bench_self_test_uses) / sizeof(bench_self_test_uses[0]); u++) {
+			uint64_t use_flags = bench_self_test_uses[u];
+
+			columns[u] = "-";
+			if (!drv_find_combination(drv, entry->format, use_flags))
+				continue;
+
+			columns[u] = "ok";
+			num_combos++;
+
+			if (config->has_3d && (use_flags & BO_USE_RENDERING) &&
+			    !bench_caps_has_format(&config->caps.v1.render, entry->virgl_format)) {
+				columns[u] = "no-caps";
+				failed = true;
+			} else if (config->has_3d && (use_flags & BO_USE_TEXTURE) &&
+				 !bench_caps_has_format(&config->caps.v1.sampler, entry->virgl_format))
+				columns[u] = "emulated";
+
+			for (s = 0; s < sizeof(bench_self_test_sizes) / sizeof(bench_self_test_sizes[0]);
+			     s++) {
+				if (bench_self_test_bo(drv, entry->format, &bench_self_test_sizes[s],
+						       use_flags)) {
+					columns[u] = "failed";
+					failed = true;
+				}
+			}
+		}
+
+		bench_format_name(entry->format, name);
+		printf("%-6s %6u %-8s %-8s %-8s %s\n", name, entry->virgl_format, columns[0],
+		       columns[1], columns[2], failed ? "FAILED" : "ok");
+		num_failed += failed;
+	}
+
+	printf("%u combinations, %u formats failed\n", num_combos, num_failed);
+	return num_failed ? 1 : 0;
+}
+
+static void bench_usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-n iterations] [-f fourcc]... [-s WxH]... [-l op=latency,...] "
+		"[-2] [-b] [-y] [-t]\n"
+		"  -n  iterations of every measurement (default %d)\n"
+		"  -f  format to measure, e.g. AB24 or NV12 (default: a common set)\n"
+		"  -s  size to measure (default: 256x256 and 1920x1080)\n"
+		"  -l  ioctl latencies, ops are create, destroy, map, transfer, wait, other\n"
+		"      and all, e.g. create=200us,transfer=30us\n"
+		"  -2  device without 3D, buffers are dumb buffers\n"
+		"  -b  device with host visible blob resources\n"
+		"  -y  host without YUV textures, YUV formats are emulated\n"
+		"  -t  self-test: allocate every supported combination of every format\n"
+		"      and check it against the host's capabilities, instead of measuring\n",
+		name, BENCH_DEFAULT_ITERATIONS);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t formats[BENCH_MAX_FORMATS];
+	struct bench_size sizes[BENCH_MAX_SIZES];
+	uint32_t num_formats = 0, num_sizes = 0, iterations = BENCH_DEFAULT_ITERATIONS;
+	struct mock_drm_config config;
+	struct driver *drv;
+	uint32_t f, s;
+	bool self_test = false;
+	int fd, opt, ret = 0;
+
+	mock_drm_config_init(&config);
+
+	while ((opt = getopt(argc, argv, "n:f:s:l:2byt")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			if (!iterations) {
+				bench_usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'f':
+			if (num_formats == BENCH_MAX_FORMATS || !bench_parse_format(optarg)) {
+				bench_usage(argv[0]);
+				return 1;
+			}
+			formats[num_formats++] = bench_parse_format(optarg);
+			break;
+		case 's':
+			if (num_sizes == BENCH_MAX_SIZES ||
+			    sscanf(optarg, "%ux%u", &sizes[num_sizes].width,
+				   &sizes[num_sizes].height) != 2 ||
+			    !sizes[num_sizes].width || !sizes[num_sizes].height) {
+				bench_usage(argv[0]);
+				return 1;
+			}
+			num_sizes++;
+			break;
+		case 'l':
+			if (mock_drm_parse_latency(&config, optarg)) {
+				bench_usage(argv[0]);
+				return 1;
+			}
+			break;
+		case '2':
+			config.has_3d = false;
+			break;
+		case 'b':
+			config.has_blob = true;
+			break;
+		case 'y':
+			config.caps.v1.sampler.bitmask[VIRGL_FORMAT_YV12 / 32] &=
+			    ~(1u << (VIRGL_FORMAT_YV12 % 32));
+			config.caps.v1.sampler.bitmask[VIRGL_FORMAT_NV12 / 32] &=
+			    ~(1u << (VIRGL_FORMAT_NV12 % 32));
+			break;
+		case 't':
+			self_test = true;
+			break;
+		default:
+			bench_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!num_formats) {
+		num_formats = sizeof(bench_default_formats) / sizeof(bench_default_formats[0]);
+		memcpy(formats, bench_default_formats, sizeof(bench_default_formats));
+	}
+
+	if (!num_sizes) {
+		num_sizes = sizeof(bench_default_sizes) / sizeof(bench_default_sizes[0]);
+		memcpy(sizes, bench_default_sizes, sizeof(bench_default_sizes));
+	}
+
+	fd = mock_drm_open(&config);
+	if (fd < 0) {
+		fprintf(stderr, "failed to open the mock device: %s\n", strerror(-fd));
+		return 1;
+	}
+
+	drv = drv_create(fd);
+	if (!drv) {
+		fprintf(stderr, "failed to create the driver\n");
+		mock_drm_close(fd);
+		return 1;
+	}
+
+	if (self_test) {
+		ret = bench_self_test(drv, &config);
+		goto out;
+	}
+
+	printf("%-6s %-11s %12s %12s %14s %12s %14s %12s\n", "format", "size", "allocs/s",
+	       "burst/s", "map+unmap us", "flush MB/s", "xfer/flush KB", "readback us");
+
+	for (f = 0; f < num_formats; f++) {
+		for (s = 0; s < num_sizes; s++) {
+			struct bench_result result;
+			char name[5], size[24];
+
+			bench_format_name(formats[f], name);
+			snprintf(size, sizeof(size), "%ux%u", sizes[s].width, sizes[s].height);
+
+			memset(&result, 0, sizeof(result));
+			if (bench_alloc(drv, formats[f], &sizes[s], iterations, &result) ||
+			    bench_map_flush(drv, formats[f], &sizes[s], iterations, &result) ||
+			    bench_readback(drv, formats[f], &sizes[s], iterations, &result)) {
+				printf("%-6s %-11s failed\n", name, size);
+				ret = 1;
+				continue;
+			}
+
+			printf("%-6s %-11s %12.0f %12.0f %14.2f %12.1f %14.1f", name, size,
+			       result.allocs_per_sec, result.burst_allocs_per_sec,
+			       result.map_unmap_us, result.flush_mb_per_sec,
+			       result.transferred_per_flush / 1024);
+			if (result.readback_us < 0)
+				printf(" %12s\n", "-");
+			else
+				printf(" %12.2f\n", result.readback_us);
+		}
+	}
+
+out:
+	drv_destroy(drv);
+	mock_drm_close(fd);
+	return ret;
+}
+
+/* Android-EMU: end of modification */
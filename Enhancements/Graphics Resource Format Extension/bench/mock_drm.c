@@ -0,0 +1,610 @@
+/*
+ * Copyright 2014 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/* Android-EMU: start of modification */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <virtgpu_drm.h>
+#include <xf86drm.h>
+
+#include "mock_drm.h"
+
+#define MOCK_DRM_NAME "virtio_gpu"
+#define MOCK_DRM_PAGE_SIZE 4096
+// the backing file grows in steps of this size to keep ftruncate() off the create path
+#define MOCK_DRM_GROW_SIZE (64 << 20)
+// latencies below this are spun rather than slept, nanosleep() overshoots them
+#define MOCK_DRM_SPIN_NS 50000
+
+/**
+ * Android-EMU:
+ * a resource of the device: a page aligned range of the backing file, plus
+ * the host's copy of it the transfers move data to and from
+ */
+struct mock_resource {
+	int used;
+	uint64_t offset;
+	uint64_t size;
+	uint32_t stride;
+	uint32_t cpp;
+	uint8_t *host;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	int fd;
+	struct mock_drm_config config;
+	struct mock_resource *resources; /* index is the GEM handle minus one */
+	uint32_t num_resources;
+	uint32_t free_hint;
+	uint64_t end;
+	uint64_t file_size;
+	struct mock_drm_stats stats;
+} mock = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1,
+};
+
+static const char *const mock_drm_op_names[MOCK_DRM_OP_COUNT] = {
+	[MOCK_DRM_OP_CREATE] = "create",     [MOCK_DRM_OP_DESTROY] = "destroy",
+	[MOCK_DRM_OP_MAP] = "map",	     [MOCK_DRM_OP_TRANSFER] = "transfer",
+	[MOCK_DRM_OP_WAIT] = "wait",	     [MOCK_DRM_OP_OTHER] = "other",
+};
+
+const char *mock_drm_op_name(enum mock_drm_op op)
+{
+	return op < MOCK_DRM_OP_COUNT ? mock_drm_op_names[op] : "?";
+}
+
+static void mock_drm_caps_set(struct virgl_supported_format_mask *mask, uint32_t virgl_format)
+{
+	mask->bitmask[virgl_format / 32] |= 1u << (virgl_format % 32);
+}
+
+void mock_drm_config_format(struct mock_drm_config *config, uint32_t virgl_format, bool sampler,
+			    bool render)
+{
+	if (sampler)
+		mock_drm_caps_set(&config->caps.v1.sampler, virgl_format);
+	if (render)
+		mock_drm_caps_set(&config->caps.v1.render, virgl_format);
+}
+
+/**
+ * Android-EMU:
+ * a 3D capable device without blob support, whose host samples and renders
+ * the formats a virglrenderer host on a desktop GPU does, with no latency
+ */
+void mock_drm_config_init(struct mock_drm_config *config)
+{
+	uint32_t i;
+	static const uint32_t render_formats[] = {
+		VIRGL_FORMAT_B8G8R8A8_UNORM, VIRGL_FORMAT_B8G8R8X8_UNORM, VIRGL_FORMAT_R8G8B8A8_UNORM,
+		VIRGL_FORMAT_R8G8B8X8_UNORM, VIRGL_FORMAT_B5G6R5_UNORM,	  VIRGL_FORMAT_R8_UNORM,
+		VIRGL_FORMAT_R8G8_UNORM,
+	};
+	static const uint32_t sampler_formats[] = {
+		VIRGL_FORMAT_YV12,
+		VIRGL_FORMAT_NV12,
+	};
+
+	memset(config, 0, sizeof(*config));
+	config->has_3d = true;
+	config->caps.max_version = 1;
+	config->caps.v1.max_version = 1;
+
+	for (i = 0; i < sizeof(render_formats) / sizeof(render_formats[0]); i++)
+		mock_drm_config_format(config, render_formats[i], true, true);
+	for (i = 0; i < sizeof(sampler_formats) / sizeof(sampler_formats[0]); i++)
+		mock_drm_config_format(config, sampler_formats[i], true, false);
+}
+
+/**
+ * Android-EMU:
+ * parse latencies like "create=200us,transfer=30us,wait=1ms"; "all" sets
+ * every op, and a number without unit is in microseconds
+ */
+int mock_drm_parse_latency(struct mock_drm_config *config, const char *spec)
+{
+	char *copy, *item, *save = NULL;
+	int ret = 0;
+
+	copy = strdup(spec);
+	if (!copy)
+		return -ENOMEM;
+
+	for (item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+		char *value = strchr(item, '=');
+		char *unit;
+		uint64_t ns;
+		uint32_t op, matched;
+
+		if (!value) {
+			ret = -EINVAL;
+			break;
+		}
+
+		*value++ = '\0';
+		ns = strtoull(value, &unit, 10);
+		if (unit == value) {
+			ret = -EINVAL;
+			break;
+		}
+
+		if (!strcmp(unit, "ms"))
+			ns *= 1000000;
+		else if (!strcmp(unit, "us") || !*unit)
+			ns *= 1000;
+		else if (strcmp(unit, "ns")) {
+			ret = -EINVAL;
+			break;
+		}
+
+		matched = 0;
+		for (op = 0; op < MOCK_DRM_OP_COUNT; op++) {
+			if (!strcmp(item, "all") || !strcmp(item, mock_drm_op_names[op])) {
+				config->latency_ns[op] = ns;
+				matched++;
+			}
+		}
+
+		if (!matched) {
+			ret = -EINVAL;
+			break;
+		}
+	}
+
+	free(copy);
+	return ret;
+}
+
+int mock_drm_open(const struct mock_drm_config *config)
+{
+	int fd;
+
+	fd = memfd_create("mock_drm", MFD_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	pthread_mutex_lock(&mock.lock);
+	if (mock.fd >= 0) {
+		pthread_mutex_unlock(&mock.lock);
+		close(fd);
+		return -EBUSY;
+	}
+
+	mock.fd = fd;
+	mock.config = *config;
+	mock.end = 0;
+	mock.file_size = 0;
+	memset(&mock.stats, 0, sizeof(mock.stats));
+	pthread_mutex_unlock(&mock.lock);
+
+	return fd;
+}
+
+void mock_drm_close(int fd)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&mock.lock);
+	if (fd == mock.fd) {
+		for (i = 0; i < mock.num_resources; i++)
+			free(mock.resources[i].host);
+		free(mock.resources);
+		mock.resources = NULL;
+		mock.num_resources = 0;
+		mock.free_hint = 0;
+		close(mock.fd);
+		mock.fd = -1;
+	}
+	pthread_mutex_unlock(&mock.lock);
+}
+
+void mock_drm_get_stats(struct mock_drm_stats *stats)
+{
+	pthread_mutex_lock(&mock.lock);
+	*stats = mock.stats;
+	pthread_mutex_unlock(&mock.lock);
+}
+
+void mock_drm_reset_stats(void)
+{
+	pthread_mutex_lock(&mock.lock);
+	memset(mock.stats.calls, 0, sizeof(mock.stats.calls));
+	mock.stats.transferred_bytes = 0;
+	pthread_mutex_unlock(&mock.lock);
+}
+
+static void mock_drm_delay(uint64_t ns)
+{
+	struct timespec now, until;
+
+	if (!ns)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &until);
+	until.tv_sec += (until.tv_nsec + ns) / 1000000000;
+	until.tv_nsec = (until.tv_nsec + ns) % 1000000000;
+
+	if (ns >= MOCK_DRM_SPIN_NS) {
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+			;
+		return;
+	}
+
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (now.tv_sec < until.tv_sec ||
+		 (now.tv_sec == until.tv_sec && now.tv_nsec < until.tv_nsec));
+}
+
+static struct mock_resource *mock_drm_lookup(uint32_t handle)
+{
+	if (!handle || handle > mock.num_resources || !mock.resources[handle - 1].used)
+		return NULL;
+
+	return &mock.resources[handle - 1];
+}
+
+/**
+ * Android-EMU:
+ * back a new resource with a range of the file and return its handle, or 0;
+ * ranges are never reused, freed ones have their pages punched out instead
+ */
+static uint32_t mock_drm_alloc(uint64_t size, uint32_t stride, uint32_t cpp)
+{
+	struct mock_resource *res;
+	uint32_t i;
+
+	size = (size + MOCK_DRM_PAGE_SIZE - 1) & ~((uint64_t)MOCK_DRM_PAGE_SIZE - 1);
+	if (!size)
+		size = MOCK_DRM_PAGE_SIZE;
+
+	if (mock.end + size > mock.file_size) {
+		uint64_t file_size = (mock.end + size + MOCK_DRM_GROW_SIZE - 1) &
+				     ~((uint64_t)MOCK_DRM_GROW_SIZE - 1);
+		if (ftruncate(mock.fd, file_size))
+			return 0;
+		mock.file_size = file_size;
+	}
+
+	for (i = mock.free_hint; i < mock.num_resources; i++)
+		if (!mock.resources[i].used)
+			break;
+
+	if (i == mock.num_resources) {
+		uint32_t count = mock.num_resources ? mock.num_resources * 2 : 64;
+		res = realloc(mock.resources, count * sizeof(*res));
+		if (!res)
+			return 0;
+		memset(&res[mock.num_resources], 0, (count - mock.num_resources) * sizeof(*res));
+		mock.resources = res;
+		mock.num_resources = count;
+	}
+
+	res = &mock.resources[i];
+	res->used = 1;
+	res->offset = mock.end;
+	res->size = size;
+	res->stride = stride;
+	res->cpp = cpp ? cpp : 1;
+	res->host = NULL;
+
+	mock.end += size;
+	mock.free_hint = i + 1;
+	mock.stats.live_resources++;
+	mock.stats.live_bytes += size;
+
+	return i + 1;
+}
+
+static int mock_drm_free(uint32_t handle)
+{
+	struct mock_resource *res = mock_drm_lookup(handle);
+
+	if (!res)
+		return -ENOENT;
+
+	fallocate(mock.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, res->offset, res->size);
+	free(res->host);
+
+	mock.stats.live_resources--;
+	mock.stats.live_bytes -= res->size;
+	memset(res, 0, sizeof(*res));
+	if (handle - 1 < mock.free_hint)
+		mock.free_hint = handle - 1;
+
+	return 0;
+}
+
+/**
+ * Android-EMU:
+ * copy the rows of a box between the guest's backing and the host's copy,
+ * as the host would with its iovecs; rows are the box's width in the bytes
+ * per pixel of the first plane, which is exact for single-plane formats
+ */
+static int mock_drm_transfer(const struct drm_virtgpu_3d_transfer_to_host *xfer, int to_host)
+{
+	struct mock_resource *res = mock_drm_lookup(xfer->bo_handle);
+	uint32_t stride, row;
+	uint64_t offset, length;
+
+	if (!res)
+		return -ENOENT;
+
+	if (!res->host) {
+		res->host = calloc(1, res->size);
+		if (!res->host)
+			return -ENOMEM;
+	}
+
+	stride = xfer->stride ? xfer->stride : res->stride;
+	for (row = 0; row < xfer->box.h; row++) {
+		offset = xfer->offset + (uint64_t)(xfer->box.y + row) * stride +
+			 (uint64_t)xfer->box.x * res->cpp;
+		length = (uint64_t)xfer->box.w * res->cpp;
+		if (offset >= res->size)
+			break;
+		if (length > res->size - offset)
+			length = res->size - offset;
+
+		if (to_host)
+			pread(mock.fd, res->host + offset, length, res->offset + offset);
+		else
+			pwrite(mock.fd, res->host + offset, length, res->offset + offset);
+
+		mock.stats.transferred_bytes += length;
+	}
+
+	return 0;
+}
+
+static int mock_drm_getparam(struct drm_virtgpu_getparam *args)
+{
+	int value;
+
+	switch (args->param) {
+	case VIRTGPU_PARAM_3D_FEATURES:
+		value = mock.config.has_3d;
+		break;
+	case VIRTGPU_PARAM_CAPSET_QUERY_FIX:
+		value = 0;
+		break;
+	case VIRTGPU_PARAM_RESOURCE_BLOB:
+	case VIRTGPU_PARAM_HOST_VISIBLE:
+		value = mock.config.has_blob;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	*(int *)(uintptr_t)args->value = value;
+	return 0;
+}
+
+static int mock_drm_get_caps(struct drm_virtgpu_get_caps *args)
+{
+	size_t size = args->size;
+
+	if (args->cap_set_id == VIRGL_CAPSET_ANDROID_EMU_MODIFIERS && mock.config.has_blob &&
+	    mock.config.modifiers.num_modifiers) {
+		if (size > sizeof(mock.config.modifiers))
+			size = sizeof(mock.config.modifiers);
+
+		memcpy((void *)(uintptr_t)args->addr, &mock.config.modifiers, size);
+		return 0;
+	}
+
+	if (args->cap_set_id != 1 || !mock.config.has_3d)
+		return -EINVAL;
+
+	if (size > sizeof(mock.config.caps))
+		size = sizeof(mock.config.caps);
+
+	memcpy((void *)(uintptr_t)args->addr, &mock.config.caps, size);
+	return 0;
+}
+
+static int mock_drm_version(struct drm_version *version)
+{
+	size_t length = strlen(MOCK_DRM_NAME);
+
+	if (version->name && version->name_len)
+		memcpy(version->name, MOCK_DRM_NAME,
+		       version->name_len < length ? version->name_len : length);
+
+	version->version_major = 0;
+	version->version_minor = 1;
+	version->version_patchlevel = 0;
+	version->name_len = length;
+	version->date_len = 0;
+	version->desc_len = 0;
+	return 0;
+}
+
+static enum mock_drm_op mock_drm_classify(unsigned long request)
+{
+	switch (request) {
+	case DRM_IOCTL_VIRTGPU_RESOURCE_CREATE:
+	case DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB:
+	case DRM_IOCTL_MODE_CREATE_DUMB:
+		return MOCK_DRM_OP_CREATE;
+	case DRM_IOCTL_GEM_CLOSE:
+	case DRM_IOCTL_MODE_DESTROY_DUMB:
+		return MOCK_DRM_OP_DESTROY;
+	case DRM_IOCTL_VIRTGPU_MAP:
+	case DRM_IOCTL_MODE_MAP_DUMB:
+		return MOCK_DRM_OP_MAP;
+	case DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST:
+	case DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST:
+		return MOCK_DRM_OP_TRANSFER;
+	case DRM_IOCTL_VIRTGPU_WAIT:
+		return MOCK_DRM_OP_WAIT;
+	default:
+		return MOCK_DRM_OP_OTHER;
+	}
+}
+
+static int mock_drm_ioctl(unsigned long request, void *arg)
+{
+	struct mock_resource *res;
+	uint32_t handle;
+
+	switch (request) {
+	case DRM_IOCTL_VERSION:
+		return mock_drm_version(arg);
+	case DRM_IOCTL_VIRTGPU_GETPARAM:
+		return mock_drm_getparam(arg);
+	case DRM_IOCTL_VIRTGPU_GET_CAPS:
+		return mock_drm_get_caps(arg);
+	case DRM_IOCTL_VIRTGPU_RESOURCE_CREATE: {
+		struct drm_virtgpu_resource_create *args = arg;
+		uint32_t cpp = args->width ? args->stride / args->width : 1;
+
+		if (!mock.config.has_3d)
+			return -EINVAL;
+
+		handle = mock_drm_alloc(args->size, args->stride, cpp);
+		if (!handle)
+			return -ENOMEM;
+
+		args->bo_handle = handle;
+		args->res_handle = handle;
+		return 0;
+	}
+	case DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB: {
+		struct drm_virtgpu_resource_create_blob *args = arg;
+
+		if (!mock.config.has_blob)
+			return -EINVAL;
+
+		handle = mock_drm_alloc(args->size, 0, 1);
+		if (!handle)
+			return -ENOMEM;
+
+		args->bo_handle = handle;
+		args->res_handle = handle;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_CREATE_DUMB: {
+		struct drm_mode_create_dumb *args = arg;
+		uint32_t cpp = (args->bpp + 7) / 8;
+
+		args->pitch = args->width * cpp;
+		args->size = (uint64_t)args->pitch * args->height;
+		handle = mock_drm_alloc(args->size, args->pitch, cpp);
+		if (!handle)
+			return -ENOMEM;
+
+		args->handle = handle;
+		return 0;
+	}
+	case DRM_IOCTL_GEM_CLOSE:
+		return mock_drm_free(((struct drm_gem_close *)arg)->handle);
+	case DRM_IOCTL_MODE_DESTROY_DUMB:
+		return mock_drm_free(((struct drm_mode_destroy_dumb *)arg)->handle);
+	case DRM_IOCTL_VIRTGPU_MAP: {
+		struct drm_virtgpu_map *args = arg;
+
+		res = mock_drm_lookup(args->handle);
+		if (!res)
+			return -ENOENT;
+
+		args->offset = res->offset;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_MAP_DUMB: {
+		struct drm_mode_map_dumb *args = arg;
+
+		res = mock_drm_lookup(args->handle);
+		if (!res)
+			return -ENOENT;
+
+		args->offset = res->offset;
+		return 0;
+	}
+	case DRM_IOCTL_VIRTGPU_RESOURCE_INFO: {
+		struct drm_virtgpu_resource_info *args = arg;
+
+		res = mock_drm_lookup(args->bo_handle);
+		if (!res)
+			return -ENOENT;
+
+		args->res_handle = args->bo_handle;
+		args->size = res->size;
+		return 0;
+	}
+	case DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST:
+		return mock_drm_transfer(arg, 1);
+	case DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST:
+		return mock_drm_transfer(arg, 0);
+	case DRM_IOCTL_VIRTGPU_WAIT:
+		// Android-EMU: the host copies synchronously, nothing is ever busy
+		res = mock_drm_lookup(((struct drm_virtgpu_3d_wait *)arg)->handle);
+		return res ? 0 : -ENOENT;
+	case DRM_IOCTL_VIRTGPU_EXECBUFFER: {
+		struct drm_virtgpu_execbuffer *args = arg;
+
+		if (args->flags & VIRTGPU_EXECBUF_FENCE_FD_OUT)
+			args->fence_fd = -1;
+		return 0;
+	}
+	default:
+		// Android-EMU: no dma-bufs, the file is the only thing the device can map
+		return -ENOTTY;
+	}
+}
+
+/**
+ * Android-EMU:
+ * libdrm's drmIoctl(), answering the calls on the mock device and passing
+ * the others to the kernel; the executable defines it ahead of libdrm's
+ */
+int drmIoctl(int fd, unsigned long request, void *arg)
+{
+	enum mock_drm_op op;
+	uint64_t latency;
+	int ret;
+
+	pthread_mutex_lock(&mock.lock);
+	if (fd < 0 || fd != mock.fd) {
+		pthread_mutex_unlock(&mock.lock);
+		do {
+			ret = ioctl(fd, request, arg);
+		} while (ret == -1 && (errno == EINTR || errno == EAGAIN));
+		return ret;
+	}
+
+	op = mock_drm_classify(request);
+	mock.stats.calls[op]++;
+	latency = mock.config.latency_ns[op];
+	ret = mock_drm_ioctl(request, arg);
+	pthread_mutex_unlock(&mock.lock);
+
+	// Android-EMU: the latency is spent outside the lock, like a real ioctl sleeps
+	mock_drm_delay(latency);
+
+	if (ret) {
+		errno = -ret;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Android-EMU: end of modification */
@@ -0,0 +1,69 @@
+/*
+ * Copyright 2014 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/* Android-EMU: start of modification */
+
+#ifndef MOCK_DRM_H
+#define MOCK_DRM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "virgl_hw.h"
+
+/**
+ * Android-EMU:
+ * a virtio-gpu device in userspace: drmIoctl() calls on its fd are answered
+ * from memory, and the buffers live in one shmem file the fd refers to, so
+ * the driver's mmap() calls work unchanged
+ */
+
+// the ioctls the latency of the device is configured for
+enum mock_drm_op {
+	MOCK_DRM_OP_CREATE,   /* RESOURCE_CREATE, RESOURCE_CREATE_BLOB, MODE_CREATE_DUMB */
+	MOCK_DRM_OP_DESTROY,  /* GEM_CLOSE, MODE_DESTROY_DUMB */
+	MOCK_DRM_OP_MAP,      /* VIRTGPU_MAP, MODE_MAP_DUMB */
+	MOCK_DRM_OP_TRANSFER, /* TRANSFER_TO_HOST, TRANSFER_FROM_HOST */
+	MOCK_DRM_OP_WAIT,     /* VIRTGPU_WAIT */
+	MOCK_DRM_OP_OTHER,
+	MOCK_DRM_OP_COUNT,
+};
+
+struct mock_drm_config {
+	bool has_3d;
+	bool has_blob;
+	union virgl_caps caps;
+	struct virgl_caps_modifiers modifiers; /* offered with blob support */
+	uint64_t latency_ns[MOCK_DRM_OP_COUNT];
+};
+
+struct mock_drm_stats {
+	uint64_t calls[MOCK_DRM_OP_COUNT];
+	uint64_t live_resources;
+	uint64_t live_bytes;
+	uint64_t transferred_bytes;
+};
+
+void mock_drm_config_init(struct mock_drm_config *config);
+
+void mock_drm_config_format(struct mock_drm_config *config, uint32_t virgl_format, bool sampler,
+			    bool render);
+
+int mock_drm_parse_latency(struct mock_drm_config *config, const char *spec);
+
+const char *mock_drm_op_name(enum mock_drm_op op);
+
+int mock_drm_open(const struct mock_drm_config *config);
+
+void mock_drm_close(int fd);
+
+void mock_drm_get_stats(struct mock_drm_stats *stats);
+
+void mock_drm_reset_stats(void);
+
+#endif
+
+/* Android-EMU: end of modification */
@@ -0,0 +1,1112 @@
+/*
+ * Copyright 2014 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/* Android-EMU: start of modification */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DRV_CONVERT_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define DRV_CONVERT_NEON
+#endif
+
+#include "drv_convert.h"
+#include "helpers.h"
+#include "util.h"
+
+/*
+ * YUV is BT.601 limited range. The coefficients are scaled by 64 for YUV to
+ * RGB and by 256 for RGB to YUV, so every kernel computes in 16-bit lanes and
+ * the SIMD kernels give the same results as the scalar ones.
+ */
+#define YUV_Y_SCALE 75   /* 1.164 */
+#define YUV_Y_BIAS 1168  /* 16 * 75 - 32, the rounding of >> 6 */
+#define YUV_RV 102       /* 1.596 */
+#define YUV_GU 25        /* 0.391 */
+#define YUV_GV 52        /* 0.813 */
+#define YUV_BU 129       /* 2.018 */
+
+// the planes of a YUV 4:2:0 image; semi-planar chroma has a step of 2
+struct yuv_planes {
+	uint8_t *y;
+	uint8_t *u;
+	uint8_t *v;
+	uint32_t y_stride;
+	uint32_t chroma_stride;
+	uint32_t chroma_step;
+};
+
+struct convert_kernels {
+	void (*interleave)(const uint8_t *a, const uint8_t *b, uint8_t *ab, uint32_t n);
+	void (*deinterleave)(const uint8_t *ab, uint8_t *a, uint8_t *b, uint32_t n);
+	void (*yuv_to_rgba)(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *rgba,
+			    uint32_t width);
+	void (*rgba_to_y)(const uint8_t *rgba, uint8_t *y, uint32_t width);
+	void (*rgba_to_uv)(const uint8_t *rgba0, const uint8_t *rgba1, uint8_t *u, uint8_t *v,
+			   uint32_t width);
+	void (*downscale_2x2)(const uint8_t *row0, const uint8_t *row1, uint8_t *out,
+			      uint32_t width);
+	void (*swap_rb)(const uint8_t *src, uint8_t *dst, uint32_t n);
+};
+
+static inline uint8_t clamp_u8(int value)
+{
+	return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+static void interleave_c(const uint8_t *a, const uint8_t *b, uint8_t *ab, uint32_t n)
+{
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		ab[2 * i] = a[i];
+		ab[2 * i + 1] = b[i];
+	}
+}
+
+static void deinterleave_c(const uint8_t *ab, uint8_t *a, uint8_t *b, uint32_t n)
+{
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		a[i] = ab[2 * i];
+		b[i] = ab[2 * i + 1];
+	}
+}
+
+static void yuv_to_rgba_c(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *rgba,
+			  uint32_t width)
+{
+	uint32_t x;
+
+	for (x = 0; x < width; x++) {
+		int c = y[x] * YUV_Y_SCALE - YUV_Y_BIAS;
+		int d = u[x / 2] - 128;
+		int e = v[x / 2] - 128;
+
+		rgba[4 * x] = clamp_u8((c + YUV_RV * e) >> 6);
+		rgba[4 * x + 1] = clamp_u8((c - YUV_GU * d - YUV_GV * e) >> 6);
+		rgba[4 * x + 2] = clamp_u8((c + YUV_BU * d) >> 6);
+		rgba[4 * x + 3] = 0xff;
+	}
+}
+
+static void rgba_to_y_c(const uint8_t *rgba, uint8_t *y, uint32_t width)
+{
+	uint32_t x;
+
+	for (x = 0; x < width; x++)
+		y[x] = ((66 * rgba[4 * x] + 129 * rgba[4 * x + 1] + 25 * rgba[4 * x + 2] + 128) >> 8) +
+		       16;
+}
+
+// one chroma sample per 2x2 block; an odd last column is averaged with itself
+static void rgba_to_uv_c(const uint8_t *rgba0, const uint8_t *rgba1, uint8_t *u, uint8_t *v,
+			 uint32_t width)
+{
+	uint32_t x, x1;
+
+	for (x = 0; x < width; x += 2) {
+		int r, g, b;
+
+		x1 = (x + 1 < width) ? x + 1 : x;
+		r = (rgba0[4 * x] + rgba0[4 * x1] + rgba1[4 * x] + rgba1[4 * x1] + 2) >> 2;
+		g = (rgba0[4 * x + 1] + rgba0[4 * x1 + 1] + rgba1[4 * x + 1] + rgba1[4 * x1 + 1] + 2) >> 2;
+		b = (rgba0[4 * x + 2] + rgba0[4 * x1 + 2] + rgba1[4 * x + 2] + rgba1[4 * x1 + 2] + 2) >> 2;
+
+		u[x / 2] = ((112 * b - 38 * r - 74 * g + 128) >> 8) + 128;
+		v[x / 2] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+	}
+}
+
+// width pixels of 32 bits, each the rounded average of a 2x2 block of two rows
+static void downscale_2x2_c(const uint8_t *row0, const uint8_t *row1, uint8_t *out,
+			    uint32_t width)
+{
+	uint32_t x, c;
+
+	for (x = 0; x < width; x++) {
+		for (c = 0; c < 4; c++)
+			out[4 * x + c] = (row0[8 * x + c] + row0[8 * x + 4 + c] + row1[8 * x + c] +
+					  row1[8 * x + 4 + c] + 2) >> 2;
+	}
+}
+
+// swap the first and third byte of n pixels of 32 bits, src may be dst
+static void swap_rb_c(const uint8_t *src, uint8_t *dst, uint32_t n)
+{
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		uint8_t r = src[4 * i], g = src[4 * i + 1], b = src[4 * i + 2], a = src[4 * i + 3];
+
+		dst[4 * i] = b;
+		dst[4 * i + 1] = g;
+		dst[4 * i + 2] = r;
+		dst[4 * i + 3] = a;
+	}
+}
+
+#ifdef DRV_CONVERT_X86
+
+__attribute__((target("sse4.1"))) static void interleave_sse41(const uint8_t *a, const uint8_t *b,
+							       uint8_t *ab, uint32_t n)
+{
+	uint32_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+
+		_mm_storeu_si128((__m128i *)(ab + 2 * i), _mm_unpacklo_epi8(va, vb));
+		_mm_storeu_si128((__m128i *)(ab + 2 * i + 16), _mm_unpackhi_epi8(va, vb));
+	}
+
+	interleave_c(a + i, b + i, ab + 2 * i, n - i);
+}
+
+__attribute__((target("sse4.1"))) static void deinterleave_sse41(const uint8_t *ab, uint8_t *a,
+								 uint8_t *b, uint32_t n)
+{
+	const __m128i low = _mm_set1_epi16(0x00ff);
+	uint32_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i v0 = _mm_loadu_si128((const __m128i *)(ab + 2 * i));
+		__m128i v1 = _mm_loadu_si128((const __m128i *)(ab + 2 * i + 16));
+
+		_mm_storeu_si128((__m128i *)(a + i), _mm_packus_epi16(_mm_and_si128(v0, low),
+								      _mm_and_si128(v1, low)));
+		_mm_storeu_si128((__m128i *)(b + i),
+				 _mm_packus_epi16(_mm_srli_epi16(v0, 8), _mm_srli_epi16(v1, 8)));
+	}
+
+	deinterleave_c(ab + 2 * i, a + i, b + i, n - i);
+}
+
+// R, G, B of 8 pixels as signed 16-bit lanes, before the final >> 6
+__attribute__((target("sse4.1"))) static inline void yuv_to_rgb_sse41(__m128i y, __m128i u,
+								      __m128i v, __m128i *r,
+								      __m128i *g, __m128i *b)
+{
+	__m128i c = _mm_sub_epi16(_mm_mullo_epi16(y, _mm_set1_epi16(YUV_Y_SCALE)),
+				  _mm_set1_epi16(YUV_Y_BIAS));
+	__m128i d = _mm_sub_epi16(u, _mm_set1_epi16(128));
+	__m128i e = _mm_sub_epi16(v, _mm_set1_epi16(128));
+
+	*r = _mm_srai_epi16(_mm_adds_epi16(c, _mm_mullo_epi16(e, _mm_set1_epi16(YUV_RV))), 6);
+	*g = _mm_srai_epi16(_mm_subs_epi16(_mm_subs_epi16(c, _mm_mullo_epi16(d, _mm_set1_epi16(YUV_GU))),
+					   _mm_mullo_epi16(e, _mm_set1_epi16(YUV_GV))),
+			    6);
+	*b = _mm_srai_epi16(_mm_adds_epi16(c, _mm_mullo_epi16(d, _mm_set1_epi16(YUV_BU))), 6);
+}
+
+__attribute__((target("sse4.1"))) static void yuv_to_rgba_sse41(const uint8_t *y, const uint8_t *u,
+								const uint8_t *v, uint8_t *rgba,
+								uint32_t width)
+{
+	const __m128i alpha = _mm_set1_epi8((char)0xff);
+	uint32_t x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		__m128i yy = _mm_loadu_si128((const __m128i *)(y + x));
+		__m128i uu = _mm_loadl_epi64((const __m128i *)(u + x / 2));
+		__m128i vv = _mm_loadl_epi64((const __m128i *)(v + x / 2));
+		__m128i r0, g0, b0, r1, g1, b1, r, g, b, rg, ba;
+
+		// every chroma sample covers two pixels
+		uu = _mm_unpacklo_epi8(uu, uu);
+		vv = _mm_unpacklo_epi8(vv, vv);
+
+		yuv_to_rgb_sse41(_mm_cvtepu8_epi16(yy), _mm_cvtepu8_epi16(uu), _mm_cvtepu8_epi16(vv),
+				 &r0, &g0, &b0);
+		yuv_to_rgb_sse41(_mm_cvtepu8_epi16(_mm_srli_si128(yy, 8)),
+				 _mm_cvtepu8_epi16(_mm_srli_si128(uu, 8)),
+				 _mm_cvtepu8_epi16(_mm_srli_si128(vv, 8)), &r1, &g1, &b1);
+
+		r = _mm_packus_epi16(r0, r1);
+		g = _mm_packus_epi16(g0, g1);
+		b = _mm_packus_epi16(b0, b1);
+
+		rg = _mm_unpacklo_epi8(r, g);
+		ba = _mm_unpacklo_epi8(b, alpha);
+		_mm_storeu_si128((__m128i *)(rgba + 4 * x), _mm_unpacklo_epi16(rg, ba));
+		_mm_storeu_si128((__m128i *)(rgba + 4 * x + 16), _mm_unpackhi_epi16(rg, ba));
+
+		rg = _mm_unpackhi_epi8(r, g);
+		ba = _mm_unpackhi_epi8(b, alpha);
+		_mm_storeu_si128((__m128i *)(rgba + 4 * x + 32), _mm_unpacklo_epi16(rg, ba));
+		_mm_storeu_si128((__m128i *)(rgba + 4 * x + 48), _mm_unpackhi_epi16(rg, ba));
+	}
+
+	yuv_to_rgba_c(y + x, u + x / 2, v + x / 2, rgba + 4 * x, width - x);
+}
+
+// R, G, B of 8 RGBA pixels as unsigned 16-bit lanes
+__attribute__((target("sse4.1"))) static inline void rgba_unpack_sse41(const uint8_t *rgba,
+								       __m128i *r, __m128i *g,
+								       __m128i *b)
+{
+	const __m128i low = _mm_set1_epi32(0xff);
+	__m128i p0 = _mm_loadu_si128((const __m128i *)rgba);
+	__m128i p1 = _mm_loadu_si128((const __m128i *)(rgba + 16));
+
+	*r = _mm_packus_epi32(_mm_and_si128(p0, low), _mm_and_si128(p1, low));
+	*g = _mm_packus_epi32(_mm_and_si128(_mm_srli_epi32(p0, 8), low),
+			      _mm_and_si128(_mm_srli_epi32(p1, 8), low));
+	*b = _mm_packus_epi32(_mm_and_si128(_mm_srli_epi32(p0, 16), low),
+			      _mm_and_si128(_mm_srli_epi32(p1, 16), low));
+}
+
+__attribute__((target("sse4.1"))) static inline __m128i rgb_to_y_sse41(__m128i r, __m128i g,
+								       __m128i b)
+{
+	__m128i y = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(66)),
+				  _mm_mullo_epi16(g, _mm_set1_epi16(129)));
+
+	y = _mm_add_epi16(y, _mm_mullo_epi16(b, _mm_set1_epi16(25)));
+	y = _mm_srli_epi16(_mm_add_epi16(y, _mm_set1_epi16(128)), 8);
+	return _mm_add_epi16(y, _mm_set1_epi16(16));
+}
+
+__attribute__((target("sse4.1"))) static void rgba_to_y_sse41(const uint8_t *rgba, uint8_t *y,
+							      uint32_t width)
+{
+	uint32_t x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		__m128i r0, g0, b0, r1, g1, b1;
+
+		rgba_unpack_sse41(rgba + 4 * x, &r0, &g0, &b0);
+		rgba_unpack_sse41(rgba + 4 * x + 32, &r1, &g1, &b1);
+		_mm_storeu_si128((__m128i *)(y + x), _mm_packus_epi16(rgb_to_y_sse41(r0, g0, b0),
+								      rgb_to_y_sse41(r1, g1, b1)));
+	}
+
+	rgba_to_y_c(rgba + 4 * x, y + x, width - x);
+}
+
+// the rounded average of the 2x2 blocks of 16 pixels of two rows
+__attribute__((target("sse4.1"))) static inline __m128i average_2x2_sse41(__m128i a0, __m128i a1,
+									  __m128i b0, __m128i b1)
+{
+	__m128i sum = _mm_add_epi16(_mm_hadd_epi16(a0, a1), _mm_hadd_epi16(b0, b1));
+
+	return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(2)), 2);
+}
+
+__attribute__((target("sse4.1"))) static void rgba_to_uv_sse41(const uint8_t *rgba0,
+							       const uint8_t *rgba1, uint8_t *u,
+							       uint8_t *v, uint32_t width)
+{
+	uint32_t x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		__m128i r00, g00, b00, r01, g01, b01, r10, g10, b10, r11, g11, b11;
+		__m128i r, g, b, uu, vv, uv;
+
+		rgba_unpack_sse41(rgba0 + 4 * x, &r00, &g00, &b00);
+		rgba_unpack_sse41(rgba0 + 4 * x + 32, &r01, &g01, &b01);
+		rgba_unpack_sse41(rgba1 + 4 * x, &r10, &g10, &b10);
+		rgba_unpack_sse41(rgba1 + 4 * x + 32, &r11, &g11, &b11);
+
+		r = average_2x2_sse41(r00, r01, r10, r11);
+		g = average_2x2_sse41(g00, g01, g10, g11);
+		b = average_2x2_sse41(b00, b01, b10, b11);
+
+		uu = _mm_sub_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(112)),
+				   _mm_mullo_epi16(r, _mm_set1_epi16(38)));
+		uu = _mm_sub_epi16(uu, _mm_mullo_epi16(g, _mm_set1_epi16(74)));
+		uu = _mm_srai_epi16(_mm_add_epi16(uu, _mm_set1_epi16(128)), 8);
+
+		vv = _mm_sub_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(112)),
+				   _mm_mullo_epi16(g, _mm_set1_epi16(94)));
+		vv = _mm_sub_epi16(vv, _mm_mullo_epi16(b, _mm_set1_epi16(18)));
+		vv = _mm_srai_epi16(_mm_add_epi16(vv, _mm_set1_epi16(128)), 8);
+
+		uv = _mm_packus_epi16(_mm_add_epi16(uu, _mm_set1_epi16(128)),
+				      _mm_add_epi16(vv, _mm_set1_epi16(128)));
+		_mm_storel_epi64((__m128i *)(u + x / 2), uv);
+		_mm_storel_epi64((__m128i *)(v + x / 2), _mm_srli_si128(uv, 8));
+	}
+
+	rgba_to_uv_c(rgba0 + 4 * x, rgba1 + 4 * x, u + x / 2, v + x / 2, width - x);
+}
+
+__attribute__((target("avx2"))) static void interleave_avx2(const uint8_t *a, const uint8_t *b,
+							    uint8_t *ab, uint32_t n)
+{
+	uint32_t i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		__m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+		__m256i lo = _mm256_unpacklo_epi8(va, vb);
+		__m256i hi = _mm256_unpackhi_epi8(va, vb);
+
+		// the unpacks work within 128-bit lanes, put the lanes back in order
+		_mm256_storeu_si256((__m256i *)(ab + 2 * i), _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *)(ab + 2 * i + 32),
+				    _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+
+	interleave_sse41(a + i, b + i, ab + 2 * i, n - i);
+}
+
+__attribute__((target("avx2"))) static void deinterleave_avx2(const uint8_t *ab, uint8_t *a,
+							      uint8_t *b, uint32_t n)
+{
+	const __m256i low = _mm256_set1_epi16(0x00ff);
+	uint32_t i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		__m256i v0 = _mm256_loadu_si256((const __m256i *)(ab + 2 * i));
+		__m256i v1 = _mm256_loadu_si256((const __m256i *)(ab + 2 * i + 32));
+		__m256i va = _mm256_packus_epi16(_mm256_and_si256(v0, low), _mm256_and_si256(v1, low));
+		__m256i vb = _mm256_packus_epi16(_mm256_srli_epi16(v0, 8), _mm256_srli_epi16(v1, 8));
+
+		_mm256_storeu_si256((__m256i *)(a + i), _mm256_permute4x64_epi64(va, 0xd8));
+		_mm256_storeu_si256((__m256i *)(b + i), _mm256_permute4x64_epi64(vb, 0xd8));
+	}
+
+	deinterleave_sse41(ab + 2 * i, a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2"))) static inline void yuv_to_rgb_avx2(__m256i y, __m256i u,
+								   __m256i v, __m256i *r,
+								   __m256i *g, __m256i *b)
+{
+	__m256i c = _mm256_sub_epi16(_mm256_mullo_epi16(y, _mm256_set1_epi16(YUV_Y_SCALE)),
+				     _mm256_set1_epi16(YUV_Y_BIAS));
+	__m256i d = _mm256_sub_epi16(u, _mm256_set1_epi16(128));
+	__m256i e = _mm256_sub_epi16(v, _mm256_set1_epi16(128));
+
+	*r = _mm256_srai_epi16(
+	    _mm256_adds_epi16(c, _mm256_mullo_epi16(e, _mm256_set1_epi16(YUV_RV))), 6);
+	*g = _mm256_srai_epi16(
+	    _mm256_subs_epi16(_mm256_subs_epi16(c, _mm256_mullo_epi16(d, _mm256_set1_epi16(YUV_GU))),
+			      _mm256_mullo_epi16(e, _mm256_set1_epi16(YUV_GV))),
+	    6);
+	*b = _mm256_srai_epi16(
+	    _mm256_adds_epi16(c, _mm256_mullo_epi16(d, _mm256_set1_epi16(YUV_BU))), 6);
+}
+
+__attribute__((target("avx2"))) static void yuv_to_rgba_avx2(const uint8_t *y, const uint8_t *u,
+							     const uint8_t *v, uint8_t *rgba,
+							     uint32_t width)
+{
+	const __m256i alpha = _mm256_set1_epi8((char)0xff);
+	uint32_t x;
+
+	for (x = 0; x + 32 <= width; x += 32) {
+		__m256i yy = _mm256_loadu_si256((const __m256i *)(y + x));
+		__m128i uu = _mm_loadu_si128((const __m128i *)(u + x / 2));
+		__m128i vv = _mm_loadu_si128((const __m128i *)(v + x / 2));
+		__m256i r0, g0, b0, r1, g1, b1, r, g, b, rg, ba, p0, p1, p2, p3;
+
+		yuv_to_rgb_avx2(_mm256_cvtepu8_epi16(_mm256_castsi256_si128(yy)),
+				_mm256_cvtepu8_epi16(_mm_unpacklo_epi8(uu, uu)),
+				_mm256_cvtepu8_epi16(_mm_unpacklo_epi8(vv, vv)), &r0, &g0, &b0);
+		yuv_to_rgb_avx2(_mm256_cvtepu8_epi16(_mm256_extracti128_si256(yy, 1)),
+				_mm256_cvtepu8_epi16(_mm_unpackhi_epi8(uu, uu)),
+				_mm256_cvtepu8_epi16(_mm_unpackhi_epi8(vv, vv)), &r1, &g1, &b1);
+
+		r = _mm256_permute4x64_epi64(_mm256_packus_epi16(r0, r1), 0xd8);
+		g = _mm256_permute4x64_epi64(_mm256_packus_epi16(g0, g1), 0xd8);
+		b = _mm256_permute4x64_epi64(_mm256_packus_epi16(b0, b1), 0xd8);
+
+		// pixels 0-7 and 16-23, then 8-15 and 24-31
+		rg = _mm256_unpacklo_epi8(r, g);
+		ba = _mm256_unpacklo_epi8(b, alpha);
+		p0 = _mm256_unpacklo_epi16(rg, ba);
+		p1 = _mm256_unpackhi_epi16(rg, ba);
+		rg = _mm256_unpackhi_epi8(r, g);
+		ba = _mm256_unpackhi_epi8(b, alpha);
+		p2 = _mm256_unpacklo_epi16(rg, ba);
+		p3 = _mm256_unpackhi_epi16(rg, ba);
+
+		_mm256_storeu_si256((__m256i *)(rgba + 4 * x), _mm256_permute2x128_si256(p0, p1, 0x20));
+		_mm256_storeu_si256((__m256i *)(rgba + 4 * x + 32),
+				    _mm256_permute2x128_si256(p2, p3, 0x20));
+		_mm256_storeu_si256((__m256i *)(rgba + 4 * x + 64),
+				    _mm256_permute2x128_si256(p0, p1, 0x31));
+		_mm256_storeu_si256((__m256i *)(rgba + 4 * x + 96),
+				    _mm256_permute2x128_si256(p2, p3, 0x31));
+	}
+
+	yuv_to_rgba_sse41(y + x, u + x / 2, v + x / 2, rgba + 4 * x, width - x);
+}
+
+// the 2x2 sums of two source pixels of each row in the low four 16-bit lanes
+__attribute__((target("sse4.1"))) static inline __m128i sum_2x2_sse41(__m128i a, __m128i b)
+{
+	__m128i sum = _mm_add_epi16(a, b);
+
+	return _mm_add_epi16(sum, _mm_srli_si128(sum, 8));
+}
+
+__attribute__((target("sse4.1"))) static void downscale_2x2_sse41(const uint8_t *row0,
+								  const uint8_t *row1,
+								  uint8_t *out, uint32_t width)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi16(2);
+	uint32_t x;
+
+	for (x = 0; x + 4 <= width; x += 4) {
+		__m128i a0 = _mm_loadu_si128((const __m128i *)(row0 + 8 * x));
+		__m128i a1 = _mm_loadu_si128((const __m128i *)(row0 + 8 * x + 16));
+		__m128i b0 = _mm_loadu_si128((const __m128i *)(row1 + 8 * x));
+		__m128i b1 = _mm_loadu_si128((const __m128i *)(row1 + 8 * x + 16));
+		__m128i lo, hi;
+
+		lo = _mm_unpacklo_epi64(
+		    sum_2x2_sse41(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(b0, zero)),
+		    sum_2x2_sse41(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(b0, zero)));
+		hi = _mm_unpacklo_epi64(
+		    sum_2x2_sse41(_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(b1, zero)),
+		    sum_2x2_sse41(_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(b1, zero)));
+
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 2);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 2);
+		_mm_storeu_si128((__m128i *)(out + 4 * x), _mm_packus_epi16(lo, hi));
+	}
+
+	downscale_2x2_c(row0 + 8 * x, row1 + 8 * x, out + 4 * x, width - x);
+}
+
+__attribute__((target("sse4.1"))) static void swap_rb_sse41(const uint8_t *src, uint8_t *dst,
+							    uint32_t n)
+{
+	const __m128i order = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+	uint32_t i;
+
+	for (i = 0; i + 4 <= n; i += 4)
+		_mm_storeu_si128((__m128i *)(dst + 4 * i),
+				 _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 4 * i)),
+						  order));
+
+	swap_rb_c(src + 4 * i, dst + 4 * i, n - i);
+}
+
+#endif
+
+#ifdef DRV_CONVERT_NEON
+
+static void interleave_neon(const uint8_t *a, const uint8_t *b, uint8_t *ab, uint32_t n)
+{
+	uint32_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		uint8x16x2_t pairs;
+
+		pairs.val[0] = vld1q_u8(a + i);
+		pairs.val[1] = vld1q_u8(b + i);
+		vst2q_u8(ab + 2 * i, pairs);
+	}
+
+	interleave_c(a + i, b + i, ab + 2 * i, n - i);
+}
+
+static void deinterleave_neon(const uint8_t *ab, uint8_t *a, uint8_t *b, uint32_t n)
+{
+	uint32_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		uint8x16x2_t pairs = vld2q_u8(ab + 2 * i);
+
+		vst1q_u8(a + i, pairs.val[0]);
+		vst1q_u8(b + i, pairs.val[1]);
+	}
+
+	deinterleave_c(ab + 2 * i, a + i, b + i, n - i);
+}
+
+// R, G, B of 8 pixels as signed 16-bit lanes, before the final >> 6
+static inline void yuv_to_rgb_neon(int16x8_t y, int16x8_t u, int16x8_t v, int16x8_t *r,
+				   int16x8_t *g, int16x8_t *b)
+{
+	int16x8_t c = vsubq_s16(vmulq_n_s16(y, YUV_Y_SCALE), vdupq_n_s16(YUV_Y_BIAS));
+	int16x8_t d = vsubq_s16(u, vdupq_n_s16(128));
+	int16x8_t e = vsubq_s16(v, vdupq_n_s16(128));
+
+	*r = vqaddq_s16(c, vmulq_n_s16(e, YUV_RV));
+	*g = vqsubq_s16(vqsubq_s16(c, vmulq_n_s16(d, YUV_GU)), vmulq_n_s16(e, YUV_GV));
+	*b = vqaddq_s16(c, vmulq_n_s16(d, YUV_BU));
+}
+
+static void yuv_to_rgba_neon(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *rgba,
+			     uint32_t width)
+{
+	uint32_t x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		uint8x16_t yy = vld1q_u8(y + x);
+		uint8x8x2_t uu = vzip_u8(vld1_u8(u + x / 2), vld1_u8(u + x / 2));
+		uint8x8x2_t vv = vzip_u8(vld1_u8(v + x / 2), vld1_u8(v + x / 2));
+		int16x8_t r0, g0, b0, r1, g1, b1;
+		uint8x16x4_t out;
+
+		yuv_to_rgb_neon(vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(yy))),
+				vreinterpretq_s16_u16(vmovl_u8(uu.val[0])),
+				vreinterpretq_s16_u16(vmovl_u8(vv.val[0])), &r0, &g0, &b0);
+		yuv_to_rgb_neon(vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(yy))),
+				vreinterpretq_s16_u16(vmovl_u8(uu.val[1])),
+				vreinterpretq_s16_u16(vmovl_u8(vv.val[1])), &r1, &g1, &b1);
+
+		out.val[0] = vcombine_u8(vqshrun_n_s16(r0, 6), vqshrun_n_s16(r1, 6));
+		out.val[1] = vcombine_u8(vqshrun_n_s16(g0, 6), vqshrun_n_s16(g1, 6));
+		out.val[2] = vcombine_u8(vqshrun_n_s16(b0, 6), vqshrun_n_s16(b1, 6));
+		out.val[3] = vdupq_n_u8(0xff);
+		vst4q_u8(rgba + 4 * x, out);
+	}
+
+	yuv_to_rgba_c(y + x, u + x / 2, v + x / 2, rgba + 4 * x, width - x);
+}
+
+static inline uint8x8_t rgb_to_y_neon(uint8x8_t r, uint8x8_t g, uint8x8_t b)
+{
+	uint16x8_t y = vmull_u8(r, vdup_n_u8(66));
+
+	y = vmlal_u8(y, g, vdup_n_u8(129));
+	y = vmlal_u8(y, b, vdup_n_u8(25));
+	return vadd_u8(vshrn_n_u16(vaddq_u16(y, vdupq_n_u16(128)), 8), vdup_n_u8(16));
+}
+
+static void rgba_to_y_neon(const uint8_t *rgba, uint8_t *y, uint32_t width)
+{
+	uint32_t x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		uint8x16x4_t p = vld4q_u8(rgba + 4 * x);
+
+		vst1q_u8(y + x, vcombine_u8(rgb_to_y_neon(vget_low_u8(p.val[0]),
+							  vget_low_u8(p.val[1]),
+							  vget_low_u8(p.val[2])),
+					    rgb_to_y_neon(vget_high_u8(p.val[0]),
+							  vget_high_u8(p.val[1]),
+							  vget_high_u8(p.val[2]))));
+	}
+
+	rgba_to_y_c(rgba + 4 * x, y + x, width - x);
+}
+
+// the rounded average of the 2x2 blocks of 16 pixels of two rows
+static inline int16x8_t average_2x2_neon(uint8x16_t a, uint8x16_t b)
+{
+	uint16x8_t sum = vaddq_u16(vpaddlq_u8(a), vpaddlq_u8(b));
+
+	return vreinterpretq_s16_u16(vshrq_n_u16(vaddq_u16(sum, vdupq_n_u16(2)), 2));
+}
+
+static void rgba_to_uv_neon(const uint8_t *rgba0, const uint8_t *rgba1, uint8_t *u, uint8_t *v,
+			    uint32_t width)
+{
+	uint32_t x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		uint8x16x4_t p0 = vld4q_u8(rgba0 + 4 * x);
+		uint8x16x4_t p1 = vld4q_u8(rgba1 + 4 * x);
+		int16x8_t r = average_2x2_neon(p0.val[0], p1.val[0]);
+		int16x8_t g = average_2x2_neon(p0.val[1], p1.val[1]);
+		int16x8_t b = average_2x2_neon(p0.val[2], p1.val[2]);
+		int16x8_t uu, vv;
+
+		uu = vsubq_s16(vsubq_s16(vmulq_n_s16(b, 112), vmulq_n_s16(r, 38)), vmulq_n_s16(g, 74));
+		vv = vsubq_s16(vsubq_s16(vmulq_n_s16(r, 112), vmulq_n_s16(g, 94)), vmulq_n_s16(b, 18));
+		uu = vaddq_s16(vshrq_n_s16(vaddq_s16(uu, vdupq_n_s16(128)), 8), vdupq_n_s16(128));
+		vv = vaddq_s16(vshrq_n_s16(vaddq_s16(vv, vdupq_n_s16(128)), 8), vdupq_n_s16(128));
+
+		vst1_u8(u + x / 2, vqmovun_s16(uu));
+		vst1_u8(v + x / 2, vqmovun_s16(vv));
+	}
+
+	rgba_to_uv_c(rgba0 + 4 * x, rgba1 + 4 * x, u + x / 2, v + x / 2, width - x);
+}
+
+static void downscale_2x2_neon(const uint8_t *row0, const uint8_t *row1, uint8_t *out,
+			       uint32_t width)
+{
+	uint32_t x;
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		uint8x16x4_t a = vld4q_u8(row0 + 8 * x);
+		uint8x16x4_t b = vld4q_u8(row1 + 8 * x);
+		uint8x8x4_t o;
+
+		o.val[0] = vrshrn_n_u16(vaddq_u16(vpaddlq_u8(a.val[0]), vpaddlq_u8(b.val[0])), 2);
+		o.val[1] = vrshrn_n_u16(vaddq_u16(vpaddlq_u8(a.val[1]), vpaddlq_u8(b.val[1])), 2);
+		o.val[2] = vrshrn_n_u16(vaddq_u16(vpaddlq_u8(a.val[2]), vpaddlq_u8(b.val[2])), 2);
+		o.val[3] = vrshrn_n_u16(vaddq_u16(vpaddlq_u8(a.val[3]), vpaddlq_u8(b.val[3])), 2);
+		vst4_u8(out + 4 * x, o);
+	}
+
+	downscale_2x2_c(row0 + 8 * x, row1 + 8 * x, out + 4 * x, width - x);
+}
+
+static void swap_rb_neon(const uint8_t *src, uint8_t *dst, uint32_t n)
+{
+	uint32_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		uint8x16x4_t p = vld4q_u8(src + 4 * i);
+		uint8x16_t r = p.val[0];
+
+		p.val[0] = p.val[2];
+		p.val[2] = r;
+		vst4q_u8(dst + 4 * i, p);
+	}
+
+	swap_rb_c(src + 4 * i, dst + 4 * i, n - i);
+}
+
+#endif
+
+static struct convert_kernels kernels = {
+	interleave_c, deinterleave_c, yuv_to_rgba_c, rgba_to_y_c, rgba_to_uv_c, downscale_2x2_c,
+	swap_rb_c,
+};
+
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+// pick the widest kernels the CPU runs, once per process
+static void kernels_init(void)
+{
+#if defined(DRV_CONVERT_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.1")) {
+		kernels.interleave = interleave_sse41;
+		kernels.deinterleave = deinterleave_sse41;
+		kernels.yuv_to_rgba = yuv_to_rgba_sse41;
+		kernels.rgba_to_y = rgba_to_y_sse41;
+		kernels.rgba_to_uv = rgba_to_uv_sse41;
+		kernels.downscale_2x2 = downscale_2x2_sse41;
+		kernels.swap_rb = swap_rb_sse41;
+	}
+	if (__builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("avx2")) {
+		kernels.interleave = interleave_avx2;
+		kernels.deinterleave = deinterleave_avx2;
+		kernels.yuv_to_rgba = yuv_to_rgba_avx2;
+	}
+#elif defined(DRV_CONVERT_NEON)
+	kernels.interleave = interleave_neon;
+	kernels.deinterleave = deinterleave_neon;
+	kernels.yuv_to_rgba = yuv_to_rgba_neon;
+	kernels.rgba_to_y = rgba_to_y_neon;
+	kernels.rgba_to_uv = rgba_to_uv_neon;
+	kernels.downscale_2x2 = downscale_2x2_neon;
+	kernels.swap_rb = swap_rb_neon;
+#endif
+}
+
+static bool format_is_rgba(uint32_t format)
+{
+	return format == DRM_FORMAT_ABGR8888 || format == DRM_FORMAT_XBGR8888;
+}
+
+static bool format_is_bgra(uint32_t format)
+{
+	return format == DRM_FORMAT_ARGB8888 || format == DRM_FORMAT_XRGB8888;
+}
+
+static bool format_has_alpha(uint32_t format)
+{
+	return format == DRM_FORMAT_ABGR8888 || format == DRM_FORMAT_ARGB8888;
+}
+
+static int image_yuv_planes(const struct drv_image *image, struct yuv_planes *out)
+{
+	out->y = image->planes[0];
+	out->y_stride = image->strides[0];
+	out->chroma_stride = image->strides[1];
+
+	switch (image->format) {
+	case DRM_FORMAT_YVU420:
+	case DRM_FORMAT_YVU420_ANDROID:
+		out->v = image->planes[1];
+		out->u = image->planes[2];
+		out->chroma_step = 1;
+		return 0;
+	case DRM_FORMAT_YUV420:
+		out->u = image->planes[1];
+		out->v = image->planes[2];
+		out->chroma_step = 1;
+		return 0;
+	case DRM_FORMAT_NV12:
+		out->u = image->planes[1];
+		out->v = image->planes[1] + 1;
+		out->chroma_step = 2;
+		return 0;
+	case DRM_FORMAT_NV21:
+		out->v = image->planes[1];
+		out->u = image->planes[1] + 1;
+		out->chroma_step = 2;
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+/*
+ * A chroma row of an image as two planar rows: planar images are read in
+ * place, semi-planar ones are split into u_buf and v_buf.
+ */
+static void chroma_row_get(const struct yuv_planes *planes, uint32_t row, uint32_t width,
+			   uint8_t *u_buf, uint8_t *v_buf, const uint8_t **u, const uint8_t **v)
+{
+	size_t offset = (size_t)row * planes->chroma_stride;
+
+	if (planes->chroma_step == 1) {
+		*u = planes->u + offset;
+		*v = planes->v + offset;
+	} else if (planes->u < planes->v) {
+		kernels.deinterleave(planes->u + offset, u_buf, v_buf, width);
+		*u = u_buf;
+		*v = v_buf;
+	} else {
+		kernels.deinterleave(planes->v + offset, v_buf, u_buf, width);
+		*u = u_buf;
+		*v = v_buf;
+	}
+}
+
+static void chroma_row_put(const struct yuv_planes *planes, uint32_t row, uint32_t width,
+			   const uint8_t *u, const uint8_t *v)
+{
+	size_t offset = (size_t)row * planes->chroma_stride;
+
+	if (planes->chroma_step == 1) {
+		if (u != planes->u + offset)
+			memcpy(planes->u + offset, u, width);
+		if (v != planes->v + offset)
+			memcpy(planes->v + offset, v, width);
+	} else if (planes->u < planes->v) {
+		kernels.interleave(u, v, planes->u + offset, width);
+	} else {
+		kernels.interleave(v, u, planes->v + offset, width);
+	}
+}
+
+// rows of a planar destination can receive the split rows of the source directly
+static void chroma_row_bufs(const struct yuv_planes *planes, uint32_t row, uint8_t *scratch,
+			    uint32_t width, uint8_t **u_buf, uint8_t **v_buf)
+{
+	size_t offset = (size_t)row * planes->chroma_stride;
+
+	if (planes->chroma_step == 1) {
+		*u_buf = planes->u + offset;
+		*v_buf = planes->v + offset;
+	} else {
+		*u_buf = scratch;
+		*v_buf = scratch + width;
+	}
+}
+
+static void convert_yuv_to_yuv(const struct yuv_planes *src, const struct yuv_planes *dst,
+			       uint32_t width, uint32_t height, uint8_t *scratch)
+{
+	uint32_t chroma_width = DIV_ROUND_UP(width, 2);
+	uint32_t row;
+
+	for (row = 0; row < height; row++)
+		memcpy(dst->y + (size_t)row * dst->y_stride, src->y + (size_t)row * src->y_stride,
+		       width);
+
+	for (row = 0; row < DIV_ROUND_UP(height, 2); row++) {
+		const uint8_t *u, *v;
+		uint8_t *u_buf, *v_buf;
+
+		chroma_row_bufs(dst, row, scratch, chroma_width, &u_buf, &v_buf);
+		chroma_row_get(src, row, chroma_width, u_buf, v_buf, &u, &v);
+		chroma_row_put(dst, row, chroma_width, u, v);
+	}
+}
+
+static void convert_yuv_to_rgba(const struct yuv_planes *src, const struct drv_image *dst,
+				uint8_t *scratch)
+{
+	uint32_t chroma_width = DIV_ROUND_UP(dst->width, 2);
+	const uint8_t *u = NULL, *v = NULL;
+	uint32_t row;
+
+	for (row = 0; row < dst->height; row++) {
+		// a chroma row is shared by two rows of pixels
+		if (!(row & 1))
+			chroma_row_get(src, row / 2, chroma_width, scratch, scratch + chroma_width,
+				       &u, &v);
+
+		kernels.yuv_to_rgba(src->y + (size_t)row * src->y_stride, u, v,
+				    dst->planes[0] + (size_t)row * dst->strides[0], dst->width);
+	}
+}
+
+static void convert_rgba_to_yuv(const struct drv_image *src, const struct yuv_planes *dst,
+				uint8_t *scratch)
+{
+	uint32_t chroma_width = DIV_ROUND_UP(src->width, 2);
+	uint32_t row;
+
+	for (row = 0; row < src->height; row += 2) {
+		const uint8_t *rgba0 = src->planes[0] + (size_t)row * src->strides[0];
+		const uint8_t *rgba1 = rgba0;
+		uint8_t *u_buf, *v_buf;
+
+		kernels.rgba_to_y(rgba0, dst->y + (size_t)row * dst->y_stride, src->width);
+
+		// an odd last row is averaged with itself
+		if (row + 1 < src->height) {
+			rgba1 = rgba0 + src->strides[0];
+			kernels.rgba_to_y(rgba1, dst->y + (size_t)(row + 1) * dst->y_stride,
+					  src->width);
+		}
+
+		chroma_row_bufs(dst, row / 2, scratch, chroma_width, &u_buf, &v_buf);
+		kernels.rgba_to_uv(rgba0, rgba1, u_buf, v_buf, src->width);
+		chroma_row_put(dst, row / 2, chroma_width, u_buf, v_buf);
+	}
+}
+
+// the same format in other strides: copy the rows of every plane
+static void convert_repack(const struct drv_image *src, const struct drv_image *dst)
+{
+	size_t plane, num_planes = drv_num_planes_from_format(src->format);
+	uint32_t row;
+
+	for (plane = 0; plane < num_planes; plane++) {
+		uint32_t row_bytes = drv_width_from_format(src->format, src->width, plane) *
+				     drv_bytes_per_pixel_from_format(src->format, plane);
+		uint32_t rows = drv_height_from_format(src->format, src->height, plane);
+
+		if (!rows)
+			continue;
+
+		if (src->strides[plane] == dst->strides[plane]) {
+			memcpy(dst->planes[plane], src->planes[plane],
+			       (size_t)src->strides[plane] * (rows - 1) + row_bytes);
+			continue;
+		}
+
+		for (row = 0; row < rows; row++)
+			memcpy(dst->planes[plane] + (size_t)row * dst->strides[plane],
+			       src->planes[plane] + (size_t)row * src->strides[plane], row_bytes);
+	}
+}
+
+/**
+ * Android-EMU:
+ * describe an image at base in the layout given by strides and offsets, e.g.
+ * the ones of a buffer object
+ */
+void drv_image_init(struct drv_image *image, uint32_t format, uint32_t width, uint32_t height,
+		    void *base, const uint32_t *strides, const uint32_t *offsets)
+{
+	size_t plane, num_planes = drv_num_planes_from_format(format);
+
+	memset(image, 0, sizeof(*image));
+	image->format = format;
+	image->width = width;
+	image->height = height;
+	for (plane = 0; plane < num_planes && plane < DRV_MAX_PLANES; plane++) {
+		image->planes[plane] = (uint8_t *)base + offsets[plane];
+		image->strides[plane] = strides[plane];
+	}
+}
+
+/**
+ * Android-EMU:
+ * whether drv_convert_image() converts from src_format to dst_format
+ */
+bool drv_convert_supported(uint32_t src_format, uint32_t dst_format)
+{
+	struct drv_image image = { 0 };
+	struct yuv_planes planes;
+	bool src_yuv, dst_yuv;
+
+	if (src_format == dst_format)
+		return drv_num_planes_from_format(src_format) > 0;
+
+	image.format = src_format;
+	src_yuv = !image_yuv_planes(&image, &planes);
+	image.format = dst_format;
+	dst_yuv = !image_yuv_planes(&image, &planes);
+
+	return (src_yuv && dst_yuv) || (src_yuv && format_is_rgba(dst_format)) ||
+	       (format_is_rgba(src_format) && dst_yuv);
+}
+
+/**
+ * Android-EMU:
+ * convert an image between YUV 4:2:0 formats (YV12, I420, NV12, NV21), from
+ * and to RGBA, or repack it into other strides; odd sizes are supported, the
+ * chroma planes cover DIV_ROUND_UP(width, 2) x DIV_ROUND_UP(height, 2)
+ * samples like the layouts of drv_bo_from_format()
+ */
+int drv_convert_image(const struct drv_image *src, const struct drv_image *dst)
+{
+	struct yuv_planes src_planes, dst_planes;
+	bool src_yuv, dst_yuv;
+	uint8_t *scratch;
+
+	if (src->width != dst->width || src->height != dst->height ||
+	    !drv_convert_supported(src->format, dst->format))
+		return -EINVAL;
+
+	pthread_once(&kernels_once, kernels_init);
+
+	if (src->format == dst->format) {
+		convert_repack(src, dst);
+		return 0;
+	}
+
+	src_yuv = !image_yuv_planes(src, &src_planes);
+	dst_yuv = !image_yuv_planes(dst, &dst_planes);
+
+	// two chroma rows, split from or to be merged into a semi-planar row
+	scratch = malloc(2 * (size_t)DIV_ROUND_UP(src->width, 2));
+	if (!scratch)
+		return -ENOMEM;
+
+	if (src_yuv && dst_yuv)
+		convert_yuv_to_yuv(&src_planes, &dst_planes, src->width, src->height, scratch);
+	else if (src_yuv)
+		convert_yuv_to_rgba(&src_planes, dst, scratch);
+	else
+		convert_rgba_to_yuv(src, &dst_planes, scratch);
+
+	free(scratch);
+	return 0;
+}
+
+/**
+ * Android-EMU:
+ * narrow an image to a rectangle of it; YUV images need an even origin
+ */
+int drv_image_crop(struct drv_image *image, const struct rectangle *rect)
+{
+	size_t plane, num_planes = drv_num_planes_from_format(image->format);
+
+	if (rect->x + rect->width > image->width || rect->y + rect->height > image->height)
+		return -EINVAL;
+
+	if (num_planes > 1 && (rect->x % 2 || rect->y % 2))
+		return -EINVAL;
+
+	for (plane = 0; plane < num_planes && plane < DRV_MAX_PLANES; plane++)
+		image->planes[plane] +=
+		    (size_t)drv_height_from_format(image->format, rect->y, plane) *
+			image->strides[plane] +
+		    drv_width_from_format(image->format, rect->x, plane) *
+			drv_bytes_per_pixel_from_format(image->format, plane);
+
+	image->width = rect->width;
+	image->height = rect->height;
+	return 0;
+}
+
+// one row of dst from the rows of src it covers, in src's byte order
+static void scale_row(const struct drv_image *src, const struct drv_image *dst, uint32_t row,
+		      const uint32_t *columns, uint8_t *out)
+{
+	const uint8_t *in;
+	uint32_t x;
+
+	if (src->width == dst->width && src->height == dst->height) {
+		memcpy(out, src->planes[0] + (size_t)row * src->strides[0], 4 * (size_t)dst->width);
+		return;
+	}
+
+	if (src->width == 2 * dst->width && src->height == 2 * dst->height) {
+		in = src->planes[0] + (size_t)2 * row * src->strides[0];
+		kernels.downscale_2x2(in, in + src->strides[0], out, dst->width);
+		return;
+	}
+
+	in = src->planes[0] + ((uint64_t)row * src->height + src->height / 2) / dst->height *
+				  src->strides[0];
+	for (x = 0; x < dst->width; x++)
+		memcpy(out + 4 * x, in + 4 * columns[x], 4);
+}
+
+/**
+ * Android-EMU:
+ * copy an image into a smaller or equal one of 32-bit RGB, e.g. a screenshot
+ * or a thumbnail of a frame: YUV images are converted to RGBA first, halving
+ * both sizes averages 2x2 blocks, and other sizes sample the nearest pixel
+ */
+int drv_scale_image(const struct drv_image *src, const struct drv_image *dst)
+{
+	struct drv_image rgba;
+	uint32_t *columns = NULL;
+	uint32_t row, x;
+	bool swap;
+	int ret;
+
+	if (!format_is_rgba(dst->format) && !format_is_bgra(dst->format))
+		return -EINVAL;
+
+	if (!dst->width || !dst->height || dst->width > src->width || dst->height > src->height)
+		return -EINVAL;
+
+	// a YUV image goes through an RGBA copy of it
+	if (!format_is_rgba(src->format) && !format_is_bgra(src->format)) {
+		if (!drv_convert_supported(src->format, DRM_FORMAT_ABGR8888))
+			return -EINVAL;
+
+		memset(&rgba, 0, sizeof(rgba));
+		rgba.format = DRM_FORMAT_ABGR8888;
+		rgba.width = src->width;
+		rgba.height = src->height;
+		rgba.strides[0] = 4 * src->width;
+		rgba.planes[0] = malloc((size_t)rgba.strides[0] * src->height);
+		if (!rgba.planes[0])
+			return -ENOMEM;
+
+		ret = drv_convert_image(src, &rgba);
+		if (!ret)
+			ret = drv_scale_image(&rgba, dst);
+
+		free(rgba.planes[0]);
+		return ret;
+	}
+
+	pthread_once(&kernels_once, kernels_init);
+
+	if ((src->width != dst->width || src->height != dst->height) &&
+	    (src->width != 2 * dst->width || src->height != 2 * dst->height)) {
+		columns = malloc(dst->width * sizeof(*columns));
+		if (!columns)
+			return -ENOMEM;
+
+		for (x = 0; x < dst->width; x++)
+			columns[x] = ((uint64_t)x * src->width + src->width / 2) / dst->width;
+	}
+
+	swap = format_is_rgba(src->format) != format_is_rgba(dst->format);
+	for (row = 0; row < dst->height; row++) {
+		uint8_t *out = dst->planes[0] + (size_t)row * dst->strides[0];
+
+		scale_row(src, dst, row, columns, out);
+		if (swap)
+			kernels.swap_rb(out, out, dst->width);
+
+		// an image without alpha is opaque
+		if (format_has_alpha(dst->format) && !format_has_alpha(src->format)) {
+			for (x = 0; x < dst->width; x++)
+				out[4 * x + 3] = 0xff;
+		}
+	}
+
+	free(columns);
+	return 0;
+}
+
+/* Android-EMU: end of modification */
@@ -0,0 +1,43 @@
+/*
+ * Copyright 2014 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/* Android-EMU: start of modification */
+
+#ifndef DRV_CONVERT_H
+#define DRV_CONVERT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "drv.h"
+
+/**
+ * Android-EMU:
+ * the planes of an image in memory, e.g. a mapped buffer in the layout of
+ * its buffer object or of a drv_layout
+ */
+struct drv_image {
+	uint32_t format;
+	uint32_t width;
+	uint32_t height;
+	uint8_t *planes[DRV_MAX_PLANES];
+	uint32_t strides[DRV_MAX_PLANES];
+};
+
+void drv_image_init(struct drv_image *image, uint32_t format, uint32_t width, uint32_t height,
+		    void *base, const uint32_t *strides, const uint32_t *offsets);
+
+bool drv_convert_supported(uint32_t src_format, uint32_t dst_format);
+
+int drv_convert_image(const struct drv_image *src, const struct drv_image *dst);
+
+int drv_image_crop(struct drv_image *image, const struct rectangle *rect);
+
+int drv_scale_image(const struct drv_image *src, const struct drv_image *dst);
+
+#endif
+
+/* Android-EMU: end of modification */
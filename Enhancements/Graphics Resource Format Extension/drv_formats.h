@@ -0,0 +1,97 @@
+/*
+ * Copyright 2014 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/* Android-EMU: start of modification */
+
+#ifndef DRV_FORMATS_H
+#define DRV_FORMATS_H
+
+/*
+ * Android-EMU:
+ * every format minigbm lays out, in one table that the layout lookup of
+ * helpers.c, translate_format() of virtio_gpu.c and the self-test of the
+ * benchmark are all generated from, so they cannot disagree on a format.
+ * DRV_FORMATS(X) expands X(fourcc, layout, virgl_format, stride_align, flags)
+ * once per format:
+ *  - layout: the planar_layout of helpers.c the planes follow
+ *  - virgl_format: the VIRGL_FORMAT_* of virgl_hw.h the host knows the format
+ *    as, or 0 if the host has none; only virtio_gpu.c and the benchmark
+ *    expand it
+ *  - stride_align: the alignment in bytes of the first plane's stride, the
+ *    other planes are aligned to it divided by their subsampling
+ *  - flags: DRV_FORMAT_* semantics Android attaches to the format
+ */
+
+// the planes follow the buffer's height, never an aligned one (HAL_PIXEL_FORMAT_YV12)
+#define DRV_FORMAT_FIXED_HEIGHT (1u << 0)
+
+// clang-format off
+
+#define DRV_FORMATS(X)                                                                              \
+	X(DRM_FORMAT_BGR233, packed_1bpp_layout, 0, 1, 0)                                           \
+	X(DRM_FORMAT_C8, packed_1bpp_layout, 0, 1, 0)                                               \
+	X(DRM_FORMAT_R8, packed_1bpp_layout, VIRGL_FORMAT_R8_UNORM, 1, 0)                           \
+	X(DRM_FORMAT_RGB332, packed_1bpp_layout, 0, 1, 0)                                           \
+                                                                                                    \
+	X(DRM_FORMAT_YVU420, triplanar_yuv_420_layout, VIRGL_FORMAT_YV12, 1, 0)                     \
+	X(DRM_FORMAT_YVU420_ANDROID, triplanar_yuv_420_layout, VIRGL_FORMAT_YV12, 32,               \
+	  DRV_FORMAT_FIXED_HEIGHT)                                                                  \
+	X(DRM_FORMAT_YUV420, triplanar_yuv_420_layout, 0, 1, 0)                                     \
+                                                                                                    \
+	X(DRM_FORMAT_NV12, biplanar_yuv_420_layout, VIRGL_FORMAT_NV12, 1, 0)                        \
+	X(DRM_FORMAT_NV21, biplanar_yuv_420_layout, 0, 1, 0)                                        \
+                                                                                                    \
+	X(DRM_FORMAT_ABGR1555, packed_2bpp_layout, 0, 1, 0)                                         \
+	X(DRM_FORMAT_ABGR4444, packed_2bpp_layout, 0, 1, 0)                                         \
+	X(DRM_FORMAT_ARGB1555, packed_2bpp_layout, 0, 1, 0)                                         \
+	X(DRM_FORMAT_ARGB4444, packed_2bpp_layout, 0, 1, 0)                                         \
+	X(DRM_FORMAT_BGR565, packed_2bpp_layout, 0, 1, 0)                                           \
+	X(DRM_FORMAT_BGRA4444, packed_2bpp_layout, 0, 1, 0)                                         \
+	X(DRM_FORMAT_BGRA5551, packed_2bpp_layout, 0, 1, 0)                                         \
+	X(DRM_FORMAT_BGRX4444, packed_2bpp_layout, 0, 1, 0)                                         \
+	X(DRM_FORMAT_BGRX5551, packed_2bpp_layout, 0, 1, 0)                                         \
+	X(DRM_FORMAT_GR88, packed_2bpp_layout, 0, 1, 0)                                             \
+	X(DRM_FORMAT_RG88, packed_2bpp_layout, VIRGL_FORMAT_R8G8_UNORM, 1, 0)                       \
+	X(DRM_FORMAT_RGB565, packed_2bpp_layout, VIRGL_FORMAT_B5G6R5_UNORM, 1, 0)                   \
+	X(DRM_FORMAT_RGBA4444, packed_2bpp_layout, 0, 1, 0)                                         \
+	X(DRM_FORMAT_RGBA5551, packed_2bpp_layout, 0, 1, 0)                                         \
+	X(DRM_FORMAT_RGBX4444, packed_2bpp_layout, 0, 1, 0)                                         \
+	X(DRM_FORMAT_RGBX5551, packed_2bpp_layout, 0, 1, 0)                                         \
+	X(DRM_FORMAT_UYVY, packed_2bpp_layout, 0, 1, 0)                                             \
+	X(DRM_FORMAT_VYUY, packed_2bpp_layout, 0, 1, 0)                                             \
+	X(DRM_FORMAT_XBGR1555, packed_2bpp_layout, 0, 1, 0)                                         \
+	X(DRM_FORMAT_XBGR4444, packed_2bpp_layout, 0, 1, 0)                                         \
+	X(DRM_FORMAT_XRGB1555, packed_2bpp_layout, 0, 1, 0)                                         \
+	X(DRM_FORMAT_XRGB4444, packed_2bpp_layout, 0, 1, 0)                                         \
+	X(DRM_FORMAT_YUYV, packed_2bpp_layout, 0, 1, 0)                                             \
+	X(DRM_FORMAT_YVYU, packed_2bpp_layout, 0, 1, 0)                                             \
+                                                                                                    \
+	X(DRM_FORMAT_BGR888, packed_3bpp_layout, 0, 1, 0)                                           \
+	X(DRM_FORMAT_RGB888, packed_3bpp_layout, 0, 1, 0)                                           \
+                                                                                                    \
+	X(DRM_FORMAT_ABGR2101010, packed_4bpp_layout, 0, 1, 0)                                      \
+	X(DRM_FORMAT_ABGR8888, packed_4bpp_layout, VIRGL_FORMAT_R8G8B8A8_UNORM, 1, 0)               \
+	X(DRM_FORMAT_ARGB2101010, packed_4bpp_layout, 0, 1, 0)                                      \
+	X(DRM_FORMAT_ARGB8888, packed_4bpp_layout, VIRGL_FORMAT_B8G8R8A8_UNORM, 1, 0)               \
+	X(DRM_FORMAT_AYUV, packed_4bpp_layout, 0, 1, 0)                                             \
+	X(DRM_FORMAT_BGRA1010102, packed_4bpp_layout, 0, 1, 0)                                      \
+	X(DRM_FORMAT_BGRA8888, packed_4bpp_layout, 0, 1, 0)                                         \
+	X(DRM_FORMAT_BGRX1010102, packed_4bpp_layout, 0, 1, 0)                                      \
+	X(DRM_FORMAT_BGRX8888, packed_4bpp_layout, 0, 1, 0)                                         \
+	X(DRM_FORMAT_RGBA1010102, packed_4bpp_layout, 0, 1, 0)                                      \
+	X(DRM_FORMAT_RGBA8888, packed_4bpp_layout, 0, 1, 0)                                         \
+	X(DRM_FORMAT_RGBX1010102, packed_4bpp_layout, 0, 1, 0)                                      \
+	X(DRM_FORMAT_RGBX8888, packed_4bpp_layout, 0, 1, 0)                                         \
+	X(DRM_FORMAT_XBGR2101010, packed_4bpp_layout, 0, 1, 0)                                      \
+	X(DRM_FORMAT_XBGR8888, packed_4bpp_layout, VIRGL_FORMAT_R8G8B8X8_UNORM, 1, 0)               \
+	X(DRM_FORMAT_XRGB2101010, packed_4bpp_layout, 0, 1, 0)                                      \
+	X(DRM_FORMAT_XRGB8888, packed_4bpp_layout, VIRGL_FORMAT_B8G8R8X8_UNORM, 1, 0)
+
+// clang-format on
+
+#endif
+
+/* Android-EMU: end of modification */
@@ -0,0 +1,33 @@
+/*
+ * Copyright 2014 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/* Android-EMU: start of modification */
+
+#ifndef DRV_LAYOUT_H
+#define DRV_LAYOUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "drv.h"
+
+/**
+ * Android-EMU:
+ * the planes of a buffer, packed back to back
+ */
+struct drv_layout {
+	size_t num_planes;
+	uint32_t strides[DRV_MAX_PLANES];
+	uint32_t sizes[DRV_MAX_PLANES];
+	uint32_t offsets[DRV_MAX_PLANES];
+	uint32_t total_size;
+};
+
+int drv_layout_compute(uint32_t format, uint32_t width, uint32_t height, struct drv_layout *out);
+
+#endif
+
+/* Android-EMU: end of modification */
@@ -0,0 +1,37 @@
+/*
+ * Copyright 2014 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/* Android-EMU: start of modification */
+
+#ifndef DRV_MAPPING_H
+#define DRV_MAPPING_H
+
+#include <stdint.h>
+
+#include "drv.h"
+
+struct vma;
+
+/**
+ * Android-EMU:
+ * the index of a driver's mappings by GEM handle, which drv_bo_map() and
+ * drv_bo_unmap() of drv.c use instead of scanning drv->mappings (see
+ * drv.c.patch), and which drv_mapping_destroy() walks per buffer
+ */
+struct mapping *drv_mapping_append(struct driver *drv, struct mapping *mapping);
+
+int drv_mapping_remove(struct driver *drv, struct mapping *mapping);
+
+struct mapping *drv_mapping_find(struct driver *drv, uint32_t handle, const struct rectangle *rect,
+				 uint32_t map_flags);
+
+struct vma *drv_mapping_find_vma(struct driver *drv, uint32_t handle, uint32_t map_flags);
+
+void drv_mapping_index_destroy(struct driver *drv);
+
+#endif
+
+/* Android-EMU: end of modification */
@@ -0,0 +1,427 @@
+/*
+ * Copyright 2014 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/* Android-EMU: start of modification */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "drv_priv.h"
+#include "drv_trace.h"
+#include "helpers.h"
+#include "util.h"
+
+// set to enable tracing; a value with a '/' is also the file the trace is exported to at exit
+#define DRV_TRACE_ENV "MINIGBM_TRACE"
+// records per thread, the oldest are overwritten; a power of two
+#define DRV_TRACE_RING_SIZE 2048
+
+/*
+ * A record is written by its thread only. Its sequence is odd while the
+ * record is written and 2 * (index + 1) once it holds the index-th record of
+ * the ring, so readers copy it without a lock and drop the copy if the
+ * sequence changed meanwhile. The fields are relaxed atomics, which cost the
+ * writer nothing over plain stores.
+ */
+struct drv_trace_record {
+	atomic_uint_fast64_t seq;
+	atomic_uint_fast64_t start_ns;
+	atomic_uint_fast64_t duration_ns;
+	atomic_uint_fast64_t use_flags;
+	atomic_uint_fast64_t bytes;
+	atomic_uint format;
+	atomic_uint width;
+	atomic_uint height;
+	atomic_uint handle;
+	atomic_int result;
+	atomic_int tid;
+	atomic_uint event;
+};
+
+// Rings are never freed: the ring of an exited thread goes to the next new
+// thread, and the list is only ever prepended to, so readers walk it unlocked.
+struct drv_trace_ring {
+	atomic_uint_fast64_t head;
+	atomic_int in_use;
+	struct drv_trace_ring *next;
+	struct drv_trace_record records[DRV_TRACE_RING_SIZE];
+};
+
+// a copy of a complete record
+struct drv_trace_entry {
+	uint64_t start_ns;
+	uint64_t duration_ns;
+	uint64_t use_flags;
+	uint64_t bytes;
+	uint32_t format;
+	uint32_t width;
+	uint32_t height;
+	uint32_t handle;
+	int32_t result;
+	int32_t tid;
+	uint32_t event;
+};
+
+struct trace_out {
+	int fd;
+	int error;
+	size_t length;
+	char buffer[4096];
+};
+
+static const char *const event_names[DRV_TRACE_EVENT_COUNT] = {
+	[DRV_TRACE_BO_CREATE] = "bo_create",	     [DRV_TRACE_BO_DESTROY] = "bo_destroy",
+	[DRV_TRACE_BO_MAP] = "bo_map",		     [DRV_TRACE_BO_FLUSH] = "bo_flush",
+	[DRV_TRACE_BO_INVALIDATE] = "bo_invalidate", [DRV_TRACE_BO_IMPORT] = "bo_import",
+	[DRV_TRACE_BO_CREATE_ARRAY] = "bo_create_array",
+	[DRV_TRACE_BO_READBACK] = "bo_readback",
+};
+
+static atomic_bool trace_on;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(struct drv_trace_ring *) rings;
+static __thread struct drv_trace_ring *thread_ring;
+static __thread int32_t thread_tid;
+
+static void trace_release_ring(void *data)
+{
+	struct drv_trace_ring *ring = data;
+
+	atomic_store_explicit(&ring->in_use, 0, memory_order_release);
+}
+
+static void trace_init(void)
+{
+	const char *env = getenv(DRV_TRACE_ENV);
+
+	pthread_key_create(&trace_key, trace_release_ring);
+	if (env && *env && strcmp(env, "0"))
+		atomic_store(&trace_on, true);
+}
+
+bool drv_trace_enabled(void)
+{
+	pthread_once(&trace_once, trace_init);
+	return atomic_load_explicit(&trace_on, memory_order_relaxed);
+}
+
+void drv_trace_set_enabled(bool enabled)
+{
+	pthread_once(&trace_once, trace_init);
+	atomic_store(&trace_on, enabled);
+}
+
+static uint64_t trace_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Android-EMU:
+ * the start of a traced call, or 0 if tracing is off
+ */
+uint64_t drv_trace_begin(void)
+{
+	return drv_trace_enabled() ? trace_now_ns() : 0;
+}
+
+/**
+ * Android-EMU:
+ * the calling thread's ring; a released ring is taken over before a new one
+ * is allocated, so the rings are bounded by the peak number of threads
+ */
+static struct drv_trace_ring *trace_thread_ring(void)
+{
+	struct drv_trace_ring *ring;
+	int unused = 0;
+
+	if (thread_ring)
+		return thread_ring;
+
+	for (ring = atomic_load_explicit(&rings, memory_order_acquire); ring; ring = ring->next) {
+		unused = 0;
+		if (atomic_compare_exchange_strong(&ring->in_use, &unused, 1))
+			break;
+	}
+
+	if (!ring) {
+		ring = calloc(1, sizeof(*ring));
+		if (!ring)
+			return NULL;
+
+		atomic_init(&ring->in_use, 1);
+		pthread_mutex_lock(&rings_lock);
+		ring->next = atomic_load_explicit(&rings, memory_order_relaxed);
+		atomic_store_explicit(&rings, ring, memory_order_release);
+		pthread_mutex_unlock(&rings_lock);
+	}
+
+	pthread_setspecific(trace_key, ring);
+	thread_ring = ring;
+	thread_tid = syscall(SYS_gettid);
+	return ring;
+}
+
+/**
+ * Android-EMU:
+ * record a call that started at start, unless tracing was off then; width
+ * and height are those of the region the call covered, bytes its size
+ */
+void drv_trace_end(uint64_t start, enum drv_trace_event event, struct bo *bo, uint32_t width,
+		   uint32_t height, uint64_t bytes, int result)
+{
+	struct drv_trace_ring *ring;
+	struct drv_trace_record *record;
+	uint64_t index, end;
+
+	if (!start)
+		return;
+
+	end = trace_now_ns();
+	ring = trace_thread_ring();
+	if (!ring)
+		return;
+
+	index = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	record = &ring->records[index & (DRV_TRACE_RING_SIZE - 1)];
+
+	atomic_store_explicit(&record->seq, 2 * index + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	atomic_store_explicit(&record->start_ns, start, memory_order_relaxed);
+	atomic_store_explicit(&record->duration_ns, end - start, memory_order_relaxed);
+	atomic_store_explicit(&record->use_flags, bo->use_flags, memory_order_relaxed);
+	atomic_store_explicit(&record->bytes, bytes, memory_order_relaxed);
+	atomic_store_explicit(&record->format, bo->format, memory_order_relaxed);
+	atomic_store_explicit(&record->width, width, memory_order_relaxed);
+	atomic_store_explicit(&record->height, height, memory_order_relaxed);
+	atomic_store_explicit(&record->handle, bo->handles[0].u32, memory_order_relaxed);
+	atomic_store_explicit(&record->result, result, memory_order_relaxed);
+	atomic_store_explicit(&record->tid, thread_tid, memory_order_relaxed);
+	atomic_store_explicit(&record->event, event, memory_order_relaxed);
+
+	atomic_store_explicit(&record->seq, 2 * index + 2, memory_order_release);
+	atomic_store_explicit(&ring->head, index + 1, memory_order_release);
+}
+
+/**
+ * Android-EMU:
+ * copy the index-th record of a ring, false if it was overwritten
+ */
+static bool trace_copy(struct drv_trace_ring *ring, uint64_t index, struct drv_trace_entry *entry)
+{
+	struct drv_trace_record *record = &ring->records[index & (DRV_TRACE_RING_SIZE - 1)];
+	uint64_t seq = atomic_load_explicit(&record->seq, memory_order_acquire);
+
+	if (seq != 2 * index + 2)
+		return false;
+
+	entry->start_ns = atomic_load_explicit(&record->start_ns, memory_order_relaxed);
+	entry->duration_ns = atomic_load_explicit(&record->duration_ns, memory_order_relaxed);
+	entry->use_flags = atomic_load_explicit(&record->use_flags, memory_order_relaxed);
+	entry->bytes = atomic_load_explicit(&record->bytes, memory_order_relaxed);
+	entry->format = atomic_load_explicit(&record->format, memory_order_relaxed);
+	entry->width = atomic_load_explicit(&record->width, memory_order_relaxed);
+	entry->height = atomic_load_explicit(&record->height, memory_order_relaxed);
+	entry->handle = atomic_load_explicit(&record->handle, memory_order_relaxed);
+	entry->result = atomic_load_explicit(&record->result, memory_order_relaxed);
+	entry->tid = atomic_load_explicit(&record->tid, memory_order_relaxed);
+	entry->event = atomic_load_explicit(&record->event, memory_order_relaxed);
+
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&record->seq, memory_order_relaxed) == seq &&
+	       entry->event < DRV_TRACE_EVENT_COUNT;
+}
+
+static void trace_flush(struct trace_out *out)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (!out->error && done < out->length) {
+		ret = write(out->fd, out->buffer + done, out->length - done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			out->error = ret < 0 ? errno : EIO;
+		else
+			done += ret;
+	}
+
+	out->length = 0;
+}
+
+__attribute__((format(printf, 2, 3))) static void trace_printf(struct trace_out *out,
+							      const char *format, ...)
+{
+	va_list args;
+	int length;
+
+	va_start(args, format);
+	length = vsnprintf(out->buffer + out->length, sizeof(out->buffer) - out->length, format,
+			   args);
+	va_end(args);
+
+	if (length < 0 || out->length + length < sizeof(out->buffer)) {
+		out->length += length > 0 ? length : 0;
+		return;
+	}
+
+	trace_flush(out);
+
+	va_start(args, format);
+	length = vsnprintf(out->buffer, sizeof(out->buffer), format, args);
+	va_end(args);
+
+	// a record that cannot be formatted is dropped rather than written partly
+	if (length < 0)
+		out->length = 0;
+	else
+		out->length = MIN((size_t)length, sizeof(out->buffer) - 1);
+}
+
+static void trace_fourcc(uint32_t format, char name[5])
+{
+	uint32_t i;
+
+	for (i = 0; i < 4; i++) {
+		char c = (format >> (8 * i)) & 0xff;
+		name[i] = (c >= ' ' && c <= '~' && c != '"' && c != '\\') ? c : '_';
+	}
+	name[4] = '\0';
+}
+
+/**
+ * Android-EMU:
+ * visit the records of every thread, oldest first per thread
+ */
+static void trace_walk(struct trace_out *out,
+		       void (*visit)(struct trace_out *out, const struct drv_trace_entry *entry,
+				     bool *first),
+		       bool *first)
+{
+	struct drv_trace_ring *ring;
+	struct drv_trace_entry entry;
+	uint64_t index, head;
+
+	for (ring = atomic_load_explicit(&rings, memory_order_acquire); ring; ring = ring->next) {
+		head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		index = head > DRV_TRACE_RING_SIZE ? head - DRV_TRACE_RING_SIZE : 0;
+		for (; index < head; index++)
+			if (trace_copy(ring, index, &entry))
+				visit(out, &entry, first);
+	}
+}
+
+static void trace_dump_entry(struct trace_out *out, const struct drv_trace_entry *entry,
+			     bool *first)
+{
+	char format[5];
+
+	trace_fourcc(entry->format, format);
+	trace_printf(out, "%llu.%06llu %d %-15s %s %ux%u use=0x%llx handle=%u bytes=%llu %lluus%s\n",
+		     (unsigned long long)(entry->start_ns / 1000000000),
+		     (unsigned long long)(entry->start_ns % 1000000000 / 1000), entry->tid,
+		     event_names[entry->event], format, entry->width, entry->height,
+		     (unsigned long long)entry->use_flags, entry->handle,
+		     (unsigned long long)entry->bytes,
+		     (unsigned long long)(entry->duration_ns / 1000),
+		     entry->result ? " failed" : "");
+}
+
+/**
+ * Android-EMU:
+ * write the trace as text, a line per call
+ */
+int drv_trace_dump(int fd)
+{
+	struct trace_out out = { .fd = fd };
+
+	trace_walk(&out, trace_dump_entry, NULL);
+	trace_flush(&out);
+	return -out.error;
+}
+
+static void trace_export_entry(struct trace_out *out, const struct drv_trace_entry *entry,
+			       bool *first)
+{
+	char format[5];
+
+	trace_fourcc(entry->format, format);
+	trace_printf(out,
+		     "%s{\"name\":\"%s\",\"cat\":\"minigbm\",\"ph\":\"X\",\"ts\":%llu.%03llu,"
+		     "\"dur\":%llu.%03llu,\"pid\":%d,\"tid\":%d,\"args\":{\"format\":\"%s\","
+		     "\"width\":%u,\"height\":%u,\"use_flags\":\"0x%llx\",\"handle\":%u,"
+		     "\"bytes\":%llu,\"result\":%d}}",
+		     *first ? "\n" : ",\n", event_names[entry->event],
+		     (unsigned long long)(entry->start_ns / 1000),
+		     (unsigned long long)(entry->start_ns % 1000),
+		     (unsigned long long)(entry->duration_ns / 1000),
+		     (unsigned long long)(entry->duration_ns % 1000), getpid(), entry->tid, format,
+		     entry->width, entry->height, (unsigned long long)entry->use_flags,
+		     entry->handle, (unsigned long long)entry->bytes, entry->result);
+	*first = false;
+}
+
+/**
+ * Android-EMU:
+ * write the trace as JSON trace events, which Perfetto and chrome://tracing
+ * open, a complete event per call
+ */
+int drv_trace_export(int fd)
+{
+	struct trace_out out = { .fd = fd };
+	bool first = true;
+
+	trace_printf(&out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	trace_walk(&out, trace_export_entry, &first);
+	trace_printf(&out, "\n]}\n");
+	trace_flush(&out);
+	return -out.error;
+}
+
+/**
+ * Android-EMU:
+ * export the trace to the file MINIGBM_TRACE names, if it names one; this
+ * runs once, when the process exits or the library is unloaded, so every
+ * driver the process opened and closed ends up in the one file
+ */
+__attribute__((destructor)) static void trace_export_at_exit(void)
+{
+	const char *path = getenv(DRV_TRACE_ENV);
+	int fd, ret;
+
+	if (!drv_trace_enabled() || !path || !strchr(path, '/'))
+		return;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		drv_log("opening the trace file %s failed with %s\n", path, strerror(errno));
+		return;
+	}
+
+	ret = drv_trace_export(fd);
+	if (ret)
+		drv_log("exporting the trace failed with %s\n", strerror(-ret));
+
+	close(fd);
+}
+
+/* Android-EMU: end of modification */
@@ -0,0 +1,48 @@
+/*
+ * Copyright 2014 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/* Android-EMU: start of modification */
+
+#ifndef DRV_TRACE_H
+#define DRV_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "drv.h"
+
+/**
+ * Android-EMU:
+ * the buffer operations the trace records, timed from entry to return
+ */
+enum drv_trace_event {
+	DRV_TRACE_BO_CREATE,
+	DRV_TRACE_BO_DESTROY,
+	DRV_TRACE_BO_MAP,
+	DRV_TRACE_BO_FLUSH,
+	DRV_TRACE_BO_INVALIDATE,
+	DRV_TRACE_BO_IMPORT,
+	DRV_TRACE_BO_CREATE_ARRAY,
+	DRV_TRACE_BO_READBACK,
+	DRV_TRACE_EVENT_COUNT,
+};
+
+bool drv_trace_enabled(void);
+
+void drv_trace_set_enabled(bool enabled);
+
+uint64_t drv_trace_begin(void);
+
+void drv_trace_end(uint64_t start, enum drv_trace_event event, struct bo *bo, uint32_t width,
+		   uint32_t height, uint64_t bytes, int result);
+
+int drv_trace_dump(int fd);
+
+int drv_trace_export(int fd);
+
+#endif
+
+/* Android-EMU: end of modification */
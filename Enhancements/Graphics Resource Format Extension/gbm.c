@@ -5,6 +5,7 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -14,8 +15,10 @@
 #include <xf86drm.h>
 
 #include "drv.h"
+#include "drv_convert.h"
 #include "gbm_helpers.h"
 #include "gbm_priv.h"
+#include "helpers.h"
 #include "util.h"
 
 PUBLIC int gbm_device_get_fd(struct gbm_device *gbm)
@@ -38,7 +41,12 @@ PUBLIC int gbm_device_is_format_supported(struct gbm_device *gbm, uint32_t forma
 
 	use_flags = gbm_convert_usage(usage);
 
-	return (drv_get_combination(gbm->drv, format, use_flags) != NULL);
+	/* Android-EMU: start of modification */
+
+	// Android-EMU: probe the indexed combinations of the format only
+	return (drv_find_combination(gbm->drv, format, use_flags) != NULL);
+
+	/* Android-EMU: end of modification */
 }
 
 PUBLIC struct gbm_device *gbm_create_device(int fd)
@@ -135,6 +143,65 @@ PUBLIC struct gbm_bo *gbm_bo_create(struct gbm_device *gbm, uint32_t width, uint
 	return bo;
 }
 
+/* Android-EMU: start of modification */
+
+/**
+ * Android-EMU:
+ * create count identical buffers at once, e.g. a swapchain or a codec's
+ * output queue; returns 0 and fills bos, or a negative errno and creates none
+ */
+PUBLIC int gbm_bo_create_array(struct gbm_device *gbm, uint32_t width, uint32_t height,
+			       uint32_t format, uint32_t usage, uint32_t count, struct gbm_bo **bos)
+{
+	int ret;
+	uint32_t i;
+	struct bo **drv_bos;
+
+	if (!count)
+		return -EINVAL;
+
+	if (!gbm_device_is_format_supported(gbm, format, usage))
+		return -EINVAL;
+
+	drv_bos = (struct bo **)calloc(count, sizeof(*drv_bos));
+	if (!drv_bos)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i++) {
+		bos[i] = gbm_bo_new(gbm, format);
+		if (!bos[i]) {
+			ret = -ENOMEM;
+			goto fail;
+		}
+	}
+
+	// Android-EMU: map minigbm YV12 format to Android YV12 format
+	if (format == GBM_FORMAT_YVU420 && (usage & GBM_BO_USE_LINEAR))
+		format = DRM_FORMAT_YVU420_ANDROID;
+
+	ret = drv_bo_create_array(gbm->drv, width, height, format, gbm_convert_usage(usage), count,
+				  drv_bos);
+	if (ret)
+		goto fail;
+
+	for (i = 0; i < count; i++)
+		bos[i]->bo = drv_bos[i];
+
+	free(drv_bos);
+	return 0;
+
+fail:
+	while (i--) {
+		free(bos[i]);
+		bos[i] = NULL;
+	}
+
+	free(drv_bos);
+	return ret;
+}
+
+/* Android-EMU: end of modification */
+
 PUBLIC struct gbm_bo *gbm_bo_create_with_modifiers(struct gbm_device *gbm, uint32_t width,
 						   uint32_t height, uint32_t format,
 						   const uint64_t *modifiers, uint32_t count)
@@ -261,6 +328,32 @@ PUBLIC void gbm_bo_unmap(struct gbm_bo *bo, void *map_data)
 	drv_bo_flush_or_unmap(bo->bo, map_data);
 }
 
+/* Android-EMU: start of modification */
+
+/**
+ * Android-EMU:
+ * copy the rectangle x, y, width, height of a buffer into dst, an image of
+ * dst_width x dst_height in a 32-bit RGB format, downscaled if it is smaller
+ * than the rectangle, e.g. for screenshots; returns 0 or a negative errno
+ */
+PUBLIC int gbm_bo_readback(struct gbm_bo *bo, uint32_t x, uint32_t y, uint32_t width,
+			   uint32_t height, uint32_t dst_width, uint32_t dst_height,
+			   uint32_t dst_format, uint32_t dst_stride, void *dst)
+{
+	struct rectangle rect = { .x = x, .y = y, .width = width, .height = height };
+	struct drv_image image;
+	uint32_t offset = 0;
+
+	// the destination is a single plane of 32-bit RGB
+	if (!bo || !dst || drv_num_planes_from_format(dst_format) != 1)
+		return -EINVAL;
+
+	drv_image_init(&image, dst_format, dst_width, dst_height, dst, &dst_stride, &offset);
+	return drv_bo_readback(bo->bo, &rect, &image);
+}
+
+/* Android-EMU: end of modification */
+
 PUBLIC uint32_t gbm_bo_get_width(struct gbm_bo *bo)
 {
 	return drv_bo_get_width(bo->bo);
@@ -313,11 +406,25 @@ PUBLIC size_t gbm_bo_get_num_planes(struct gbm_bo *bo)
 
 PUBLIC union gbm_bo_handle gbm_bo_get_plane_handle(struct gbm_bo *bo, size_t plane)
 {
+	/* Android-EMU: start of modification */
+
+	// Android-EMU: the caller may export the handle on its own
+	drv_bo_mark_shared(bo->bo);
+
+	/* Android-EMU: end of modification */
+
 	return (union gbm_bo_handle)drv_bo_get_plane_handle(bo->bo, plane).u64;
 }
 
 PUBLIC int gbm_bo_get_plane_fd(struct gbm_bo *bo, size_t plane)
 {
+	/* Android-EMU: start of modification */
+
+	// Android-EMU: the buffer may be handed to other processes
+	drv_bo_mark_shared(bo->bo);
+
+	/* Android-EMU: end of modification */
+
 	return drv_bo_get_plane_fd(bo->bo, plane);
 }
 
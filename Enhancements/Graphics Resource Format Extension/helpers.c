@@ -6,15 +6,23 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <unistd.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include "drv_convert.h"
+#include "drv_formats.h"
+#include "drv_layout.h"
+#include "drv_mapping.h"
 #include "drv_priv.h"
+#include "drv_trace.h"
 #include "helpers.h"
 #include "util.h"
 
@@ -71,78 +79,111 @@ static const struct planar_layout triplanar_yuv_420_layout = {
 
 // clang-format on
 
-static const struct planar_layout *layout_from_format(uint32_t format)
+/* Android-EMU: start of modification */
+
+struct format_layout {
+	uint32_t format;
+	const struct planar_layout *layout;
+	uint32_t stride_align;
+	uint32_t flags;
+};
+
+// Android-EMU: generated from the format table of drv_formats.h
+#define FORMAT_LAYOUT(fourcc, layout, virgl_format, stride_align, flags)                           \
+	{ fourcc, &layout, stride_align, flags },
+
+static const struct format_layout format_layouts[] = { DRV_FORMATS(FORMAT_LAYOUT) };
+
+#undef FORMAT_LAYOUT
+
+#define FORMAT_LAYOUT_TABLE_BITS 7
+#define FORMAT_LAYOUT_TABLE_SIZE (1 << FORMAT_LAYOUT_TABLE_BITS)
+
+static struct format_layout format_layout_table[FORMAT_LAYOUT_TABLE_SIZE];
+static pthread_once_t format_layout_once = PTHREAD_ONCE_INIT;
+
+static inline uint32_t format_layout_slot(uint32_t format)
 {
-	switch (format) {
-	case DRM_FORMAT_BGR233:
-	case DRM_FORMAT_C8:
-	case DRM_FORMAT_R8:
-	case DRM_FORMAT_RGB332:
-		return &packed_1bpp_layout;
-
-	case DRM_FORMAT_YVU420:
-	case DRM_FORMAT_YVU420_ANDROID:
-		return &triplanar_yuv_420_layout;
-
-	case DRM_FORMAT_NV12:
-	case DRM_FORMAT_NV21:
-		return &biplanar_yuv_420_layout;
-
-	case DRM_FORMAT_ABGR1555:
-	case DRM_FORMAT_ABGR4444:
-	case DRM_FORMAT_ARGB1555:
-	case DRM_FORMAT_ARGB4444:
-	case DRM_FORMAT_BGR565:
-	case DRM_FORMAT_BGRA4444:
-	case DRM_FORMAT_BGRA5551:
-	case DRM_FORMAT_BGRX4444:
-	case DRM_FORMAT_BGRX5551:
-	case DRM_FORMAT_GR88:
-	case DRM_FORMAT_RG88:
-	case DRM_FORMAT_RGB565:
-	case DRM_FORMAT_RGBA4444:
-	case DRM_FORMAT_RGBA5551:
-	case DRM_FORMAT_RGBX4444:
-	case DRM_FORMAT_RGBX5551:
-	case DRM_FORMAT_UYVY:
-	case DRM_FORMAT_VYUY:
-	case DRM_FORMAT_XBGR1555:
-	case DRM_FORMAT_XBGR4444:
-	case DRM_FORMAT_XRGB1555:
-	case DRM_FORMAT_XRGB4444:
-	case DRM_FORMAT_YUYV:
-	case DRM_FORMAT_YVYU:
-		return &packed_2bpp_layout;
-
-	case DRM_FORMAT_BGR888:
-	case DRM_FORMAT_RGB888:
-		return &packed_3bpp_layout;
-
-	case DRM_FORMAT_ABGR2101010:
-	case DRM_FORMAT_ABGR8888:
-	case DRM_FORMAT_ARGB2101010:
-	case DRM_FORMAT_ARGB8888:
-	case DRM_FORMAT_AYUV:
-	case DRM_FORMAT_BGRA1010102:
-	case DRM_FORMAT_BGRA8888:
-	case DRM_FORMAT_BGRX1010102:
-	case DRM_FORMAT_BGRX8888:
-	case DRM_FORMAT_RGBA1010102:
-	case DRM_FORMAT_RGBA8888:
-	case DRM_FORMAT_RGBX1010102:
-	case DRM_FORMAT_RGBX8888:
-	case DRM_FORMAT_XBGR2101010:
-	case DRM_FORMAT_XBGR8888:
-	case DRM_FORMAT_XRGB2101010:
-	case DRM_FORMAT_XRGB8888:
-		return &packed_4bpp_layout;
-
-	default:
-		drv_log("UNKNOWN FORMAT %d\n", format);
-		return NULL;
+	return (format * 0x9e3779b1u) >> (32 - FORMAT_LAYOUT_TABLE_BITS);
+}
+
+/**
+ * Android-EMU:
+ * build the fourcc-indexed layout table; it is less than half full, so
+ * lookups probe one or two slots
+ */
+static void format_layout_table_init(void)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(format_layouts); i++) {
+		uint32_t slot = format_layout_slot(format_layouts[i].format);
+
+		while (format_layout_table[slot].layout)
+			slot = (slot + 1) & (FORMAT_LAYOUT_TABLE_SIZE - 1);
+
+		format_layout_table[slot] = format_layouts[i];
 	}
 }
 
+/**
+ * Android-EMU:
+ * look a format up in a hash table instead of a switch over all fourcc
+ * codes, as it is queried for every plane of every allocation
+ */
+static const struct format_layout *format_layout_find(uint32_t format)
+{
+	uint32_t slot;
+
+	pthread_once(&format_layout_once, format_layout_table_init);
+
+	for (slot = format_layout_slot(format); format_layout_table[slot].layout;
+	     slot = (slot + 1) & (FORMAT_LAYOUT_TABLE_SIZE - 1)) {
+		if (format_layout_table[slot].format == format)
+			return &format_layout_table[slot];
+	}
+
+	drv_log("UNKNOWN FORMAT %d\n", format);
+	return NULL;
+}
+
+static const struct planar_layout *layout_from_format(uint32_t format)
+{
+	const struct format_layout *entry = format_layout_find(format);
+
+	return entry ? entry->layout : NULL;
+}
+
+/**
+ * Android-EMU:
+ * the alignment in bytes the stride of a plane of a format needs
+ */
+uint32_t drv_stride_align_from_format(uint32_t format, size_t plane)
+{
+	const struct format_layout *entry = format_layout_find(format);
+	uint32_t align;
+
+	if (!entry || plane >= entry->layout->num_planes)
+		return 1;
+
+	align = entry->stride_align / entry->layout->horizontal_subsampling[plane];
+	return align ? align : 1;
+}
+
+/**
+ * Android-EMU:
+ * whether the planes of a format follow the buffer's height, never an
+ * aligned one
+ */
+bool drv_format_fixed_height(uint32_t format)
+{
+	const struct format_layout *entry = format_layout_find(format);
+
+	return entry && (entry->flags & DRV_FORMAT_FIXED_HEIGHT);
+}
+
+/* Android-EMU: end of modification */
+
 size_t drv_num_planes_from_format(uint32_t format)
 {
 	const struct planar_layout *layout = layout_from_format(format);
@@ -166,6 +207,23 @@ uint32_t drv_height_from_format(uint32_t format, uint32_t height, size_t plane)
 	return DIV_ROUND_UP(height, layout->vertical_subsampling[plane]);
 }
 
+/* Android-EMU: start of modification */
+
+/**
+ * Android-EMU:
+ * the width of a plane, i.e., the horizontal counterpart of drv_height_from_format()
+ */
+uint32_t drv_width_from_format(uint32_t format, uint32_t width, size_t plane)
+{
+	const struct planar_layout *layout = layout_from_format(format);
+
+	assert(plane < layout->num_planes);
+
+	return DIV_ROUND_UP(width, layout->horizontal_subsampling[plane]);
+}
+
+/* Android-EMU: end of modification */
+
 uint32_t drv_bytes_per_pixel_from_format(uint32_t format, size_t plane)
 {
 	const struct planar_layout *layout = layout_from_format(format);
@@ -190,8 +248,13 @@ uint32_t drv_stride_from_format(uint32_t format, uint32_t width, size_t plane)
 	 * The stride of Android YV12 buffers is required to be aligned to 16 bytes
 	 * (see <system/graphics.h>).
 	 */
-	if (format == DRM_FORMAT_YVU420_ANDROID)
-		stride = (plane == 0) ? ALIGN(stride, 32) : ALIGN(stride, 16);
+
+	/* Android-EMU: start of modification */
+
+	// Android-EMU: the alignment comes from the format table
+	stride = ALIGN(stride, drv_stride_align_from_format(format, plane));
+
+	/* Android-EMU: end of modification */
 
 	return stride;
 }
@@ -207,14 +270,71 @@ static uint32_t subsample_stride(uint32_t stride, uint32_t format, size_t plane)
 		switch (format) {
 		case DRM_FORMAT_YVU420:
 		case DRM_FORMAT_YVU420_ANDROID:
+		/* Android-EMU: start of modification */
+		case DRM_FORMAT_YUV420:
+		/* Android-EMU: end of modification */
 			stride = DIV_ROUND_UP(stride, 2);
 			break;
+		/* Android-EMU: start of modification */
+		// Android-EMU: an odd width still has a whole CbCr pair at the end of the row
+		case DRM_FORMAT_NV12:
+		case DRM_FORMAT_NV21:
+			stride = ALIGN(stride, 2);
+			break;
+		/* Android-EMU: end of modification */
 		}
 	}
 
 	return stride;
 }
 
+/* Android-EMU: start of modification */
+
+/**
+ * Android-EMU:
+ * the planes of a format packed back to back, given the stride of the first
+ * plane; the format's layout is looked up once for all planes
+ */
+static void layout_fill(const struct planar_layout *layout, uint32_t format, uint32_t stride,
+			uint32_t aligned_height, struct drv_layout *out)
+{
+	size_t p;
+	uint32_t offset = 0;
+
+	out->num_planes = layout->num_planes;
+	for (p = 0; p < layout->num_planes; p++) {
+		out->strides[p] = subsample_stride(stride, format, p);
+		out->sizes[p] = out->strides[p] *
+				DIV_ROUND_UP(aligned_height, layout->vertical_subsampling[p]);
+		out->offsets[p] = offset;
+		offset += out->sizes[p];
+	}
+
+	out->total_size = offset;
+}
+
+/**
+ * Android-EMU:
+ * strides, sizes, and offsets of all planes of a width x height buffer with
+ * the minimal stride of drv_stride_from_format(), in one call
+ */
+int drv_layout_compute(uint32_t format, uint32_t width, uint32_t height, struct drv_layout *out)
+{
+	const struct planar_layout *layout = layout_from_format(format);
+	uint32_t stride;
+
+	if (!layout)
+		return -EINVAL;
+
+	stride = DIV_ROUND_UP(width, layout->horizontal_subsampling[0]) * layout->bytes_per_pixel[0];
+	stride = ALIGN(stride, drv_stride_align_from_format(format, 0));
+
+	layout_fill(layout, format, stride, height, out);
+	return 0;
+}
+
+/* Android-EMU: end of modification */
+
 /*
  * This function fills in the buffer object given the driver aligned stride of
  * the first plane, height and a format. This function assumes there is just
@@ -223,11 +343,16 @@ static uint32_t subsample_stride(uint32_t stride, uint32_t format, size_t plane)
 int drv_bo_from_format(struct bo *bo, uint32_t stride, uint32_t aligned_height, uint32_t format)
 {
 
-	size_t p, num_planes;
-	uint32_t offset = 0;
+	size_t p;
+	const struct planar_layout *layout = layout_from_format(format);
+
+	/* Android-EMU: start of modification */
+
+	struct drv_layout planes;
+
+	/* Android-EMU: end of modification */
 
-	num_planes = drv_num_planes_from_format(format);
-	assert(num_planes);
+	assert(layout);
 
 	/*
 	 * HAL_PIXEL_FORMAT_YV12 requires that (see <system/graphics.h>):
@@ -235,19 +360,28 @@ int drv_bo_from_format(struct bo *bo, uint32_t stride, uint32_t aligned_height,
 	 *  - the chroma stride is 16 bytes aligned, i.e., the luma's strides
 	 *    is 32 bytes aligned.
 	 */
-	if (format == DRM_FORMAT_YVU420_ANDROID) {
+
+	/* Android-EMU: start of modification */
+
+	if (drv_format_fixed_height(format))
 		assert(aligned_height == bo->height);
-		assert(stride == ALIGN(stride, 32));
-	}
+	assert(stride == ALIGN(stride, drv_stride_align_from_format(format, 0)));
 
-	for (p = 0; p < num_planes; p++) {
-		bo->strides[p] = subsample_stride(stride, format, p);
-		bo->sizes[p] = drv_size_from_format(format, bo->strides[p], aligned_height, p);
-		bo->offsets[p] = offset;
-		offset += bo->sizes[p];
+	/* Android-EMU: end of modification */
+
+	/* Android-EMU: start of modification */
+
+	layout_fill(layout, format, stride, aligned_height, &planes);
+	for (p = 0; p < planes.num_planes; p++) {
+		bo->strides[p] = planes.strides[p];
+		bo->sizes[p] = planes.sizes[p];
+		bo->offsets[p] = planes.offsets[p];
 	}
 
-	bo->total_size = offset;
+	bo->total_size = planes.total_size;
+
+	/* Android-EMU: end of modification */
+
 	return 0;
 }
 
@@ -261,13 +395,16 @@ int drv_dumb_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t
 
 	aligned_width = width;
 	aligned_height = height;
-	if (format == DRM_FORMAT_YVU420_ANDROID) {
-		/*
-		 * Align width to 32 pixels, so chroma strides are 16 bytes as
-		 * Android requires.
-		 */
-		aligned_width = ALIGN(width, 32);
-	}
+
+	/* Android-EMU: start of modification */
+
+	/*
+	 * Align width to the format's stride alignment, so chroma strides of
+	 * YV12 are 16 bytes as Android requires.
+	 */
+	aligned_width = ALIGN(width, drv_stride_align_from_format(format, 0));
+
+	/* Android-EMU: end of modification */
 
 	if (format == DRM_FORMAT_YVU420_ANDROID || format == DRM_FORMAT_YVU420) {
 		aligned_height = 3 * DIV_ROUND_UP(height, 2);
@@ -352,6 +489,12 @@ int drv_prime_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 	size_t plane;
 	struct drm_prime_handle prime_handle;
 
+	/* Android-EMU: start of modification */
+
+	uint64_t start = drv_trace_begin();
+
+	/* Android-EMU: end of modification */
+
 	for (plane = 0; plane < bo->num_planes; plane++) {
 		memset(&prime_handle, 0, sizeof(prime_handle));
 		prime_handle.fd = data->fds[plane];
@@ -369,21 +512,121 @@ int drv_prime_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 			 */
 			bo->num_planes = plane;
 			drv_gem_bo_destroy(bo);
+
+			/* Android-EMU: start of modification */
+
+			drv_trace_end(start, DRV_TRACE_BO_IMPORT, bo, data->width, data->height, 0,
+				      ret);
+
+			/* Android-EMU: end of modification */
+
 			return ret;
 		}
 
 		bo->handles[plane].u32 = prime_handle.handle;
 	}
 
-	for (plane = 0; plane < bo->num_planes; plane++) {
-		pthread_mutex_lock(&bo->drv->driver_lock);
+	/* Android-EMU: start of modification */
+
+	// Android-EMU: the reference counts are atomic, imports need not serialize
+	for (plane = 0; plane < bo->num_planes; plane++)
 		drv_increment_reference_count(bo->drv, bo, plane);
-		pthread_mutex_unlock(&bo->drv->driver_lock);
+
+	/* Android-EMU: end of modification */
+
+	/* Android-EMU: start of modification */
+
+	// Android-EMU: another process owns the buffer as well
+	drv_bo_mark_shared(bo);
+
+	// Android-EMU: trace the import, with the size of the dma-buf (the end of
+	// its file), only looked up when tracing
+	if (start) {
+		off_t size = lseek(data->fds[0], 0, SEEK_END);
+		drv_trace_end(start, DRV_TRACE_BO_IMPORT, bo, data->width, data->height,
+			      size > 0 ? size : 0, 0);
 	}
 
+	/* Android-EMU: end of modification */
+
 	return 0;
 }
 
+/* Android-EMU: start of modification */
+
+// Android-EMU: GEM handles of buffers that other processes may hold, i.e.,
+// imported or handed out to the caller. The value is the driver the handle
+// belongs to, or SHARED_BY_DRIVERS when handles of several drivers collide,
+// which only errs on the side of treating a buffer as shared.
+#define SHARED_BY_DRIVERS ((void *)1)
+
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static void *shared_table;
+
+/**
+ * Android-EMU:
+ * record that the buffer is (or may become) visible to other processes,
+ * so its handles must not be recycled for another buffer
+ */
+void drv_bo_mark_shared(struct bo *bo)
+{
+	size_t plane;
+	void *owner;
+
+	pthread_mutex_lock(&shared_lock);
+	if (!shared_table)
+		shared_table = drmHashCreate();
+
+	for (plane = 0; shared_table && plane < bo->num_planes; plane++) {
+		if (drmHashLookup(shared_table, bo->handles[plane].u32, &owner)) {
+			drmHashInsert(shared_table, bo->handles[plane].u32, bo->drv);
+		} else if (owner != bo->drv) {
+			drmHashDelete(shared_table, bo->handles[plane].u32);
+			drmHashInsert(shared_table, bo->handles[plane].u32, SHARED_BY_DRIVERS);
+		}
+	}
+	pthread_mutex_unlock(&shared_lock);
+}
+
+/**
+ * Android-EMU:
+ * check if any plane of the buffer is shared
+ */
+bool drv_bo_is_shared(struct bo *bo)
+{
+	size_t plane;
+	void *owner;
+	bool shared = false;
+
+	pthread_mutex_lock(&shared_lock);
+	for (plane = 0; shared_table && !shared && plane < bo->num_planes; plane++) {
+		if (!drmHashLookup(shared_table, bo->handles[plane].u32, &owner))
+			shared = (owner == bo->drv || owner == SHARED_BY_DRIVERS);
+	}
+	pthread_mutex_unlock(&shared_lock);
+
+	return shared;
+}
+
+/**
+ * Android-EMU:
+ * forget the buffer's handles once they are closed, as the kernel reuses them
+ */
+void drv_bo_clear_shared(struct bo *bo)
+{
+	size_t plane;
+	void *owner;
+
+	pthread_mutex_lock(&shared_lock);
+	for (plane = 0; shared_table && plane < bo->num_planes; plane++) {
+		if (!drmHashLookup(shared_table, bo->handles[plane].u32, &owner) && owner == bo->drv)
+			drmHashDelete(shared_table, bo->handles[plane].u32);
+	}
+	pthread_mutex_unlock(&shared_lock);
+}
+
+/* Android-EMU: end of modification */
+
 void *drv_dumb_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
 {
 	int ret;
@@ -412,6 +655,324 @@ int drv_bo_munmap(struct bo *bo, struct vma *vma)
 	return munmap(vma->addr, vma->length);
 }
 
+/* Android-EMU: start of modification */
+
+// Android-EMU: per driver, an index of the mappings drv_bo_map() makes through
+// drv_mapping_append(), listed by the GEM handle they map, so a buffer's
+// mappings and vmas are found without a scan. Indexed mappings live in their
+// index node instead of drv->mappings, at a stable address, and the nodes are
+// kept in a dense array where each node knows its slot, so removal swaps the
+// last node into the freed slot. drv_bo_map()/drv_bo_unmap() fill the index
+// through drv_mapping.h once drv.c.patch is applied; mappings that went to
+// drv->mappings (an unpatched drv.c, or an index that could not grow) are
+// still found by a scan.
+struct mapping_node {
+	struct mapping mapping;
+	uint32_t handle; /* of the vma, which may go before the node */
+	uint32_t slot;	 /* in mapping_index.nodes */
+	struct mapping_node *prev;
+	struct mapping_node *next;
+};
+
+struct mapping_index {
+	void *by_handle;  /* handle -> first node */
+	void *by_mapping; /* mapping -> node, to tell indexed mappings apart */
+	struct mapping_node **nodes;
+	uint32_t count;
+	uint32_t capacity;
+};
+
+static pthread_mutex_t mapping_index_lock = PTHREAD_MUTEX_INITIALIZER;
+static void *mapping_indexes;
+
+static struct mapping_index *mapping_index_get(struct driver *drv, bool create)
+{
+	struct mapping_index *index;
+
+	if (!mapping_indexes && create)
+		mapping_indexes = drmHashCreate();
+	if (!mapping_indexes)
+		return NULL;
+
+	if (!drmHashLookup(mapping_indexes, (unsigned long)drv, (void **)&index))
+		return index;
+	if (!create)
+		return NULL;
+
+	index = calloc(1, sizeof(*index));
+	if (!index)
+		return NULL;
+
+	index->by_handle = drmHashCreate();
+	index->by_mapping = drmHashCreate();
+	if (!index->by_handle || !index->by_mapping) {
+		if (index->by_handle)
+			drmHashDestroy(index->by_handle);
+		if (index->by_mapping)
+			drmHashDestroy(index->by_mapping);
+		free(index);
+		return NULL;
+	}
+
+	drmHashInsert(mapping_indexes, (unsigned long)drv, index);
+	return index;
+}
+
+static void mapping_index_unlink(struct mapping_index *index, struct mapping_node *node)
+{
+	struct mapping_node *last;
+
+	if (node->next)
+		node->next->prev = node->prev;
+
+	if (node->prev) {
+		node->prev->next = node->next;
+	} else {
+		drmHashDelete(index->by_handle, node->handle);
+		if (node->next)
+			drmHashInsert(index->by_handle, node->handle, node->next);
+	}
+
+	drmHashDelete(index->by_mapping, (unsigned long)&node->mapping);
+
+	last = index->nodes[--index->count];
+	index->nodes[node->slot] = last;
+	last->slot = node->slot;
+	free(node);
+}
+
+/**
+ * Android-EMU:
+ * store a mapping in the index, or append it to drv->mappings if the index
+ * cannot grow; returns the stored mapping
+ */
+struct mapping *drv_mapping_append(struct driver *drv, struct mapping *mapping)
+{
+	struct mapping_index *index;
+	struct mapping_node *node = NULL, *first, **nodes;
+	uint32_t capacity;
+
+	pthread_mutex_lock(&mapping_index_lock);
+	index = mapping_index_get(drv, true);
+	if (index && index->count == index->capacity) {
+		capacity = index->capacity ? 2 * index->capacity : 64;
+		nodes = realloc(index->nodes, sizeof(*nodes) * capacity);
+		if (nodes) {
+			index->nodes = nodes;
+			index->capacity = capacity;
+		}
+	}
+
+	if (index && index->count < index->capacity)
+		node = calloc(1, sizeof(*node));
+
+	if (node) {
+		node->mapping = *mapping;
+		node->handle = mapping->vma->handle;
+		node->slot = index->count;
+		index->nodes[index->count++] = node;
+		if (!drmHashLookup(index->by_handle, node->handle, (void **)&first)) {
+			node->next = first;
+			first->prev = node;
+			drmHashDelete(index->by_handle, node->handle);
+		}
+
+		drmHashInsert(index->by_handle, node->handle, node);
+		drmHashInsert(index->by_mapping, (unsigned long)&node->mapping, node);
+	}
+	pthread_mutex_unlock(&mapping_index_lock);
+
+	return node ? &node->mapping : drv_array_append(drv->mappings, mapping);
+}
+
+/**
+ * Android-EMU:
+ * remove a mapping from drv->mappings; the array is searched by pointer only,
+ * from both ends, as buffers tend to be released first-in first-out (queues)
+ * or last-in first-out (teardown)
+ */
+static int mapping_array_remove(struct driver *drv, struct mapping *mapping)
+{
+	uint32_t lo = 0, hi = drv_array_size(drv->mappings);
+
+	while (lo < hi) {
+		if (drv_array_at_idx(drv->mappings, lo) == mapping) {
+			drv_array_remove(drv->mappings, lo);
+			return 0;
+		}
+
+		if (drv_array_at_idx(drv->mappings, --hi) == mapping) {
+			drv_array_remove(drv->mappings, hi);
+			return 0;
+		}
+
+		lo++;
+	}
+
+	return -ENOENT;
+}
+
+/**
+ * Android-EMU:
+ * remove a mapping from the index in constant time, or from drv->mappings
+ */
+int drv_mapping_remove(struct driver *drv, struct mapping *mapping)
+{
+	struct mapping_index *index;
+	struct mapping_node *node;
+
+	pthread_mutex_lock(&mapping_index_lock);
+	index = mapping_index_get(drv, false);
+	if (index && !drmHashLookup(index->by_mapping, (unsigned long)mapping, (void **)&node)) {
+		mapping_index_unlink(index, node);
+		pthread_mutex_unlock(&mapping_index_lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&mapping_index_lock);
+
+	return mapping_array_remove(drv, mapping);
+}
+
+/**
+ * Android-EMU:
+ * the mapping of a handle with the same rectangle and map flags, if any, so
+ * drv_bo_map() can take another reference of it
+ */
+struct mapping *drv_mapping_find(struct driver *drv, uint32_t handle, const struct rectangle *rect,
+				 uint32_t map_flags)
+{
+	struct mapping *found = NULL, *mapping;
+	struct mapping_index *index;
+	struct mapping_node *node;
+	uint32_t idx;
+
+	pthread_mutex_lock(&mapping_index_lock);
+	index = mapping_index_get(drv, false);
+	if (index && !drmHashLookup(index->by_handle, handle, (void **)&node)) {
+		for (; node; node = node->next) {
+			if (node->mapping.vma->map_flags == map_flags &&
+			    !memcmp(rect, &node->mapping.rect, sizeof(*rect))) {
+				found = &node->mapping;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&mapping_index_lock);
+
+	for (idx = 0; !found && idx < drv_array_size(drv->mappings); idx++) {
+		mapping = drv_array_at_idx(drv->mappings, idx);
+		if (mapping->vma->handle == handle && mapping->vma->map_flags == map_flags &&
+		    !memcmp(rect, &mapping->rect, sizeof(*rect)))
+			found = mapping;
+	}
+
+	return found;
+}
+
+/**
+ * Android-EMU:
+ * the vma already mapping a handle with the same map flags, if any, so it can
+ * be shared
+ */
+struct vma *drv_mapping_find_vma(struct driver *drv, uint32_t handle, uint32_t map_flags)
+{
+	struct vma *vma = NULL;
+	struct mapping_index *index;
+	struct mapping_node *node;
+	uint32_t idx;
+
+	pthread_mutex_lock(&mapping_index_lock);
+	index = mapping_index_get(drv, false);
+	if (index && !drmHashLookup(index->by_handle, handle, (void **)&node)) {
+		for (; node && !vma; node = node->next) {
+			if (node->mapping.vma->map_flags == map_flags)
+				vma = node->mapping.vma;
+		}
+	}
+	pthread_mutex_unlock(&mapping_index_lock);
+
+	for (idx = 0; !vma && idx < drv_array_size(drv->mappings); idx++) {
+		struct mapping *mapping = drv_array_at_idx(drv->mappings, idx);
+		if (mapping->vma->handle == handle && mapping->vma->map_flags == map_flags)
+			vma = mapping->vma;
+	}
+
+	return vma;
+}
+
+/**
+ * Android-EMU:
+ * release the driver's index and the mappings left in it, from close()
+ */
+void drv_mapping_index_destroy(struct driver *drv)
+{
+	struct mapping_index *index;
+
+	pthread_mutex_lock(&mapping_index_lock);
+	index = mapping_index_get(drv, false);
+	if (index) {
+		while (index->count)
+			mapping_index_unlink(index, index->nodes[index->count - 1]);
+
+		drmHashDestroy(index->by_handle);
+		drmHashDestroy(index->by_mapping);
+		drmHashDelete(mapping_indexes, (unsigned long)drv);
+		free(index->nodes);
+		free(index);
+	}
+	pthread_mutex_unlock(&mapping_index_lock);
+}
+
+/**
+ * Android-EMU:
+ * drop one reference of a mapping's vma, unmapping it with the last one
+ */
+static int mapping_release_vma(struct bo *bo, struct mapping *mapping)
+{
+	int ret;
+
+	if (!--mapping->vma->refcount) {
+		ret = bo->drv->backend->bo_unmap(bo, mapping->vma);
+		if (ret) {
+			drv_log("munmap failed\n");
+			return ret;
+		}
+
+		free(mapping->vma);
+	}
+
+	return 0;
+}
+
+/**
+ * Android-EMU:
+ * release the indexed mappings of a buffer, visiting only its own
+ */
+static int mapping_destroy_indexed(struct bo *bo)
+{
+	int ret = 0;
+	size_t plane;
+	struct mapping_index *index;
+	struct mapping_node *node;
+
+	pthread_mutex_lock(&mapping_index_lock);
+	index = mapping_index_get(bo->drv, false);
+	for (plane = 0; index && plane < bo->num_planes && !ret; plane++) {
+		while (!drmHashLookup(index->by_handle, bo->handles[plane].u32, (void **)&node)) {
+			ret = mapping_release_vma(bo, &node->mapping);
+			if (ret)
+				break;
+
+			mapping_index_unlink(index, node);
+		}
+	}
+	pthread_mutex_unlock(&mapping_index_lock);
+
+	return ret;
+}
+
+/* Android-EMU: end of modification */
+
 int drv_mapping_destroy(struct bo *bo)
 {
 	int ret;
@@ -424,6 +985,14 @@ int drv_mapping_destroy(struct bo *bo)
 	 * associated with the buffer.
 	 */
 
+	/* Android-EMU: start of modification */
+
+	ret = mapping_destroy_indexed(bo);
+	if (ret)
+		return ret;
+
+	/* Android-EMU: end of modification */
+
 	idx = 0;
 	for (plane = 0; plane < bo->num_planes; plane++) {
 		while (idx < drv_array_size(bo->drv->mappings)) {
@@ -433,15 +1002,13 @@ int drv_mapping_destroy(struct bo *bo)
 				continue;
 			}
 
-			if (!--mapping->vma->refcount) {
-				ret = bo->drv->backend->bo_unmap(bo, mapping->vma);
-				if (ret) {
-					drv_log("munmap failed\n");
-					return ret;
-				}
+			/* Android-EMU: start of modification */
 
-				free(mapping->vma);
-			}
+			ret = mapping_release_vma(bo, mapping);
+			if (ret)
+				return ret;
+
+			/* Android-EMU: end of modification */
 
 			/* This shrinks and shifts the array, so don't increment idx. */
 			drv_array_remove(bo->drv->mappings, idx);
@@ -456,36 +1023,314 @@ int drv_get_prot(uint32_t map_flags)
 	return (BO_MAP_WRITE & map_flags) ? PROT_WRITE | PROT_READ : PROT_READ;
 }
 
+/* Android-EMU: start of modification */
+
+// Android-EMU: GEM handles are small integers the kernel allocates densely
+// from 1, so each driver counts the references of its handles in a two-level
+// array of atomic counters: chunks are allocated on first use and published
+// with a compare-and-swap, and are only freed when the driver is closed.
+// Handles beyond the array, and drivers that did not get a slot at init, fall
+// back to drv->buffer_table under handle_ref_lock.
+#define HANDLE_REF_CHUNK_BITS 10
+#define HANDLE_REF_CHUNK_SIZE (1u << HANDLE_REF_CHUNK_BITS)
+#define HANDLE_REF_CHUNKS 256
+#define HANDLE_REF_DRIVERS 4
+
+struct handle_refs {
+	_Atomic(struct driver *) drv;
+	_Atomic(atomic_uint *) chunks[HANDLE_REF_CHUNKS];
+};
+
+static struct handle_refs handle_refs[HANDLE_REF_DRIVERS];
+static pthread_mutex_t handle_ref_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Android-EMU:
+ * claim a slot for the driver's counters, from init() before any buffer exists
+ */
+int drv_handle_refs_init(struct driver *drv)
+{
+	size_t i;
+	struct driver *expected;
+
+	for (i = 0; i < HANDLE_REF_DRIVERS; i++) {
+		expected = NULL;
+		if (atomic_compare_exchange_strong(&handle_refs[i].drv, &expected, drv))
+			return 0;
+	}
+
+	return -ENOSPC;
+}
+
+/**
+ * Android-EMU:
+ * the counter of a handle, or NULL if the handle is counted in drv->buffer_table;
+ * with create, a missing chunk is allocated
+ */
+static atomic_uint *handle_ref_counter(struct driver *drv, uint32_t handle, bool create)
+{
+	size_t i;
+	struct handle_refs *refs = NULL;
+	atomic_uint *chunk, *expected_chunk = NULL;
+
+	if ((handle >> HANDLE_REF_CHUNK_BITS) >= HANDLE_REF_CHUNKS)
+		return NULL;
+
+	for (i = 0; i < HANDLE_REF_DRIVERS && !refs; i++) {
+		if (atomic_load_explicit(&handle_refs[i].drv, memory_order_acquire) == drv)
+			refs = &handle_refs[i];
+	}
+
+	if (!refs)
+		return NULL;
+
+	chunk = atomic_load_explicit(&refs->chunks[handle >> HANDLE_REF_CHUNK_BITS],
+				     memory_order_acquire);
+	if (!chunk && create) {
+		chunk = calloc(HANDLE_REF_CHUNK_SIZE, sizeof(*chunk));
+		if (!chunk)
+			return NULL;
+
+		if (!atomic_compare_exchange_strong(&refs->chunks[handle >> HANDLE_REF_CHUNK_BITS],
+						    &expected_chunk, chunk)) {
+			free(chunk);
+			chunk = expected_chunk;
+		}
+	}
+
+	return chunk ? &chunk[handle & (HANDLE_REF_CHUNK_SIZE - 1)] : NULL;
+}
+
+/**
+ * Android-EMU:
+ * release the driver's counters, once no buffer of it is left
+ */
+void drv_handle_refs_release(struct driver *drv)
+{
+	size_t i, c;
+
+	for (i = 0; i < HANDLE_REF_DRIVERS; i++) {
+		if (atomic_load(&handle_refs[i].drv) != drv)
+			continue;
+
+		for (c = 0; c < HANDLE_REF_CHUNKS; c++)
+			free(atomic_exchange(&handle_refs[i].chunks[c], NULL));
+
+		atomic_store(&handle_refs[i].drv, NULL);
+	}
+}
+
 uintptr_t drv_get_reference_count(struct driver *drv, struct bo *bo, size_t plane)
 {
 	void *count;
 	uintptr_t num = 0;
+	atomic_uint *counter = handle_ref_counter(drv, bo->handles[plane].u32, false);
+
+	if (counter)
+		return atomic_load_explicit(counter, memory_order_acquire);
 
+	pthread_mutex_lock(&handle_ref_lock);
 	if (!drmHashLookup(drv->buffer_table, bo->handles[plane].u32, &count))
 		num = (uintptr_t)(count);
+	pthread_mutex_unlock(&handle_ref_lock);
 
 	return num;
 }
 
 void drv_increment_reference_count(struct driver *drv, struct bo *bo, size_t plane)
 {
-	uintptr_t num = drv_get_reference_count(drv, bo, plane);
+	void *count;
+	uintptr_t num = 0;
+	atomic_uint *counter = handle_ref_counter(drv, bo->handles[plane].u32, true);
+
+	if (counter) {
+		atomic_fetch_add_explicit(counter, 1, memory_order_acq_rel);
+		return;
+	}
+
+	pthread_mutex_lock(&handle_ref_lock);
+	if (!drmHashLookup(drv->buffer_table, bo->handles[plane].u32, &count))
+		num = (uintptr_t)(count);
 
 	/* If a value isn't in the table, drmHashDelete is a no-op */
 	drmHashDelete(drv->buffer_table, bo->handles[plane].u32);
 	drmHashInsert(drv->buffer_table, bo->handles[plane].u32, (void *)(num + 1));
+	pthread_mutex_unlock(&handle_ref_lock);
 }
 
 void drv_decrement_reference_count(struct driver *drv, struct bo *bo, size_t plane)
 {
-	uintptr_t num = drv_get_reference_count(drv, bo, plane);
+	void *count;
+	uintptr_t num = 0;
+	unsigned int old;
+	atomic_uint *counter = handle_ref_counter(drv, bo->handles[plane].u32, false);
+
+	if (counter) {
+		// never below zero, as with the table
+		old = atomic_load_explicit(counter, memory_order_relaxed);
+		while (old > 0 && !atomic_compare_exchange_weak_explicit(
+				      counter, &old, old - 1, memory_order_acq_rel, memory_order_relaxed))
+			;
+		return;
+	}
+
+	pthread_mutex_lock(&handle_ref_lock);
+	if (!drmHashLookup(drv->buffer_table, bo->handles[plane].u32, &count))
+		num = (uintptr_t)(count);
 
 	drmHashDelete(drv->buffer_table, bo->handles[plane].u32);
 
 	if (num > 0)
 		drmHashInsert(drv->buffer_table, bo->handles[plane].u32, (void *)(num - 1));
+	pthread_mutex_unlock(&handle_ref_lock);
+}
+
+/* Android-EMU: end of modification */
+
+/* Android-EMU: start of modification */
+
+/**
+ * Android-EMU:
+ * an unallocated buffer of the array, set up as drv_bo_new() in drv.c sets
+ * up a single one; drv_bo_new() is static there, so it is not called here
+ */
+static struct bo *drv_bo_array_new(struct driver *drv, uint32_t width, uint32_t height,
+				   uint32_t format, uint64_t use_flags)
+{
+	struct bo *bo;
+
+	bo = (struct bo *)calloc(1, sizeof(*bo));
+	if (!bo)
+		return NULL;
+
+	bo->drv = drv;
+	bo->width = width;
+	bo->height = height;
+	bo->format = format;
+	bo->use_flags = use_flags;
+	bo->num_planes = drv_num_planes_from_format(format);
+
+	return bo;
+}
+
+/**
+ * Android-EMU:
+ * create count identical buffers in one pass, through the backend's
+ * bo_create_array if it has one and buffer by buffer otherwise; either all
+ * buffers are created or none, and bos is filled on success only
+ */
+int drv_bo_create_array(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
+			uint64_t use_flags, uint32_t count, struct bo **bos)
+{
+	int ret = 0;
+	size_t plane;
+	uint32_t i, created = 0;
+
+	if (!count || !drv_num_planes_from_format(format))
+		return -EINVAL;
+
+	memset(bos, 0, count * sizeof(*bos));
+	for (i = 0; i < count; i++) {
+		bos[i] = drv_bo_array_new(drv, width, height, format, use_flags);
+		if (!bos[i]) {
+			ret = -ENOMEM;
+			goto fail;
+		}
+	}
+
+	if (drv->backend->bo_create_array) {
+		ret = drv->backend->bo_create_array(bos, count, width, height, format, use_flags);
+		if (ret)
+			goto fail;
+		created = count;
+	} else {
+		for (; created < count; created++) {
+			ret = drv->backend->bo_create(bos[created], width, height, format, use_flags);
+			if (ret)
+				goto fail;
+		}
+	}
+
+	for (i = 0; i < count; i++)
+		for (plane = 0; plane < bos[i]->num_planes; plane++)
+			drv_increment_reference_count(drv, bos[i], plane);
+
+	return 0;
+
+fail:
+	for (i = 0; i < created; i++)
+		drv->backend->bo_destroy(bos[i]);
+	for (i = 0; i < count; i++) {
+		free(bos[i]);
+		bos[i] = NULL;
+	}
+
+	return ret;
+}
+
+/* Android-EMU: end of modification */
+
+/* Android-EMU: start of modification */
+
+/**
+ * Android-EMU:
+ * start reading the mapped rectangle back from the device without waiting,
+ * through the backend's bo_invalidate_async if it has one; drv_bo_invalidate()
+ * completes the readback and must precede CPU access to the mapping.
+ * fence_fd is a sync_file the caller owns that signals when the readback has
+ * landed, or -1 if there is none to wait for.
+ */
+int drv_bo_invalidate_async(struct bo *bo, struct mapping *mapping, int *fence_fd)
+{
+	*fence_fd = -1;
+
+	if (!bo->drv->backend->bo_invalidate_async)
+		return 0;
+
+	return bo->drv->backend->bo_invalidate_async(bo, mapping, fence_fd);
+}
+
+/**
+ * Android-EMU:
+ * copy a rectangle of a buffer into dst, a caller's image of 32-bit RGB that
+ * is as large as the rectangle or smaller, e.g. a screenshot or a thumbnail;
+ * the backend's bo_readback reads the rectangle back from the device alone,
+ * without a mapping, and buffers it passes on with -ENOTSUP are mapped
+ */
+int drv_bo_readback(struct bo *bo, const struct rectangle *rect, const struct drv_image *dst)
+{
+	struct mapping *mapping;
+	struct drv_image src;
+	uint8_t *addr;
+	int ret;
+
+	if (!rect->width || !rect->height || rect->x + rect->width > bo->width ||
+	    rect->y + rect->height > bo->height)
+		return -EINVAL;
+
+	if (bo->drv->backend->bo_readback) {
+		ret = bo->drv->backend->bo_readback(bo, rect, dst);
+		if (ret != -ENOTSUP)
+			return ret;
+	}
+
+	addr = drv_bo_map(bo, rect, BO_MAP_READ, &mapping, 0);
+	if (addr == MAP_FAILED)
+		return -EFAULT;
+
+	drv_image_init(&src, bo->format, bo->width, bo->height, addr - bo->offsets[0],
+		       mapping->vma->map_strides, bo->offsets);
+
+	ret = drv_image_crop(&src, rect);
+	if (!ret)
+		ret = drv_scale_image(&src, dst);
+
+	drv_bo_unmap(bo, mapping);
+	return ret;
 }
 
+/* Android-EMU: end of modification */
+
 uint32_t drv_log_base2(uint32_t value)
 {
 	int ret = 0;
@@ -510,25 +1355,260 @@ void drv_add_combinations(struct driver *drv, const uint32_t *formats, uint32_t
 	}
 }
 
+/* Android-EMU: start of modification */
+
+// Android-EMU: per driver, the combinations of drv->combos chained by format,
+// so setup and format probes only visit the few combinations of one format.
+// Combinations appended behind the index's back (e.g., by drv_add_combination())
+// are indexed on the next lookup.
+#define COMBO_NONE UINT32_MAX
+
+struct combo_slot {
+	uint32_t format;
+	uint32_t head;
+	uint32_t tail;
+};
+
+struct combo_index {
+	uint32_t num_indexed;
+	uint32_t num_formats;
+	uint32_t num_slots;
+	struct combo_slot *slots;
+	uint32_t *next;
+	uint32_t next_capacity;
+};
+
+static pthread_mutex_t combo_index_lock = PTHREAD_MUTEX_INITIALIZER;
+static void *combo_indexes;
+
+static struct combo_slot *combo_index_slot(struct combo_index *index, uint32_t format)
+{
+	uint32_t hash = format * 0x9e3779b1u;
+	uint32_t slot = (hash ^ (hash >> 16)) & (index->num_slots - 1);
+
+	while (index->slots[slot].head != COMBO_NONE && index->slots[slot].format != format)
+		slot = (slot + 1) & (index->num_slots - 1);
+
+	return &index->slots[slot];
+}
+
+static int combo_index_resize(struct combo_index *index, uint32_t num_slots)
+{
+	struct combo_slot *old_slots = index->slots;
+	uint32_t i, old_num_slots = index->num_slots;
+
+	index->slots = malloc(num_slots * sizeof(*index->slots));
+	if (!index->slots) {
+		index->slots = old_slots;
+		return -ENOMEM;
+	}
+
+	index->num_slots = num_slots;
+	for (i = 0; i < num_slots; i++)
+		index->slots[i].head = COMBO_NONE;
+
+	for (i = 0; i < old_num_slots; i++) {
+		if (old_slots[i].head != COMBO_NONE)
+			*combo_index_slot(index, old_slots[i].format) = old_slots[i];
+	}
+
+	free(old_slots);
+	return 0;
+}
+
+/**
+ * Android-EMU:
+ * index the combinations appended since the last call, keeping the chains in
+ * array order so ties in priority resolve as with a linear scan
+ */
+static int combo_index_update(struct driver *drv, struct combo_index *index)
+{
+	uint32_t i, num_combos = drv_array_size(drv->combos);
+	struct combo_slot *slot;
+
+	if (num_combos > index->next_capacity) {
+		uint32_t *next = realloc(index->next, num_combos * sizeof(*next));
+		if (!next)
+			return -ENOMEM;
+
+		index->next = next;
+		index->next_capacity = num_combos;
+	}
+
+	for (i = index->num_indexed; i < num_combos; i++) {
+		struct combination *combo = drv_array_at_idx(drv->combos, i);
+
+		if (2 * (index->num_formats + 1) > index->num_slots &&
+		    combo_index_resize(index, 2 * index->num_slots))
+			return -ENOMEM;
+
+		slot = combo_index_slot(index, combo->format);
+		if (slot->head == COMBO_NONE) {
+			slot->format = combo->format;
+			slot->head = i;
+			index->num_formats++;
+		} else {
+			index->next[slot->tail] = i;
+		}
+
+		slot->tail = i;
+		index->next[i] = COMBO_NONE;
+		index->num_indexed = i + 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Android-EMU:
+ * the up-to-date index of the driver, or NULL if it cannot be allocated, in
+ * which case lookups fall back to scanning drv->combos; called with
+ * combo_index_lock held
+ */
+static struct combo_index *combo_index_get(struct driver *drv)
+{
+	struct combo_index *index;
+
+	if (!combo_indexes)
+		combo_indexes = drmHashCreate();
+	if (!combo_indexes)
+		return NULL;
+
+	if (drmHashLookup(combo_indexes, (unsigned long)drv, (void **)&index)) {
+		index = calloc(1, sizeof(*index));
+		if (!index)
+			return NULL;
+
+		if (combo_index_resize(index, 16)) {
+			free(index);
+			return NULL;
+		}
+
+		drmHashInsert(combo_indexes, (unsigned long)drv, index);
+	}
+
+	if (index->num_indexed < drv_array_size(drv->combos) && combo_index_update(drv, index))
+		return NULL;
+
+	return index;
+}
+
+static uint32_t combo_scan(struct driver *drv, uint32_t format, uint32_t from)
+{
+	uint32_t i;
+
+	for (i = from; i < drv_array_size(drv->combos); i++) {
+		struct combination *combo = drv_array_at_idx(drv->combos, i);
+		if (combo->format == format)
+			return i;
+	}
+
+	return COMBO_NONE;
+}
+
+static uint32_t combo_first(struct driver *drv, struct combo_index *index, uint32_t format)
+{
+	return index ? combo_index_slot(index, format)->head : combo_scan(drv, format, 0);
+}
+
+static uint32_t combo_next(struct driver *drv, struct combo_index *index, uint32_t format,
+			   uint32_t i)
+{
+	return index ? index->next[i] : combo_scan(drv, format, i + 1);
+}
+
+/**
+ * Android-EMU:
+ * index the driver's combinations, once they have been added in init()
+ */
+int drv_combination_index_build(struct driver *drv)
+{
+	int ret;
+
+	pthread_mutex_lock(&combo_index_lock);
+	ret = combo_index_get(drv) ? 0 : -ENOMEM;
+	pthread_mutex_unlock(&combo_index_lock);
+
+	return ret;
+}
+
+/**
+ * Android-EMU:
+ * release the driver's index, from close()
+ */
+void drv_combination_index_destroy(struct driver *drv)
+{
+	struct combo_index *index;
+
+	pthread_mutex_lock(&combo_index_lock);
+	if (combo_indexes && !drmHashLookup(combo_indexes, (unsigned long)drv, (void **)&index)) {
+		drmHashDelete(combo_indexes, (unsigned long)drv);
+		free(index->slots);
+		free(index->next);
+		free(index);
+	}
+	pthread_mutex_unlock(&combo_index_lock);
+}
+
+/**
+ * Android-EMU:
+ * the highest priority combination of a format that supports all use_flags,
+ * like drv_get_combination() but without scanning every combination
+ */
+struct combination *drv_find_combination(struct driver *drv, uint32_t format, uint64_t use_flags)
+{
+	uint32_t i;
+	struct combo_index *index;
+	struct combination *combo, *best = NULL;
+
+	pthread_mutex_lock(&combo_index_lock);
+	index = combo_index_get(drv);
+	for (i = combo_first(drv, index, format); i != COMBO_NONE;
+	     i = combo_next(drv, index, format, i)) {
+		combo = drv_array_at_idx(drv->combos, i);
+		if ((use_flags & combo->use_flags) == use_flags &&
+		    (!best || best->metadata.priority < combo->metadata.priority))
+			best = combo;
+	}
+	pthread_mutex_unlock(&combo_index_lock);
+
+	return best;
+}
+
 void drv_modify_combination(struct driver *drv, uint32_t format, struct format_metadata *metadata,
 			    uint64_t use_flags)
 {
 	uint32_t i;
 	struct combination *combo;
+	struct combo_index *index;
+
 	/* Attempts to add the specified flags to an existing combination. */
-	for (i = 0; i < drv_array_size(drv->combos); i++) {
+	pthread_mutex_lock(&combo_index_lock);
+	index = combo_index_get(drv);
+	for (i = combo_first(drv, index, format); i != COMBO_NONE;
+	     i = combo_next(drv, index, format, i)) {
 		combo = (struct combination *)drv_array_at_idx(drv->combos, i);
-		if (combo->format == format && combo->metadata.tiling == metadata->tiling &&
+		if (combo->metadata.tiling == metadata->tiling &&
 		    combo->metadata.modifier == metadata->modifier)
 			combo->use_flags |= use_flags;
 	}
+	pthread_mutex_unlock(&combo_index_lock);
 }
 
+/* Android-EMU: end of modification */
+
 struct drv_array *drv_query_kms(struct driver *drv)
 {
 	struct drv_array *kms_items;
 	uint64_t plane_type, use_flag;
-	uint32_t i, j, k;
+	uint32_t i, j;
+
+	/* Android-EMU: start of modification */
+
+	// Android-EMU: format -> 1 + index of its item in kms_items
+	void *item_table = drmHashCreate();
+
+	/* Android-EMU: end of modification */
 
 	drmModePlanePtr plane;
 	drmModePropertyPtr prop;
@@ -585,33 +1665,44 @@ struct drv_array *drv_query_kms(struct driver *drv)
 			assert(0);
 		}
 
-		for (j = 0; j < plane->count_formats; j++) {
-			bool found = false;
-			for (k = 0; k < drv_array_size(kms_items); k++) {
-				struct kms_item *item = drv_array_at_idx(kms_items, k);
-				if (item->format == plane->formats[j] &&
-				    item->modifier == DRM_FORMAT_MOD_LINEAR) {
-					item->use_flags |= use_flag;
-					found = true;
-					break;
-				}
-			}
+		/* Android-EMU: start of modification */
 
-			if (!found) {
+		// Android-EMU: find the item of a format by its hash instead of a scan
+		for (j = 0; j < plane->count_formats; j++) {
+			void *value;
+
+			if (item_table &&
+			    !drmHashLookup(item_table, plane->formats[j], &value)) {
+				struct kms_item *item =
+				    drv_array_at_idx(kms_items, (uintptr_t)value - 1);
+				item->use_flags |= use_flag;
+			} else {
 				struct kms_item item = { .format = plane->formats[j],
 							 .modifier = DRM_FORMAT_MOD_LINEAR,
 							 .use_flags = use_flag };
 
 				drv_array_append(kms_items, &item);
+				if (item_table)
+					drmHashInsert(item_table, plane->formats[j],
+						      (void *)(uintptr_t)drv_array_size(kms_items));
 			}
 		}
 
+		/* Android-EMU: end of modification */
+
 		drmModeFreeObjectProperties(props);
 		drmModeFreePlane(plane);
 	}
 
 	drmModeFreePlaneResources(resources);
 out:
+	/* Android-EMU: start of modification */
+
+	if (item_table)
+		drmHashDestroy(item_table);
+
+	/* Android-EMU: end of modification */
+
 	if (kms_items && !drv_array_size(kms_items)) {
 		drv_array_destroy(kms_items);
 		return NULL;
@@ -627,6 +1718,12 @@ int drv_modify_linear_combinations(struct driver *drv)
 	struct combination *combo;
 	struct drv_array *kms_items;
 
+	/* Android-EMU: start of modification */
+
+	struct combo_index *index;
+
+	/* Android-EMU: end of modification */
+
 	/*
 	 * All current drivers can scanout linear XRGB8888/ARGB8888 as a primary
 	 * plane and as a cursor. Some drivers don't support
@@ -643,14 +1740,22 @@ int drv_modify_linear_combinations(struct driver *drv)
 	if (!kms_items)
 		return 0;
 
+	/* Android-EMU: start of modification */
+
+	// Android-EMU: only visit the combinations of each scanout format
+	pthread_mutex_lock(&combo_index_lock);
+	index = combo_index_get(drv);
 	for (i = 0; i < drv_array_size(kms_items); i++) {
 		item = (struct kms_item *)drv_array_at_idx(kms_items, i);
-		for (j = 0; j < drv_array_size(drv->combos); j++) {
+		for (j = combo_first(drv, index, item->format); j != COMBO_NONE;
+		     j = combo_next(drv, index, item->format, j)) {
 			combo = drv_array_at_idx(drv->combos, j);
-			if (item->format == combo->format)
-				combo->use_flags |= BO_USE_SCANOUT;
+			combo->use_flags |= BO_USE_SCANOUT;
 		}
 	}
+	pthread_mutex_unlock(&combo_index_lock);
+
+	/* Android-EMU: end of modification */
 
 	drv_array_destroy(kms_items);
 	return 0;
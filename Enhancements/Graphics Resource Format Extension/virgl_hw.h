@@ -294,4 +294,58 @@ enum virgl_ctx_errors {
 
 
 #define VIRGL_RESOURCE_Y_0_TOP (1 << 0)
+
+/* Android-EMU: start of modification */
+
+// Android-EMU: the context command that describes a blob resource to the host
+// renderer (cf. virgl_protocol.h of virglrenderer)
+#define VIRGL_CMD0(cmd, obj, len) ((cmd) | ((obj) << 8) | ((len) << 16))
+
+#define VIRGL_CCMD_PIPE_RESOURCE_CREATE 48
+
+#define VIRGL_PIPE_RES_CREATE_SIZE 11
+#define VIRGL_PIPE_RES_CREATE_TARGET 1
+#define VIRGL_PIPE_RES_CREATE_FORMAT 2
+#define VIRGL_PIPE_RES_CREATE_BIND 3
+#define VIRGL_PIPE_RES_CREATE_WIDTH 4
+#define VIRGL_PIPE_RES_CREATE_HEIGHT 5
+#define VIRGL_PIPE_RES_CREATE_DEPTH 6
+#define VIRGL_PIPE_RES_CREATE_ARRAY_SIZE 7
+#define VIRGL_PIPE_RES_CREATE_LAST_LEVEL 8
+#define VIRGL_PIPE_RES_CREATE_NR_SAMPLES 9
+#define VIRGL_PIPE_RES_CREATE_FLAGS 10
+#define VIRGL_PIPE_RES_CREATE_BLOB_ID 11
+
+/* Android-EMU: end of modification */
+
+/* Android-EMU: start of modification */
+
+// Android-EMU: capability set of the emulator listing the layouts besides
+// linear its host allocates blob resources in; a host that offers it accepts
+// the modifier of the layout at the end of VIRGL_CCMD_PIPE_RESOURCE_CREATE
+#define VIRGL_CAPSET_ANDROID_EMU_MODIFIERS 64
+#define VIRGL_CAPS_MAX_MODIFIERS 32
+
+#define VIRGL_PIPE_RES_CREATE_MODIFIER_SIZE 13
+#define VIRGL_PIPE_RES_CREATE_MODIFIER_LO 12
+#define VIRGL_PIPE_RES_CREATE_MODIFIER_HI 13
+
+// a single plane layout of tiles of tile_width bytes by tile_height rows, in
+// the host's order of preference
+struct virgl_format_modifier {
+        uint32_t format;      /* enum virgl_formats */
+        uint32_t bind;        /* VIRGL_BIND_* the layout can be used for */
+        uint64_t modifier;
+        uint32_t tile_width;
+        uint32_t tile_height;
+};
+
+struct virgl_caps_modifiers {
+        uint32_t version;
+        uint32_t num_modifiers;
+        struct virgl_format_modifier modifiers[VIRGL_CAPS_MAX_MODIFIERS];
+};
+
+/* Android-EMU: end of modification */
+
 #endif
@@ -5,14 +5,27 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/dma-buf.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 #include <virtgpu_drm.h>
 #include <xf86drm.h>
 
+#include "drv_convert.h"
+#include "drv_formats.h"
+#include "drv_layout.h"
+#include "drv_mapping.h"
 #include "drv_priv.h"
+#include "drv_trace.h"
 #include "helpers.h"
 #include "util.h"
 #include "virgl_hw.h"
@@ -34,6 +47,161 @@ static const uint32_t dumb_texture_source_formats[] = { DRM_FORMAT_R8, DRM_FORMA
 
 static const uint32_t texture_source_formats[] = { DRM_FORMAT_R8, DRM_FORMAT_RG88 };
 
+/* Android-EMU: start of modification */
+
+// Android-EMU: YUV formats of video apps, converted from/to a format the host
+// has when it lacks them (see virtio_gpu_emulated_format())
+static const uint32_t yuv_texture_source_formats[] = { DRM_FORMAT_NV12, DRM_FORMAT_YUV420,
+						       DRM_FORMAT_YVU420,
+						       DRM_FORMAT_YVU420_ANDROID };
+
+// Android-EMU: defined with the capability queries at the end of the file
+static void virtio_gpu_add_combinations(struct driver *drv, const uint32_t *drm_formats,
+					uint32_t num_formats, struct format_metadata *metadata,
+					uint64_t use_flags);
+static int virtio_gpu_get_caps(struct driver *drv, union virgl_caps *caps);
+
+/* Android-EMU: end of modification */
+
+/* Android-EMU: start of modification */
+
+// Android-EMU: destroyed buffers are retained for reuse unless built with 0;
+// buffers other processes may hold are never retained, which relies on
+// drv_bo_get_plane_fd() marking its exports shared (see drv.c.patch)
+#ifndef VIRTIO_GPU_POOL
+#define VIRTIO_GPU_POOL 1
+#endif
+
+// Android-EMU: bounds of the buffer recycling pool
+#define VIRTIO_GPU_POOL_BUCKETS 64
+#define VIRTIO_GPU_POOL_MAX_BYTES (64 * 1024 * 1024)
+#define VIRTIO_GPU_POOL_MAX_AGE_NS (2000ull * 1000 * 1000)
+
+// Android-EMU: a destroyed buffer kept for reuse, with the layout it was created with
+struct virtio_gpu_pool_entry {
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint64_t use_flags;
+	size_t num_planes;
+	union bo_handle handles[DRV_MAX_PLANES];
+	uint32_t offsets[DRV_MAX_PLANES];
+	uint32_t sizes[DRV_MAX_PLANES];
+	uint32_t strides[DRV_MAX_PLANES];
+	uint64_t format_modifiers[DRV_MAX_PLANES];
+	size_t total_size;
+	uint32_t tiling; /* blob flags of host-visible buffers */
+	uint64_t released_ns;
+	struct virtio_gpu_pool_entry *next;  /* in the bucket, or the list of evicted entries */
+	struct virtio_gpu_pool_entry *newer; /* in release order */
+	struct virtio_gpu_pool_entry *older;
+};
+
+struct virtio_gpu_pool_stats {
+	uint64_t hits;      /* creations served from the pool */
+	uint64_t misses;    /* creations that went to the kernel */
+	uint64_t recycled;  /* destroyed buffers retained */
+	uint64_t rejected;  /* destroyed buffers not retained (shared or too large) */
+	uint64_t evicted;   /* retained buffers released by age, memory bound or close */
+};
+
+struct virtio_gpu_pool {
+	pthread_mutex_t lock;
+	struct virtio_gpu_pool_entry *buckets[VIRTIO_GPU_POOL_BUCKETS];
+	struct virtio_gpu_pool_entry *oldest;
+	struct virtio_gpu_pool_entry *newest;
+	size_t bytes;
+	struct virtio_gpu_pool_stats stats;
+	pthread_cond_t reaper_cond; /* signaled when the oldest entry changes or on close */
+	pthread_t reaper;	    /* releases entries past the age bound of an idle process */
+	bool reaper_started;
+	bool closing;
+};
+
+// Android-EMU: bounds of the cache of CPU mappings kept across unmap/map cycles
+#define VIRTIO_GPU_MAP_CACHE_BUCKETS 64
+#define VIRTIO_GPU_MAP_CACHE_MAX_BYTES (128 * 1024 * 1024)
+
+// Android-EMU: a mapping kept after its last unmap, for the next map of the handle
+struct virtio_gpu_map_entry {
+	uint32_t handle;
+	void *addr;
+	size_t length;
+	int prot;
+	struct virtio_gpu_map_entry *next;  /* in the handle bucket */
+	struct virtio_gpu_map_entry *newer; /* in least recently used order */
+	struct virtio_gpu_map_entry *older;
+};
+
+struct virtio_gpu_map_cache_stats {
+	uint64_t hits;    /* maps served from the cache */
+	uint64_t misses;  /* maps that went to the kernel */
+	uint64_t kept;    /* unmaps that kept the mapping */
+	uint64_t evicted; /* mappings unmapped by the bound, destroy or close */
+};
+
+struct virtio_gpu_map_cache {
+	pthread_mutex_t lock;
+	struct virtio_gpu_map_entry *buckets[VIRTIO_GPU_MAP_CACHE_BUCKETS];
+	struct virtio_gpu_map_entry *oldest;
+	struct virtio_gpu_map_entry *newest;
+	size_t bytes;
+	struct virtio_gpu_map_cache_stats stats;
+};
+
+// Android-EMU: the host's capabilities and the combinations derived from them,
+// shared by every process that opens the driver during one guest boot
+#ifndef VIRTIO_GPU_CAPS_CACHE_PATH
+#define VIRTIO_GPU_CAPS_CACHE_PATH "/data/vendor/minigbm/virtio_gpu_caps"
+#endif
+#define VIRTIO_GPU_CAPS_CACHE_MAGIC 0x43434756 /* "VGCC" */
+#define VIRTIO_GPU_CAPS_CACHE_VERSION 3
+#define VIRTIO_GPU_BOOT_ID_PATH "/proc/sys/kernel/random/boot_id"
+
+struct virtio_gpu_caps_key {
+	char boot_id[40];
+	uint64_t rdev;
+	uint32_t has_3d;
+	uint32_t pad;
+};
+
+struct virtio_gpu_cached_combo {
+	uint32_t format;
+	uint32_t priority;
+	uint64_t use_flags;
+	uint64_t modifier;
+};
+
+struct virtio_gpu_caps_cache {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t num_combos;
+	struct virtio_gpu_caps_key key;
+	union virgl_caps caps;
+	struct virgl_caps_modifiers modifiers;
+	struct virtio_gpu_cached_combo combos[];
+};
+
+// Android-EMU: a readback of a mapping queued by virtio_gpu_bo_invalidate_async(),
+// waited for by the next invalidate of the mapping
+struct virtio_gpu_readback {
+	uint32_t handle;
+	struct rectangle rect;
+	struct virtio_gpu_readback *next;
+};
+
+// Android-EMU: the host-format resource behind a mapping of an emulated format;
+// the mapping itself is a shadow in the buffer's own format
+struct virtio_gpu_emulation {
+	uint32_t format;
+	struct drv_layout layout;
+	void *addr;
+	size_t length;
+};
+
+/* Android-EMU: end of modification */
+
 struct virtio_gpu_priv {
 	int has_3d;
 
@@ -42,36 +210,52 @@ struct virtio_gpu_priv {
 	// Android-EMU: store the graphics capabilities of the
 	// underlying virgl driver
 	union virgl_caps caps;
+
+	// Android-EMU: recently destroyed buffers, reused by creations of the same kind
+	struct virtio_gpu_pool pool;
+
+	// Android-EMU: CPU mappings of unmapped buffers, reused by their next map
+	struct virtio_gpu_map_cache maps;
+
+	// Android-EMU: the host can back buffers with memory the guest maps directly
+	int has_blob;
+	atomic_uint next_blob_id;
+
+	// Android-EMU: the layouts besides linear the host allocates blobs in
+	struct virgl_caps_modifiers modifiers;
+
+	// Android-EMU: readbacks in flight, by the handle of their mapping
+	pthread_mutex_t readbacks_lock;
+	struct virtio_gpu_readback *readbacks;
 	
 	/* Android-EMU: end of modification */
 
 };
 
+/* Android-EMU: start of modification */
+
+// Android-EMU: every virgl format of the table fits the host's capability bitmasks
+#define VIRGL_FORMAT_FITS_CAPS(fourcc, layout, virgl_format, stride_align, flags)                 \
+	_Static_assert((virgl_format) <                                                            \
+			   32 * ARRAY_SIZE(((struct virgl_supported_format_mask *)0)->bitmask),    \
+		       #fourcc " is beyond the virgl capability bitmask");
+DRV_FORMATS(VIRGL_FORMAT_FITS_CAPS)
+#undef VIRGL_FORMAT_FITS_CAPS
+
+/* Android-EMU: end of modification */
+
 static uint32_t translate_format(uint32_t drm_fourcc, uint32_t plane)
 {
 	switch (drm_fourcc) {
-	case DRM_FORMAT_XRGB8888:
-		return VIRGL_FORMAT_B8G8R8X8_UNORM;
-	case DRM_FORMAT_ARGB8888:
-		return VIRGL_FORMAT_B8G8R8A8_UNORM;
-	case DRM_FORMAT_XBGR8888:
-		return VIRGL_FORMAT_R8G8B8X8_UNORM;
-	case DRM_FORMAT_ABGR8888:
-		return VIRGL_FORMAT_R8G8B8A8_UNORM;
-	case DRM_FORMAT_RGB565:
-		return VIRGL_FORMAT_B5G6R5_UNORM;
-	case DRM_FORMAT_R8:
-		return VIRGL_FORMAT_R8_UNORM;
-	case DRM_FORMAT_RG88:
-		return VIRGL_FORMAT_R8G8_UNORM;
 
 	/* Android-EMU: start of modification */
-	// Android-EMU: allow NV12 and YV12 format translations
-	case DRM_FORMAT_NV12:
-		return VIRGL_FORMAT_NV12;
-	case DRM_FORMAT_YVU420:
-	case DRM_FORMAT_YVU420_ANDROID:
-		return VIRGL_FORMAT_YV12;
+
+	// Android-EMU: the cases are generated from drv_formats.h
+#define TRANSLATE_FORMAT(fourcc, layout, virgl_format, stride_align, flags)                        \
+	case fourcc:                                                                               \
+		return virgl_format;
+	DRV_FORMATS(TRANSLATE_FORMAT)
+#undef TRANSLATE_FORMAT
 
 	/* Android-EMU: end of modification */
 
@@ -83,27 +267,372 @@ static uint32_t translate_format(uint32_t drm_fourcc, uint32_t plane)
 static int virtio_dumb_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 				 uint64_t use_flags)
 {
-	width = ALIGN(width, MESA_LLVMPIPE_TILE_SIZE);
-	height = ALIGN(height, MESA_LLVMPIPE_TILE_SIZE);
+	/* Android-EMU: start of modification */
+
+	// Android-EMU: only buffers llvmpipe renders into or the display scans out
+	// need the tile padding, the others keep their exact per-format layout
+	if (use_flags & (BO_USE_RENDERING | BO_USE_SCANOUT | BO_USE_CURSOR)) {
+		width = ALIGN(width, MESA_LLVMPIPE_TILE_SIZE);
+		height = ALIGN(height, MESA_LLVMPIPE_TILE_SIZE);
+	}
+
+	/* Android-EMU: end of modification */
 
 	/* HAL_PIXEL_FORMAT_YV12 requires that the buffer's height not be aligned. */
-	if (bo->format == DRM_FORMAT_YVU420_ANDROID)
+
+	/* Android-EMU: start of modification */
+
+	if (drv_format_fixed_height(bo->format))
 		height = bo->height;
 
+	/* Android-EMU: end of modification */
+
 	return drv_dumb_bo_create(bo, width, height, format, use_flags);
 }
 
-static int virtio_virgl_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
-				  uint64_t use_flags)
+/* Android-EMU: start of modification */
+
+/**
+ * Android-EMU:
+ * check the host's capability bitmask for a virgl format
+ */
+static bool virtio_gpu_caps_has_format(const struct virgl_supported_format_mask *supported,
+				       uint32_t virgl_format)
+{
+	return virgl_format && (supported->bitmask[virgl_format / 32] & (1u << (virgl_format % 32)));
+}
+
+/**
+ * Android-EMU:
+ * the virgl format of a YUV buffer that the host can allocate as a single
+ * multi-planar resource, or 0 if every plane needs a resource of its own
+ */
+static uint32_t virtio_gpu_multiplanar_format(struct virtio_gpu_priv *priv, uint32_t format)
+{
+	uint32_t virgl_format = translate_format(format, 0);
+
+	if (drv_num_planes_from_format(format) < 2)
+		return 0;
+
+	if (virgl_format != VIRGL_FORMAT_YV12 && virgl_format != VIRGL_FORMAT_NV12)
+		return 0;
+
+	return virtio_gpu_caps_has_format(&priv->caps.v1.sampler, virgl_format) ? virgl_format : 0;
+}
+
+/**
+ * Android-EMU:
+ * create one host resource covering all planes, so a YV12/NV12 buffer costs a
+ * single RESOURCE_CREATE round-trip instead of one per plane; the planes share
+ * the GEM handle and keep the offsets computed by drv_layout_compute()
+ */
+static int virtio_virgl_bo_create_multiplanar(struct bo *bo, uint32_t width, uint32_t height,
+					      uint32_t format, uint32_t virgl_format)
+{
+	int ret;
+	size_t plane;
+	struct drm_virtgpu_resource_create res_create;
+
+	struct drv_layout layout;
+
+	ret = drv_layout_compute(format, width, height, &layout);
+	if (ret)
+		return ret;
+
+	for (plane = 0; plane < layout.num_planes; plane++) {
+		bo->strides[plane] = layout.strides[plane];
+		bo->sizes[plane] = layout.sizes[plane];
+		bo->offsets[plane] = layout.offsets[plane];
+	}
+
+	bo->total_size = layout.total_size;
+
+	memset(&res_create, 0, sizeof(res_create));
+	res_create.target = PIPE_TEXTURE_2D;
+	res_create.format = virgl_format;
+	// planar YUV resources are only sampled from by the host renderer
+	res_create.bind = VIRGL_BIND_SAMPLER_VIEW;
+	res_create.width = width;
+	res_create.height = height;
+	res_create.depth = 1;
+	res_create.array_size = 1;
+	res_create.last_level = 0;
+	res_create.nr_samples = 0;
+	res_create.stride = bo->strides[0];
+	res_create.size = ALIGN(bo->total_size, PAGE_SIZE);
+
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_RESOURCE_CREATE, &res_create);
+	if (ret) {
+		drv_log("DRM_IOCTL_VIRTGPU_RESOURCE_CREATE failed with %s\n", strerror(errno));
+		return ret;
+	}
+
+	for (plane = 0; plane < bo->num_planes; plane++)
+		bo->handles[plane].u32 = res_create.bo_handle;
+
+	return 0;
+}
+
+/**
+ * Android-EMU:
+ * the format of the host resource behind a YUV buffer the host cannot sample
+ * from: a YUV format it has (lossless, only chroma is reordered), else RGBA;
+ * 0 if the host has the format itself or nothing to convert it from/to
+ */
+static uint32_t virtio_gpu_emulated_format(struct virtio_gpu_priv *priv, uint32_t format)
+{
+	static const uint32_t host_formats[] = { DRM_FORMAT_YVU420, DRM_FORMAT_NV12,
+						 DRM_FORMAT_ABGR8888 };
+	size_t i;
+
+	if (!priv->has_3d)
+		return 0;
+
+	for (i = 0; i < ARRAY_SIZE(yuv_texture_source_formats); i++) {
+		if (yuv_texture_source_formats[i] == format)
+			break;
+	}
+
+	if (i == ARRAY_SIZE(yuv_texture_source_formats) ||
+	    virtio_gpu_caps_has_format(&priv->caps.v1.sampler, translate_format(format, 0)))
+		return 0;
+
+	for (i = 0; i < ARRAY_SIZE(host_formats); i++) {
+		if (virtio_gpu_caps_has_format(&priv->caps.v1.sampler,
+					       translate_format(host_formats[i], 0)) &&
+		    drv_convert_supported(format, host_formats[i]))
+			return host_formats[i];
+	}
+
+	return 0;
+}
+
+/**
+ * Android-EMU:
+ * create the host resource of an emulated format; the buffer object keeps the
+ * layout of its own format, which is the one its mappings have
+ */
+static int virtio_virgl_bo_create_emulated(struct bo *bo, uint32_t width, uint32_t height,
+					   uint32_t format, uint32_t host_format)
+{
+	int ret;
+	size_t plane;
+	struct drv_layout layout;
+
+	ret = drv_layout_compute(format, width, height, &layout);
+	if (ret)
+		return ret;
+
+	ret = virtio_virgl_bo_create_multiplanar(bo, width, height, host_format,
+						 translate_format(host_format, 0));
+	if (ret)
+		return ret;
+
+	for (plane = 0; plane < layout.num_planes; plane++) {
+		bo->handles[plane].u32 = bo->handles[0].u32;
+		bo->strides[plane] = layout.strides[plane];
+		bo->sizes[plane] = layout.sizes[plane];
+		bo->offsets[plane] = layout.offsets[plane];
+	}
+
+	bo->total_size = layout.total_size;
+
+	return 0;
+}
+
+// Android-EMU: usages for which a host-visible buffer saves the transfers;
+// the CPU writes textures often, cameras and decoders fill the buffer on the host
+#define VIRTIO_GPU_BLOB_USE_MASK (BO_USE_CAMERA_WRITE | BO_USE_HW_VIDEO_DECODER)
+#define VIRTIO_GPU_BLOB_SW_TEXTURE (BO_USE_SW_WRITE_OFTEN | BO_USE_TEXTURE)
+
+/**
+ * Android-EMU:
+ * the virgl format to allocate a buffer as a host-visible blob with, or 0 if
+ * it needs a guest resource; scanout and render targets keep guest resources
+ */
+static uint32_t virtio_gpu_blob_format(struct virtio_gpu_priv *priv, uint32_t format,
+				       uint64_t use_flags)
+{
+	if (!priv->has_3d || !priv->has_blob)
+		return 0;
+
+	if (use_flags & (BO_USE_SCANOUT | BO_USE_RENDERING))
+		return 0;
+
+	if (!(use_flags & VIRTIO_GPU_BLOB_USE_MASK) &&
+	    (use_flags & VIRTIO_GPU_BLOB_SW_TEXTURE) != VIRTIO_GPU_BLOB_SW_TEXTURE)
+		return 0;
+
+	// the host lays the blob out as one resource, so YUV needs its multi-planar support
+	if (drv_num_planes_from_format(format) > 1)
+		return virtio_gpu_multiplanar_format(priv, format);
+
+	return translate_format(format, 0);
+}
+
+/**
+ * Android-EMU:
+ * create a blob resource of size bytes the host lays out with modifier, the
+ * command only carries the modifier if the layout is not linear
+ */
+static int virtio_virgl_blob_create(struct bo *bo, uint32_t virgl_format, uint32_t bind,
+				    uint32_t width, uint32_t height, uint64_t modifier, size_t size,
+				    uint32_t *bo_handle)
+{
+	int ret;
+	uint32_t length = VIRGL_PIPE_RES_CREATE_SIZE;
+	uint32_t cmd[VIRGL_PIPE_RES_CREATE_MODIFIER_SIZE + 1];
+	struct drm_virtgpu_resource_create_blob blob_create;
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
+
+	// the blob id ties the context command to the resource, it is unique per device fd
+	memset(cmd, 0, sizeof(cmd));
+	cmd[VIRGL_PIPE_RES_CREATE_TARGET] = PIPE_TEXTURE_2D;
+	cmd[VIRGL_PIPE_RES_CREATE_FORMAT] = virgl_format;
+	cmd[VIRGL_PIPE_RES_CREATE_BIND] = bind;
+	cmd[VIRGL_PIPE_RES_CREATE_WIDTH] = width;
+	cmd[VIRGL_PIPE_RES_CREATE_HEIGHT] = height;
+	cmd[VIRGL_PIPE_RES_CREATE_DEPTH] = 1;
+	cmd[VIRGL_PIPE_RES_CREATE_ARRAY_SIZE] = 1;
+	cmd[VIRGL_PIPE_RES_CREATE_BLOB_ID] = atomic_fetch_add(&priv->next_blob_id, 1) + 1;
+
+	if (modifier != DRM_FORMAT_MOD_LINEAR) {
+		length = VIRGL_PIPE_RES_CREATE_MODIFIER_SIZE;
+		cmd[VIRGL_PIPE_RES_CREATE_MODIFIER_LO] = (uint32_t)modifier;
+		cmd[VIRGL_PIPE_RES_CREATE_MODIFIER_HI] = (uint32_t)(modifier >> 32);
+	}
+
+	cmd[0] = VIRGL_CMD0(VIRGL_CCMD_PIPE_RESOURCE_CREATE, 0, length);
+
+	memset(&blob_create, 0, sizeof(blob_create));
+	blob_create.blob_mem = VIRTGPU_BLOB_MEM_HOST3D;
+	blob_create.blob_flags = VIRTGPU_BLOB_FLAG_USE_MAPPABLE | VIRTGPU_BLOB_FLAG_USE_SHAREABLE;
+	blob_create.blob_id = cmd[VIRGL_PIPE_RES_CREATE_BLOB_ID];
+	blob_create.size = ALIGN(size, PAGE_SIZE);
+	blob_create.cmd = (uint64_t)(uintptr_t)cmd;
+	blob_create.cmd_size = (length + 1) * sizeof(cmd[0]);
+
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB, &blob_create);
+	if (ret) {
+		drv_log("DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB failed with %s\n", strerror(errno));
+		return ret;
+	}
+
+	*bo_handle = blob_create.bo_handle;
+	bo->tiling = blob_create.blob_flags;
+	return 0;
+}
+
+/**
+ * Android-EMU:
+ * create a buffer the host allocates and the guest maps, so writes of either
+ * side are visible to the other without TRANSFER_TO_HOST/TRANSFER_FROM_HOST
+ */
+static int virtio_virgl_bo_create_blob(struct bo *bo, uint32_t width, uint32_t height,
+				       uint32_t format, uint32_t virgl_format)
+{
+	int ret;
+	size_t plane;
+	uint32_t bo_handle;
+	struct drv_layout layout;
+
+	ret = drv_layout_compute(format, width, height, &layout);
+	if (ret)
+		return ret;
+
+	ret = virtio_virgl_blob_create(bo, virgl_format, VIRGL_BIND_SAMPLER_VIEW, width, height,
+				       DRM_FORMAT_MOD_LINEAR, layout.total_size, &bo_handle);
+	if (ret)
+		return ret;
+
+	for (plane = 0; plane < layout.num_planes; plane++) {
+		bo->handles[plane].u32 = bo_handle;
+		bo->strides[plane] = layout.strides[plane];
+		bo->sizes[plane] = layout.sizes[plane];
+		bo->offsets[plane] = layout.offsets[plane];
+	}
+
+	bo->total_size = layout.total_size;
+
+	return 0;
+}
+
+/**
+ * Android-EMU:
+ * the layout of the host for this format and modifier, if it offers one
+ */
+static const struct virgl_format_modifier *virtio_gpu_find_modifier(struct virtio_gpu_priv *priv,
+								    uint32_t format,
+								    uint64_t modifier)
+{
+	uint32_t i, virgl_format = translate_format(format, 0);
+
+	if (!virgl_format || drv_num_planes_from_format(format) != 1 ||
+	    !virtio_gpu_caps_has_format(&priv->caps.v1.render, virgl_format))
+		return NULL;
+
+	for (i = 0; i < priv->modifiers.num_modifiers; i++) {
+		const struct virgl_format_modifier *entry = &priv->modifiers.modifiers[i];
+		if (entry->format == virgl_format && entry->modifier == modifier)
+			return entry;
+	}
+
+	return NULL;
+}
+
+/**
+ * Android-EMU:
+ * create a render target in a tiled or compressed layout of the host, so the
+ * host GPU renders to it without going through a linear copy
+ */
+static int virtio_virgl_bo_create_tiled(struct bo *bo, uint32_t width, uint32_t height,
+					uint32_t format,
+					const struct virgl_format_modifier *entry)
+{
+	int ret;
+	uint32_t bo_handle, stride;
+	uint32_t bind = VIRGL_BIND_RENDER_TARGET | VIRGL_BIND_SAMPLER_VIEW;
+	size_t size;
+
+	stride = ALIGN(width * drv_bytes_per_pixel_from_format(format, 0), entry->tile_width);
+	size = (size_t)stride * ALIGN(height, entry->tile_height);
+
+	ret = virtio_virgl_blob_create(bo, entry->format, bind | (entry->bind & VIRGL_BIND_SCANOUT),
+				       width, height, entry->modifier, size, &bo_handle);
+	if (ret)
+		return ret;
+
+	bo->handles[0].u32 = bo_handle;
+	bo->strides[0] = stride;
+	bo->sizes[0] = size;
+	bo->offsets[0] = 0;
+	bo->format_modifiers[0] = entry->modifier;
+	bo->total_size = size;
+
+	return 0;
+}
+
+/* Android-EMU: end of modification */
+
+/* Android-EMU: start of modification */
+
+/**
+ * Android-EMU:
+ * create a resource per plane of a layout computed by the caller, once for
+ * every buffer of an array
+ */
+static int virtio_virgl_bo_create_planes(struct bo *bo, uint32_t width, uint32_t height,
+					 uint32_t format, const struct drv_layout *layout)
 {
 	int ret;
 	ssize_t plane;
-	ssize_t num_planes = drv_num_planes_from_format(format);
-	uint32_t stride0;
+	ssize_t num_planes = layout->num_planes;
+
+	/* Android-EMU: end of modification */
 
 	for (plane = 0; plane < num_planes; plane++) {
-		uint32_t stride = drv_stride_from_format(format, width, plane);
-		uint32_t size = drv_size_from_format(format, stride, height, plane);
+		uint32_t stride = layout->strides[plane];
+		uint32_t size = layout->sizes[plane];
 		uint32_t res_format = translate_format(format, plane);
 		struct drm_virtgpu_resource_create res_create;
 
@@ -138,11 +667,18 @@ static int virtio_virgl_bo_create(struct bo *bo, uint32_t width, uint32_t height
 		bo->handles[plane].u32 = res_create.bo_handle;
 	}
 
-	stride0 = drv_stride_from_format(format, width, 0);
-	drv_bo_from_format(bo, stride0, height, format);
+	/* Android-EMU: start of modification */
 
-	for (plane = 0; plane < num_planes; plane++)
+	// Android-EMU: every plane is a resource of its own, starting at offset 0
+	for (plane = 0; plane < num_planes; plane++) {
+		bo->strides[plane] = layout->strides[plane];
+		bo->sizes[plane] = layout->sizes[plane];
 		bo->offsets[plane] = 0;
+	}
+
+	bo->total_size = layout->total_size;
+
+	/* Android-EMU: end of modification */
 
 	return 0;
 
@@ -157,142 +693,1822 @@ fail:
 	return ret;
 }
 
-static void *virtio_virgl_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
+/* Android-EMU: start of modification */
+
+/**
+ * Android-EMU:
+ * the layout of the plain per-plane path, if the host resources of a buffer
+ * of this kind are created that way, i.e. no other path applies
+ */
+static bool virtio_virgl_planes_layout(struct virtio_gpu_priv *priv, uint32_t width,
+				       uint32_t height, uint32_t format, uint64_t use_flags,
+				       struct drv_layout *layout)
+{
+	if (virtio_gpu_emulated_format(priv, format) ||
+	    virtio_gpu_blob_format(priv, format, use_flags) ||
+	    virtio_gpu_multiplanar_format(priv, format))
+		return false;
+
+	return !drv_layout_compute(format, width, height, layout);
+}
+
+/* Android-EMU: end of modification */
+
+static int virtio_virgl_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
+				  uint64_t use_flags)
+{
+	int ret;
+
+	/* Android-EMU: start of modification */
+
+	struct drv_layout layout;
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
+	uint32_t emulated_format = virtio_gpu_emulated_format(priv, format);
+	uint32_t blob_format = virtio_gpu_blob_format(priv, format, use_flags);
+	uint32_t multiplanar_format = virtio_gpu_multiplanar_format(priv, format);
+
+	// Android-EMU: back formats the host lacks with a resource of one it has
+	if (emulated_format)
+		return virtio_virgl_bo_create_emulated(bo, width, height, format, emulated_format);
+
+	// Android-EMU: share eligible buffers with the host instead of copying them,
+	// falling back to a guest resource if the host cannot allocate the blob
+	if (blob_format && !virtio_virgl_bo_create_blob(bo, width, height, format, blob_format))
+		return 0;
+
+	// Android-EMU: allocate YUV buffers as one resource when the host supports it
+	if (multiplanar_format)
+		return virtio_virgl_bo_create_multiplanar(bo, width, height, format,
+							  multiplanar_format);
+
+	// Android-EMU: compute all planes at once, the resources and the bo share the layout
+	ret = drv_layout_compute(format, width, height, &layout);
+	if (ret)
+		return ret;
+
+	return virtio_virgl_bo_create_planes(bo, width, height, format, &layout);
+
+	/* Android-EMU: end of modification */
+}
+
+static void *virtio_virgl_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
+{
+	int ret;
+	struct drm_virtgpu_map gem_map;
+
+	memset(&gem_map, 0, sizeof(gem_map));
+	gem_map.handle = bo->handles[0].u32;
+
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_MAP, &gem_map);
+	if (ret) {
+		drv_log("DRM_IOCTL_VIRTGPU_MAP failed with %s\n", strerror(errno));
+		return MAP_FAILED;
+	}
+
+	vma->length = bo->total_size;
+	return mmap(0, bo->total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
+		    gem_map.offset);
+}
+
+/* Android-EMU: start of modification */
+
+static uint64_t virtio_gpu_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t virtio_gpu_pool_bucket(uint32_t format, uint32_t width, uint32_t height)
+{
+	uint32_t hash = format * 2654435761u;
+
+	hash ^= width * 40503u + height;
+	hash *= 2246822519u;
+	return (hash >> 16) % VIRTIO_GPU_POOL_BUCKETS;
+}
+
+/**
+ * Android-EMU:
+ * take an entry out of its bucket and the release order; the pool lock is held
+ */
+static void virtio_gpu_pool_unlink(struct virtio_gpu_pool *pool, struct virtio_gpu_pool_entry *entry)
+{
+	struct virtio_gpu_pool_entry **link;
+
+	link = &pool->buckets[virtio_gpu_pool_bucket(entry->format, entry->width, entry->height)];
+	while (*link != entry)
+		link = &(*link)->next;
+	*link = entry->next;
+
+	if (entry->older)
+		entry->older->newer = entry->newer;
+	else
+		pool->oldest = entry->newer;
+	if (entry->newer)
+		entry->newer->older = entry->older;
+	else
+		pool->newest = entry->older;
+	pool->bytes -= entry->total_size;
+}
+
+/**
+ * Android-EMU:
+ * take an entry out of its bucket and the LRU order; the cache lock is held
+ */
+static void virtio_gpu_map_cache_unlink(struct virtio_gpu_map_cache *cache,
+					struct virtio_gpu_map_entry *entry)
+{
+	struct virtio_gpu_map_entry **link;
+
+	link = &cache->buckets[entry->handle % VIRTIO_GPU_MAP_CACHE_BUCKETS];
+	while (*link != entry)
+		link = &(*link)->next;
+	*link = entry->next;
+
+	if (entry->older)
+		entry->older->newer = entry->newer;
+	else
+		cache->oldest = entry->newer;
+	if (entry->newer)
+		entry->newer->older = entry->older;
+	else
+		cache->newest = entry->older;
+	cache->bytes -= entry->length;
+}
+
+static struct virtio_gpu_map_entry *virtio_gpu_map_cache_find(struct virtio_gpu_map_cache *cache,
+							      uint32_t handle)
+{
+	struct virtio_gpu_map_entry *entry;
+
+	for (entry = cache->buckets[handle % VIRTIO_GPU_MAP_CACHE_BUCKETS]; entry;
+	     entry = entry->next) {
+		if (entry->handle == handle)
+			return entry;
+	}
+
+	return NULL;
+}
+
+/**
+ * Android-EMU:
+ * unmap the least recently used mappings until the cache fits into max_bytes;
+ * the cache lock is held
+ */
+static void virtio_gpu_map_cache_trim(struct virtio_gpu_map_cache *cache, size_t max_bytes)
+{
+	struct virtio_gpu_map_entry *entry;
+
+	while (cache->oldest && cache->bytes > max_bytes) {
+		entry = cache->oldest;
+		virtio_gpu_map_cache_unlink(cache, entry);
+		munmap(entry->addr, entry->length);
+		free(entry);
+		cache->stats.evicted++;
+	}
+}
+
+/**
+ * Android-EMU:
+ * unmap the kept mappings of a buffer's handles, before the handles are closed
+ * and their numbers can be reused for other buffers
+ */
+static void virtio_gpu_map_cache_evict(struct driver *drv, const union bo_handle *handles,
+				       size_t num_planes)
+{
+	struct virtio_gpu_map_cache *cache = &((struct virtio_gpu_priv *)drv->priv)->maps;
+	struct virtio_gpu_map_entry *entry;
+	size_t plane;
+
+	pthread_mutex_lock(&cache->lock);
+	for (plane = 0; plane < num_planes; plane++) {
+		entry = virtio_gpu_map_cache_find(cache, handles[plane].u32);
+		if (!entry)
+			continue;
+
+		virtio_gpu_map_cache_unlink(cache, entry);
+		munmap(entry->addr, entry->length);
+		free(entry);
+		cache->stats.evicted++;
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Android-EMU:
+ * the length of the mapping of a buffer's plane: drv_dumb_bo_map() maps the
+ * planes of the handle without the padding rows of the dumb buffer
+ */
+static size_t virtio_gpu_map_length(struct bo *bo, size_t plane)
+{
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
+	size_t length = 0, i;
+
+	if (priv->has_3d)
+		return bo->total_size;
+
+	for (i = 0; i < bo->num_planes; i++) {
+		if (bo->handles[i].u32 == bo->handles[plane].u32)
+			length += bo->sizes[i];
+	}
+
+	return length;
+}
+
+/**
+ * Android-EMU:
+ * the kept mapping of a plane's handle if it allows the requested access,
+ * or MAP_FAILED; a mapping with too little access is unmapped
+ */
+static void *virtio_gpu_map_cache_take(struct bo *bo, struct vma *vma, size_t plane,
+				       uint32_t map_flags)
+{
+	struct virtio_gpu_map_cache *cache = &((struct virtio_gpu_priv *)bo->drv->priv)->maps;
+	struct virtio_gpu_map_entry *entry;
+	int prot = drv_get_prot(map_flags);
+	void *addr = MAP_FAILED;
+
+	pthread_mutex_lock(&cache->lock);
+	entry = virtio_gpu_map_cache_find(cache, bo->handles[plane].u32);
+	if (entry) {
+		virtio_gpu_map_cache_unlink(cache, entry);
+		if ((entry->prot & prot) == prot && entry->length == virtio_gpu_map_length(bo, plane)) {
+			addr = entry->addr;
+			vma->length = entry->length;
+		} else {
+			munmap(entry->addr, entry->length);
+			cache->stats.evicted++;
+		}
+		free(entry);
+	}
+
+	if (addr != MAP_FAILED)
+		cache->stats.hits++;
+	else
+		cache->stats.misses++;
+	pthread_mutex_unlock(&cache->lock);
+
+	return addr;
+}
+
+/**
+ * Android-EMU:
+ * keep the mapping of a vma whose last user unmapped it, returns true if the
+ * cache took ownership of the mapping
+ */
+static bool virtio_gpu_map_cache_put(struct bo *bo, struct vma *vma)
+{
+	struct virtio_gpu_map_cache *cache = &((struct virtio_gpu_priv *)bo->drv->priv)->maps;
+	struct virtio_gpu_map_entry *entry;
+
+	if (vma->length > VIRTIO_GPU_MAP_CACHE_MAX_BYTES / 4)
+		return false;
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		return false;
+
+	entry->handle = vma->handle;
+	entry->addr = vma->addr;
+	entry->length = vma->length;
+	entry->prot = drv_get_prot(vma->map_flags);
+
+	pthread_mutex_lock(&cache->lock);
+	if (virtio_gpu_map_cache_find(cache, entry->handle)) {
+		pthread_mutex_unlock(&cache->lock);
+		free(entry);
+		return false;
+	}
+
+	virtio_gpu_map_cache_trim(cache, VIRTIO_GPU_MAP_CACHE_MAX_BYTES - entry->length);
+
+	entry->next = cache->buckets[entry->handle % VIRTIO_GPU_MAP_CACHE_BUCKETS];
+	cache->buckets[entry->handle % VIRTIO_GPU_MAP_CACHE_BUCKETS] = entry;
+	entry->older = cache->newest;
+	if (cache->newest)
+		cache->newest->newer = entry;
+	else
+		cache->oldest = entry;
+	cache->newest = entry;
+	cache->bytes += entry->length;
+	cache->stats.kept++;
+	pthread_mutex_unlock(&cache->lock);
+
+	return true;
+}
+
+/**
+ * Android-EMU:
+ * record that the mapped rectangle is being read back from the host,
+ * replacing an earlier readback of the same mapping
+ */
+static int virtio_gpu_readback_put(struct driver *drv, struct mapping *mapping)
+{
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)drv->priv;
+	struct virtio_gpu_readback *readback;
+	int ret = 0;
+
+	pthread_mutex_lock(&priv->readbacks_lock);
+	for (readback = priv->readbacks; readback; readback = readback->next) {
+		if (readback->handle == mapping->vma->handle)
+			break;
+	}
+
+	if (!readback) {
+		readback = calloc(1, sizeof(*readback));
+		if (readback) {
+			readback->handle = mapping->vma->handle;
+			readback->next = priv->readbacks;
+			priv->readbacks = readback;
+		} else {
+			ret = -ENOMEM;
+		}
+	}
+
+	if (readback)
+		readback->rect = mapping->rect;
+	pthread_mutex_unlock(&priv->readbacks_lock);
+
+	return ret;
+}
+
+/**
+ * Android-EMU:
+ * forget the readback of a mapping, returns true if there was one and it
+ * covers the mapped rectangle, so only its completion is left to wait for
+ */
+static bool virtio_gpu_readback_take(struct driver *drv, struct mapping *mapping)
+{
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)drv->priv;
+	struct virtio_gpu_readback **link, *readback;
+	const struct rectangle *rect = &mapping->rect;
+	bool covered = false;
+
+	pthread_mutex_lock(&priv->readbacks_lock);
+	for (link = &priv->readbacks; *link; link = &(*link)->next) {
+		if ((*link)->handle == mapping->vma->handle)
+			break;
+	}
+
+	readback = *link;
+	if (readback) {
+		covered = readback->rect.x <= rect->x && readback->rect.y <= rect->y &&
+			  readback->rect.x + readback->rect.width >= rect->x + rect->width &&
+			  readback->rect.y + readback->rect.height >= rect->y + rect->height;
+		*link = readback->next;
+		free(readback);
+	}
+	pthread_mutex_unlock(&priv->readbacks_lock);
+
+	return covered;
+}
+
+/**
+ * Android-EMU:
+ * forget the readback of a handle that is unmapped or destroyed, so a later
+ * buffer with the same handle is read back anew
+ */
+static void virtio_gpu_readback_drop(struct driver *drv, uint32_t handle)
+{
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)drv->priv;
+	struct virtio_gpu_readback **link, *readback;
+
+	pthread_mutex_lock(&priv->readbacks_lock);
+	for (link = &priv->readbacks; *link; link = &(*link)->next) {
+		if ((*link)->handle == handle) {
+			readback = *link;
+			*link = readback->next;
+			free(readback);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&priv->readbacks_lock);
+}
+
+/**
+ * Android-EMU:
+ * unlink retained buffers older than the age bound, then the oldest ones
+ * until the retained memory fits into the memory bound; the pool lock is
+ * held, and the unlinked entries are returned for virtio_gpu_pool_release()
+ */
+static struct virtio_gpu_pool_entry *virtio_gpu_pool_trim(struct virtio_gpu_pool *pool,
+							  uint64_t now_ns, size_t max_bytes)
+{
+	struct virtio_gpu_pool_entry *entry, *evicted = NULL;
+
+	while (pool->oldest && (pool->bytes > max_bytes ||
+				now_ns - pool->oldest->released_ns > VIRTIO_GPU_POOL_MAX_AGE_NS)) {
+		entry = pool->oldest;
+		virtio_gpu_pool_unlink(pool, entry);
+		entry->next = evicted;
+		evicted = entry;
+		pool->stats.evicted++;
+	}
+
+	return evicted;
+}
+
+/**
+ * Android-EMU:
+ * close the buffers of entries unlinked by virtio_gpu_pool_trim(), without
+ * the pool lock, so creations and destructions do not wait for the ioctls
+ */
+static void virtio_gpu_pool_release(struct driver *drv, struct virtio_gpu_pool_entry *evicted)
+{
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)drv->priv;
+	struct virtio_gpu_pool_entry *entry;
+	struct bo bo;
+
+	while (evicted) {
+		entry = evicted;
+		evicted = entry->next;
+
+		memset(&bo, 0, sizeof(bo));
+		bo.drv = drv;
+		bo.num_planes = entry->num_planes;
+		memcpy(bo.handles, entry->handles, sizeof(bo.handles));
+		virtio_gpu_map_cache_evict(drv, bo.handles, bo.num_planes);
+		if (priv->has_3d)
+			drv_gem_bo_destroy(&bo);
+		else
+			drv_dumb_bo_destroy(&bo);
+
+		free(entry);
+	}
+}
+
+/**
+ * Android-EMU:
+ * release retained buffers as they pass the age bound, so a process that
+ * stops creating and destroying buffers does not keep them until it exits
+ */
+static void *virtio_gpu_pool_reaper(void *arg)
+{
+	struct driver *drv = arg;
+	struct virtio_gpu_pool *pool = &((struct virtio_gpu_priv *)drv->priv)->pool;
+	struct virtio_gpu_pool_entry *evicted;
+	struct timespec deadline;
+	uint64_t deadline_ns;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->closing) {
+		if (!pool->oldest) {
+			pthread_cond_wait(&pool->reaper_cond, &pool->lock);
+			continue;
+		}
+
+		deadline_ns = pool->oldest->released_ns + VIRTIO_GPU_POOL_MAX_AGE_NS + 1;
+		if (virtio_gpu_now_ns() < deadline_ns) {
+			deadline.tv_sec = deadline_ns / 1000000000ull;
+			deadline.tv_nsec = deadline_ns % 1000000000ull;
+			pthread_cond_timedwait(&pool->reaper_cond, &pool->lock, &deadline);
+			continue;
+		}
+
+		evicted = virtio_gpu_pool_trim(pool, virtio_gpu_now_ns(), VIRTIO_GPU_POOL_MAX_BYTES);
+		pthread_mutex_unlock(&pool->lock);
+		virtio_gpu_pool_release(drv, evicted);
+		pthread_mutex_lock(&pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+/**
+ * Android-EMU:
+ * take a retained buffer of the same format, size and usage, returns true if
+ * the buffer object was filled in from the pool
+ */
+static bool virtio_gpu_pool_take(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
+				 uint64_t use_flags)
+{
+	struct virtio_gpu_pool *pool = &((struct virtio_gpu_priv *)bo->drv->priv)->pool;
+	struct virtio_gpu_pool_entry *entry, *evicted;
+	uint32_t bucket = virtio_gpu_pool_bucket(format, width, height);
+
+	if (!VIRTIO_GPU_POOL)
+		return false;
+
+	// buffers past the age bound are never handed out
+	pthread_mutex_lock(&pool->lock);
+	evicted = virtio_gpu_pool_trim(pool, virtio_gpu_now_ns(), VIRTIO_GPU_POOL_MAX_BYTES);
+
+	// the most recently released match comes first, its pages are the warmest
+	for (entry = pool->buckets[bucket]; entry; entry = entry->next) {
+		if (entry->format == format && entry->width == width && entry->height == height &&
+		    entry->use_flags == use_flags && entry->num_planes == bo->num_planes)
+			break;
+	}
+
+	if (!entry) {
+		pool->stats.misses++;
+		pthread_mutex_unlock(&pool->lock);
+		virtio_gpu_pool_release(bo->drv, evicted);
+		return false;
+	}
+
+	memcpy(bo->handles, entry->handles, sizeof(bo->handles));
+	memcpy(bo->offsets, entry->offsets, sizeof(bo->offsets));
+	memcpy(bo->sizes, entry->sizes, sizeof(bo->sizes));
+	memcpy(bo->strides, entry->strides, sizeof(bo->strides));
+	memcpy(bo->format_modifiers, entry->format_modifiers, sizeof(bo->format_modifiers));
+	bo->total_size = entry->total_size;
+	bo->tiling = entry->tiling;
+
+	virtio_gpu_pool_unlink(pool, entry);
+	free(entry);
+	pool->stats.hits++;
+	pthread_mutex_unlock(&pool->lock);
+	virtio_gpu_pool_release(bo->drv, evicted);
+
+	return true;
+}
+
+/**
+ * Android-EMU:
+ * retain a buffer that is being destroyed, returns true if the pool took
+ * ownership of its handles; buffers other processes may hold are never retained
+ */
+static bool virtio_gpu_pool_put(struct bo *bo)
+{
+	struct virtio_gpu_pool *pool = &((struct virtio_gpu_priv *)bo->drv->priv)->pool;
+	struct virtio_gpu_pool_entry *entry, *evicted;
+	struct virtio_gpu_pool_entry **bucket;
+	uint64_t now_ns = virtio_gpu_now_ns();
+
+	if (!VIRTIO_GPU_POOL)
+		return false;
+
+	// tiled buffers are not recycled, creations of the pool's kind expect linear ones
+	if (drv_bo_is_shared(bo) || bo->total_size > VIRTIO_GPU_POOL_MAX_BYTES / 4 ||
+	    bo->format_modifiers[0] != DRM_FORMAT_MOD_LINEAR) {
+		pthread_mutex_lock(&pool->lock);
+		pool->stats.rejected++;
+		evicted = virtio_gpu_pool_trim(pool, now_ns, VIRTIO_GPU_POOL_MAX_BYTES);
+		pthread_mutex_unlock(&pool->lock);
+		virtio_gpu_pool_release(bo->drv, evicted);
+		return false;
+	}
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		return false;
+
+	entry->width = bo->width;
+	entry->height = bo->height;
+	entry->format = bo->format;
+	entry->use_flags = bo->use_flags;
+	entry->num_planes = bo->num_planes;
+	memcpy(entry->handles, bo->handles, sizeof(entry->handles));
+	memcpy(entry->offsets, bo->offsets, sizeof(entry->offsets));
+	memcpy(entry->sizes, bo->sizes, sizeof(entry->sizes));
+	memcpy(entry->strides, bo->strides, sizeof(entry->strides));
+	memcpy(entry->format_modifiers, bo->format_modifiers, sizeof(entry->format_modifiers));
+	entry->total_size = bo->total_size;
+	entry->tiling = bo->tiling;
+	entry->released_ns = now_ns;
+
+	pthread_mutex_lock(&pool->lock);
+	evicted = virtio_gpu_pool_trim(pool, now_ns, VIRTIO_GPU_POOL_MAX_BYTES - entry->total_size);
+
+	bucket = &pool->buckets[virtio_gpu_pool_bucket(entry->format, entry->width, entry->height)];
+	entry->next = *bucket;
+	*bucket = entry;
+	entry->older = pool->newest;
+	if (pool->newest)
+		pool->newest->newer = entry;
+	else
+		pool->oldest = entry;
+	pool->newest = entry;
+	pool->bytes += entry->total_size;
+	pool->stats.recycled++;
+
+	if (!pool->reaper_started)
+		pool->reaper_started =
+		    !pthread_create(&pool->reaper, NULL, virtio_gpu_pool_reaper, bo->drv);
+	else if (pool->oldest == entry)
+		pthread_cond_signal(&pool->reaper_cond);
+	pthread_mutex_unlock(&pool->lock);
+	virtio_gpu_pool_release(bo->drv, evicted);
+
+	return true;
+}
+
+/**
+ * Android-EMU:
+ * what a cached capability set is only valid for: this boot of the guest,
+ * this device, and the same 3D support
+ */
+static int virtio_gpu_caps_key(struct driver *drv, struct virtio_gpu_caps_key *key)
+{
+	int fd;
+	ssize_t len;
+	struct stat st;
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)drv->priv;
+
+	memset(key, 0, sizeof(*key));
+
+	fd = open(VIRTIO_GPU_BOOT_ID_PATH, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	len = read(fd, key->boot_id, sizeof(key->boot_id) - 1);
+	close(fd);
+	if (len <= 0 || fstat(drv->fd, &st))
+		return -EINVAL;
+
+	key->rdev = st.st_rdev;
+	key->has_3d = priv->has_3d;
+	return 0;
+}
+
+/**
+ * Android-EMU:
+ * whether the format is one of a list of formats
+ */
+static bool virtio_gpu_format_listed(const uint32_t *formats, size_t num_formats, uint32_t format)
+{
+	size_t i;
+
+	for (i = 0; i < num_formats; i++) {
+		if (formats[i] == format)
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * Android-EMU:
+ * check a cached combination against the capabilities cached with it, the
+ * same way virtio_gpu_add_combination() checks a combination before adding it
+ */
+static bool virtio_gpu_cached_combo_valid(struct virtio_gpu_priv *priv,
+					  const struct virtio_gpu_cached_combo *combo)
+{
+	bool listed;
+
+	// only formats this driver adds, with the use flags it adds them with
+	if (priv->has_3d)
+		listed = virtio_gpu_format_listed(render_target_formats,
+						  ARRAY_SIZE(render_target_formats), combo->format) ||
+			 virtio_gpu_format_listed(texture_source_formats,
+						  ARRAY_SIZE(texture_source_formats), combo->format) ||
+			 virtio_gpu_format_listed(yuv_texture_source_formats,
+						  ARRAY_SIZE(yuv_texture_source_formats), combo->format);
+	else
+		listed = virtio_gpu_format_listed(render_target_formats,
+						  ARRAY_SIZE(render_target_formats), combo->format) ||
+			 virtio_gpu_format_listed(dumb_texture_source_formats,
+						  ARRAY_SIZE(dumb_texture_source_formats), combo->format);
+
+	if (!listed ||
+	    (combo->use_flags & ~(BO_USE_RENDER_MASK | BO_USE_TEXTURE_MASK | BO_USE_SCANOUT)))
+		return false;
+
+	if (combo->modifier != DRM_FORMAT_MOD_LINEAR)
+		return priv->has_3d && virtio_gpu_find_modifier(priv, combo->format, combo->modifier);
+
+	if (!priv->has_3d)
+		return true;
+
+	if ((combo->use_flags & BO_USE_RENDERING) &&
+	    !virtio_gpu_caps_has_format(&priv->caps.v1.render, translate_format(combo->format, 0)))
+		return false;
+
+	return !(combo->use_flags & BO_USE_TEXTURE) ||
+	       virtio_gpu_caps_has_format(&priv->caps.v1.sampler,
+					  translate_format(combo->format, 0)) ||
+	       virtio_gpu_emulated_format(priv, combo->format);
+}
+
+/**
+ * Android-EMU:
+ * take the capabilities and combinations from the cache another process
+ * stored, without querying the host; the file is writable by whoever owns
+ * it, so anything the driver would not have added itself rejects the cache
+ */
+static int virtio_gpu_caps_cache_load(struct driver *drv, const struct virtio_gpu_caps_key *key)
+{
+	int fd, ret = -EINVAL;
+	uint32_t i;
+	struct stat st;
+	struct virtio_gpu_caps_cache *cache;
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)drv->priv;
+
+	fd = open(VIRTIO_GPU_CAPS_CACHE_PATH, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*cache)) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	cache = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (cache == MAP_FAILED)
+		return -errno;
+
+	if (cache->magic != VIRTIO_GPU_CAPS_CACHE_MAGIC ||
+	    cache->version != VIRTIO_GPU_CAPS_CACHE_VERSION || cache->size != st.st_size ||
+	    cache->num_combos != (st.st_size - sizeof(*cache)) / sizeof(cache->combos[0]) ||
+	    cache->size != sizeof(*cache) + cache->num_combos * sizeof(cache->combos[0]) ||
+	    memcmp(&cache->key, key, sizeof(*key)) ||
+	    cache->modifiers.num_modifiers > VIRGL_CAPS_MAX_MODIFIERS)
+		goto out;
+
+	priv->caps = cache->caps;
+	priv->modifiers = cache->modifiers;
+	for (i = 0; i < cache->num_combos; i++) {
+		if (!virtio_gpu_cached_combo_valid(priv, &cache->combos[i])) {
+			drv_log("Ignoring the capability cache, it has an unsupported combination\n");
+			memset(&priv->caps, 0, sizeof(priv->caps));
+			memset(&priv->modifiers, 0, sizeof(priv->modifiers));
+			goto out;
+		}
+	}
+
+	for (i = 0; i < cache->num_combos; i++) {
+		struct format_metadata metadata = LINEAR_METADATA;
+
+		metadata.priority = cache->combos[i].priority;
+		metadata.modifier = cache->combos[i].modifier;
+		drv_add_combinations(drv, &cache->combos[i].format, 1, &metadata,
+				     cache->combos[i].use_flags);
+	}
+	ret = 0;
+
+out:
+	munmap(cache, st.st_size);
+	return ret;
+}
+
+/**
+ * Android-EMU:
+ * publish the capabilities and the combinations added from index first_combo
+ * on; the cache is written aside and renamed into place, so readers either
+ * see the previous cache or the complete new one
+ */
+static void virtio_gpu_caps_cache_store(struct driver *drv, const struct virtio_gpu_caps_key *key,
+					size_t first_combo)
+{
+	int fd;
+	size_t i, size;
+	uint32_t num_combos = drv_array_size(drv->combos) - first_combo;
+	char path[] = VIRTIO_GPU_CAPS_CACHE_PATH ".XXXXXX";
+	struct virtio_gpu_caps_cache *cache;
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)drv->priv;
+
+	size = sizeof(*cache) + num_combos * sizeof(cache->combos[0]);
+	cache = calloc(1, size);
+	if (!cache)
+		return;
+
+	cache->magic = VIRTIO_GPU_CAPS_CACHE_MAGIC;
+	cache->version = VIRTIO_GPU_CAPS_CACHE_VERSION;
+	cache->size = size;
+	cache->num_combos = num_combos;
+	cache->key = *key;
+	cache->caps = priv->caps;
+	cache->modifiers = priv->modifiers;
+	for (i = 0; i < num_combos; i++) {
+		struct combination *combo = drv_array_at_idx(drv->combos, first_combo + i);
+		cache->combos[i].format = combo->format;
+		cache->combos[i].priority = combo->metadata.priority;
+		cache->combos[i].use_flags = combo->use_flags;
+		cache->combos[i].modifier = combo->metadata.modifier;
+	}
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		free(cache);
+		return;
+	}
+
+	if (fchmod(fd, 0644) || write(fd, cache, size) != (ssize_t)size || fsync(fd) ||
+	    rename(path, VIRTIO_GPU_CAPS_CACHE_PATH))
+		unlink(path);
+
+	close(fd);
+	free(cache);
+}
+
+/* Android-EMU: end of modification */
+
+/* Android-EMU: start of modification */
+
+/**
+ * Android-EMU:
+ * query the layouts besides linear the host allocates blobs in, keeping the
+ * ones the guest can size: a single plane of power of two tiles
+ */
+static int virtio_gpu_get_modifiers(struct driver *drv, struct virgl_caps_modifiers *modifiers)
+{
+	int ret;
+	uint32_t i;
+	struct virgl_caps_modifiers caps;
+	struct drm_virtgpu_get_caps cap_args;
+
+	memset(modifiers, 0, sizeof(*modifiers));
+	memset(&caps, 0, sizeof(caps));
+	memset(&cap_args, 0, sizeof(cap_args));
+	cap_args.cap_set_id = VIRGL_CAPSET_ANDROID_EMU_MODIFIERS;
+	cap_args.addr = (unsigned long long)(uintptr_t)&caps;
+	cap_args.size = sizeof(caps);
+
+	// a host without the capability set keeps every buffer linear
+	ret = drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_GET_CAPS, &cap_args);
+	if (ret)
+		return ret;
+
+	modifiers->version = caps.version;
+	for (i = 0; i < caps.num_modifiers && i < VIRGL_CAPS_MAX_MODIFIERS; i++) {
+		const struct virgl_format_modifier *entry = &caps.modifiers[i];
+
+		if (!entry->format || entry->modifier == DRM_FORMAT_MOD_LINEAR ||
+		    entry->modifier == DRM_FORMAT_MOD_INVALID || !entry->tile_width ||
+		    (entry->tile_width & (entry->tile_width - 1)) || !entry->tile_height ||
+		    (entry->tile_height & (entry->tile_height - 1))) {
+			drv_log("Skipping unusable layout 0x%llx of format %u\n",
+				(unsigned long long)entry->modifier, entry->format);
+			continue;
+		}
+
+		modifiers->modifiers[modifiers->num_modifiers++] = *entry;
+	}
+
+	return 0;
+}
+
+/**
+ * Android-EMU:
+ * add a combination per layout the host offers for the formats; they leave
+ * out CPU access, so linear stays the layout of buffers mapped by software
+ */
+static void virtio_gpu_add_modifier_combinations(struct driver *drv, const uint32_t *drm_formats,
+						 uint32_t num_formats)
+{
+	uint32_t i, j;
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)drv->priv;
+
+	for (i = 0; i < num_formats; i++) {
+		for (j = 0; j < priv->modifiers.num_modifiers; j++) {
+			const struct virgl_format_modifier *entry = &priv->modifiers.modifiers[j];
+			struct format_metadata metadata = { .priority = 2,
+							    .tiling = 0,
+							    .modifier = entry->modifier };
+			uint64_t use_flags = BO_USE_RENDERING | BO_USE_TEXTURE;
+
+			if (virtio_gpu_find_modifier(priv, drm_formats[i], entry->modifier) != entry)
+				continue;
+
+			if (entry->bind & VIRGL_BIND_SCANOUT)
+				use_flags |= BO_USE_SCANOUT;
+
+			drv_add_combination(drv, drm_formats[i], &metadata, use_flags);
+		}
+	}
+}
+
+/* Android-EMU: end of modification */
+
+static int virtio_gpu_init(struct driver *drv)
+{
+	int ret;
+	struct virtio_gpu_priv *priv;
+	struct drm_virtgpu_getparam args;
+
+	/* Android-EMU: start of modification */
+
+	int caps_ret, has_key;
+	size_t first_combo;
+	struct virtio_gpu_caps_key key;
+	pthread_condattr_t cond_attr;
+
+	/* Android-EMU: end of modification */
+
+	priv = calloc(1, sizeof(*priv));
+	drv->priv = priv;
+
+	/* Android-EMU: start of modification */
+
+	pthread_mutex_init(&priv->pool.lock, NULL);
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&priv->pool.reaper_cond, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+	pthread_mutex_init(&priv->maps.lock, NULL);
+	pthread_mutex_init(&priv->readbacks_lock, NULL);
+
+	// Android-EMU: count the references of our handles without the driver lock
+	if (drv_handle_refs_init(drv))
+		drv_log("no lock-free reference counts left, using the buffer table\n");
+
+	/* Android-EMU: end of modification */
+
+	memset(&args, 0, sizeof(args));
+	args.param = VIRTGPU_PARAM_3D_FEATURES;
+	args.value = (uint64_t)(uintptr_t)&priv->has_3d;
+	ret = drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_GETPARAM, &args);
+	if (ret) {
+		drv_log("virtio 3D acceleration is not available\n");
+		/* Be paranoid */
+		priv->has_3d = 0;
+	}
+
+	/* Android-EMU: start of modification */
+
+	// Android-EMU: blobs need both host allocation and a guest mapping of host memory
+	if (priv->has_3d) {
+		uint64_t resource_blob = 0, host_visible = 0;
+
+		memset(&args, 0, sizeof(args));
+		args.param = VIRTGPU_PARAM_RESOURCE_BLOB;
+		args.value = (uint64_t)(uintptr_t)&resource_blob;
+		if (!drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_GETPARAM, &args)) {
+			args.param = VIRTGPU_PARAM_HOST_VISIBLE;
+			args.value = (uint64_t)(uintptr_t)&host_visible;
+			if (!drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_GETPARAM, &args))
+				priv->has_blob = resource_blob && host_visible;
+		}
+	}
+
+	// Android-EMU: reuse the capabilities and combinations of an earlier process
+	has_key = !virtio_gpu_caps_key(drv, &key);
+	if (has_key && !virtio_gpu_caps_cache_load(drv, &key))
+		goto combinations_added;
+
+	first_combo = drv_array_size(drv->combos);
+
+	// Android-EMU: detect the host's graphics capabilities
+	caps_ret = virtio_gpu_get_caps(drv, &priv->caps);
+
+	// Android-EMU: the host's own layouts only reach the guest as blobs
+	if (priv->has_blob && !caps_ret)
+		virtio_gpu_get_modifiers(drv, &priv->modifiers);
+
+	// Android-EMU: 
+	// replace drv_add_combination() calls with our virtio_gpu_add_combinations()
+	// enables synchronization of the host's graphics capabilities with the guest.
+	virtio_gpu_add_combinations(drv, render_target_formats, ARRAY_SIZE(render_target_formats),
+				    &LINEAR_METADATA, BO_USE_RENDER_MASK);
+
+	if (priv->has_3d) {
+		virtio_gpu_add_combinations(drv, texture_source_formats,
+					    ARRAY_SIZE(texture_source_formats), &LINEAR_METADATA,
+					    BO_USE_TEXTURE_MASK);
+
+		/* Android-EMU: start of modification */
+
+		// Android-EMU: YUV formats are offered even if the host lacks them
+		virtio_gpu_add_combinations(drv, yuv_texture_source_formats,
+					    ARRAY_SIZE(yuv_texture_source_formats), &LINEAR_METADATA,
+					    BO_USE_TEXTURE_MASK);
+
+		// Android-EMU: render targets in the layouts the host prefers over linear
+		virtio_gpu_add_modifier_combinations(drv, render_target_formats,
+						     ARRAY_SIZE(render_target_formats));
+
+		/* Android-EMU: end of modification */
+	} else {
+		virtio_gpu_add_combinations(drv, dumb_texture_source_formats,
+				     ARRAY_SIZE(dumb_texture_source_formats), &LINEAR_METADATA,
+				     BO_USE_TEXTURE_MASK);
+	}
+
+	// Android-EMU: a failed query is not cached, so the next process retries it
+	if (has_key && !caps_ret)
+		virtio_gpu_caps_cache_store(drv, &key, first_combo);
+
+combinations_added:
+
+	// Android-EMU: index the combinations for setup and format probes
+	ret = drv_combination_index_build(drv);
+	if (ret)
+		drv_log("indexing the combinations failed, they will be scanned\n");
+
+	/* Android-EMU: end of modification */
+
+	return drv_modify_linear_combinations(drv);
+}
+
+static void virtio_gpu_close(struct driver *drv)
+{
+	/* Android-EMU: start of modification */
+
+	// Android-EMU: release every retained buffer and report how the pool did
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)drv->priv;
+	struct virtio_gpu_pool_stats *stats = &priv->pool.stats;
+	struct virtio_gpu_pool_entry *evicted;
+
+	pthread_mutex_lock(&priv->pool.lock);
+	priv->pool.closing = true;
+	pthread_cond_signal(&priv->pool.reaper_cond);
+	pthread_mutex_unlock(&priv->pool.lock);
+	if (priv->pool.reaper_started)
+		pthread_join(priv->pool.reaper, NULL);
+
+	pthread_mutex_lock(&priv->pool.lock);
+	evicted = virtio_gpu_pool_trim(&priv->pool, virtio_gpu_now_ns(), 0);
+	pthread_mutex_unlock(&priv->pool.lock);
+	virtio_gpu_pool_release(drv, evicted);
+	pthread_cond_destroy(&priv->pool.reaper_cond);
+	pthread_mutex_destroy(&priv->pool.lock);
+
+	drv_log("buffer pool: %llu hits, %llu misses, %llu recycled, %llu rejected, %llu evicted\n",
+		(unsigned long long)stats->hits, (unsigned long long)stats->misses,
+		(unsigned long long)stats->recycled, (unsigned long long)stats->rejected,
+		(unsigned long long)stats->evicted);
+
+	pthread_mutex_lock(&priv->maps.lock);
+	virtio_gpu_map_cache_trim(&priv->maps, 0);
+	pthread_mutex_unlock(&priv->maps.lock);
+	pthread_mutex_destroy(&priv->maps.lock);
+
+	drv_log("mapping cache: %llu hits, %llu misses, %llu kept, %llu evicted\n",
+		(unsigned long long)priv->maps.stats.hits,
+		(unsigned long long)priv->maps.stats.misses,
+		(unsigned long long)priv->maps.stats.kept,
+		(unsigned long long)priv->maps.stats.evicted);
+
+	while (priv->readbacks) {
+		struct virtio_gpu_readback *readback = priv->readbacks;
+		priv->readbacks = readback->next;
+		free(readback);
+	}
+	pthread_mutex_destroy(&priv->readbacks_lock);
+
+	drv_combination_index_destroy(drv);
+	drv_handle_refs_release(drv);
+	drv_mapping_index_destroy(drv);
+
+	/* Android-EMU: end of modification */
+
+	free(drv->priv);
+	drv->priv = NULL;
+}
+
+static int virtio_gpu_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
+				uint64_t use_flags)
+{
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
+
+	/* Android-EMU: start of modification */
+
+	// Android-EMU: reuse a recently destroyed buffer of the same kind
+	if (virtio_gpu_pool_take(bo, width, height, format, use_flags))
+		return 0;
+
+	/* Android-EMU: end of modification */
+
+	if (priv->has_3d)
+		return virtio_virgl_bo_create(bo, width, height, format, use_flags);
+	else
+		return virtio_dumb_bo_create(bo, width, height, format, use_flags);
+}
+
+static int virtio_gpu_bo_destroy(struct bo *bo)
+{
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
+
+	/* Android-EMU: start of modification */
+
+	// Android-EMU: keep the buffer for reuse instead of destroying it
+	if (virtio_gpu_pool_put(bo))
+		return 0;
+
+	drv_bo_clear_shared(bo);
+	virtio_gpu_map_cache_evict(bo->drv, bo->handles, bo->num_planes);
+	virtio_gpu_readback_drop(bo->drv, bo->handles[0].u32);
+
+	/* Android-EMU: end of modification */
+
+	if (priv->has_3d)
+		return drv_gem_bo_destroy(bo);
+	else
+		return drv_dumb_bo_destroy(bo);
+}
+
+/* Android-EMU: start of modification */
+
+/**
+ * Android-EMU:
+ * create count identical buffers, e.g. a codec's output queue: recycled
+ * buffers are taken first, and the rest share the layout of the per-plane
+ * path, computed once; either all buffers are created or none
+ */
+static int virtio_gpu_bo_create_array(struct bo **bos, uint32_t count, uint32_t width,
+				      uint32_t height, uint32_t format, uint64_t use_flags)
+{
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bos[0]->drv->priv;
+	struct drv_layout layout;
+	bool shared_layout;
+	uint32_t i;
+	int ret = 0;
+
+	for (i = 0; i < count; i++)
+		if (!virtio_gpu_pool_take(bos[i], width, height, format, use_flags))
+			break;
+
+	shared_layout = i < count && priv->has_3d &&
+			virtio_virgl_planes_layout(priv, width, height, format, use_flags, &layout);
+
+	for (; i < count; i++) {
+		if (shared_layout)
+			ret = virtio_virgl_bo_create_planes(bos[i], width, height, format, &layout);
+		else if (priv->has_3d)
+			ret = virtio_virgl_bo_create(bos[i], width, height, format, use_flags);
+		else
+			ret = virtio_dumb_bo_create(bos[i], width, height, format, use_flags);
+
+		if (ret)
+			goto fail;
+	}
+
+	return 0;
+
+fail:
+	while (i--)
+		virtio_gpu_bo_destroy(bos[i]);
+
+	return ret;
+}
+
+/**
+ * Android-EMU:
+ * create a buffer in the layout the host prefers among the caller's
+ * modifiers; linear, or a layout the host fails to allocate, takes the
+ * usual path
+ */
+static int virtio_gpu_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint32_t height,
+					       uint32_t format, const uint64_t *modifiers,
+					       uint32_t count)
+{
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
+	const struct virgl_format_modifier *entry;
+	uint64_t order[VIRGL_CAPS_MAX_MODIFIERS];
+	uint32_t i, num_order = 0, virgl_format = translate_format(format, 0);
+
+	for (i = 0; i < priv->modifiers.num_modifiers; i++) {
+		if (priv->modifiers.modifiers[i].format == virgl_format)
+			order[num_order++] = priv->modifiers.modifiers[i].modifier;
+	}
+
+	entry = virtio_gpu_find_modifier(priv, format,
+					 drv_pick_modifier(modifiers, count, order, num_order));
+	if (entry && !virtio_virgl_bo_create_tiled(bo, width, height, format, entry))
+		return 0;
+
+	return virtio_gpu_bo_create(bo, width, height, format, bo->use_flags);
+}
+
+/* Android-EMU: end of modification */
+
+/* Android-EMU: start of modification */
+
+/**
+ * Android-EMU:
+ * convert between the shadow an emulated format is mapped as and the guest
+ * backing of its host resource
+ */
+static int virtio_gpu_emulated_convert(struct bo *bo, struct virtio_gpu_emulation *emulation,
+				       void *shadow, bool to_host)
+{
+	struct drv_image image, host_image;
+
+	drv_image_init(&image, bo->format, bo->width, bo->height, shadow, bo->strides,
+		       bo->offsets);
+	drv_image_init(&host_image, emulation->format, bo->width, bo->height, emulation->addr,
+		       emulation->layout.strides, emulation->layout.offsets);
+
+	return to_host ? drv_convert_image(&image, &host_image)
+		       : drv_convert_image(&host_image, &image);
+}
+
+/**
+ * Android-EMU:
+ * map the host resource of an emulated format and hand out a shadow in the
+ * buffer's own format, filled with the resource's content; the mapping is
+ * not kept by the mapping cache, since the shadow is private to it
+ */
+static void *virtio_gpu_emulated_map(struct bo *bo, struct vma *vma, uint32_t map_flags)
+{
+	int ret;
+	void *addr;
+	struct drm_virtgpu_map gem_map;
+	struct virtio_gpu_emulation *emulation;
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
+
+	emulation = calloc(1, sizeof(*emulation));
+	if (!emulation)
+		return MAP_FAILED;
+
+	emulation->format = virtio_gpu_emulated_format(priv, bo->format);
+	ret = drv_layout_compute(emulation->format, bo->width, bo->height, &emulation->layout);
+	if (ret)
+		goto free_emulation;
+
+	memset(&gem_map, 0, sizeof(gem_map));
+	gem_map.handle = bo->handles[0].u32;
+
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_MAP, &gem_map);
+	if (ret) {
+		drv_log("DRM_IOCTL_VIRTGPU_MAP failed with %s\n", strerror(errno));
+		goto free_emulation;
+	}
+
+	emulation->length = ALIGN(emulation->layout.total_size, PAGE_SIZE);
+	emulation->addr = mmap(0, emulation->length, PROT_READ | PROT_WRITE, MAP_SHARED,
+			       bo->drv->fd, gem_map.offset);
+	if (emulation->addr == MAP_FAILED)
+		goto free_emulation;
+
+	// the shadow is converted into even when mapped read-only
+	addr = mmap(0, bo->total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+		goto unmap_resource;
+
+	ret = virtio_gpu_emulated_convert(bo, emulation, addr, false);
+	if (ret) {
+		munmap(addr, bo->total_size);
+		goto unmap_resource;
+	}
+
+	vma->length = bo->total_size;
+	vma->priv = emulation;
+	return addr;
+
+unmap_resource:
+	munmap(emulation->addr, emulation->length);
+free_emulation:
+	free(emulation);
+	return MAP_FAILED;
+}
+
+/* Android-EMU: end of modification */
+
+static void *virtio_gpu_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
+{
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
+
+	/* Android-EMU: start of modification */
+
+	void *addr;
+
+	// Android-EMU: the app sees a shadow in the format it asked for
+	if (virtio_gpu_emulated_format(priv, bo->format))
+		return virtio_gpu_emulated_map(bo, vma, map_flags);
+
+	// Android-EMU: reuse the mapping the last unmap of the buffer kept
+	addr = virtio_gpu_map_cache_take(bo, vma, plane, map_flags);
+	if (addr != MAP_FAILED)
+		return addr;
+
+	/* Android-EMU: end of modification */
+
+	if (priv->has_3d)
+		return virtio_virgl_bo_map(bo, vma, plane, map_flags);
+	else
+		return drv_dumb_bo_map(bo, vma, plane, map_flags);
+}
+
+/* Android-EMU: start of modification */
+
+// Android-EMU: more damaged boxes than this are merged into their bounding box
+#define VIRTIO_GPU_MAX_DAMAGE_BOXES 16
+
+// Android-EMU: usages through which the host may write a buffer
+#define VIRTIO_GPU_HOST_WRITE_MASK                                                                 \
+	(BO_USE_RENDERING | BO_USE_RENDERSCRIPT | BO_USE_CAMERA_WRITE | BO_USE_HW_VIDEO_DECODER)
+
+// Android-EMU: the rectangles of a buffer's write mappings the host has not
+// received yet, disjoint unless merged into a bounding box
+struct virtio_gpu_damage {
+	uint32_t num_boxes;
+	struct rectangle boxes[VIRTIO_GPU_MAX_DAMAGE_BOXES];
+};
+
+/**
+ * Android-EMU:
+ * the damage record of a mapping, allocated on first use; NULL for layouts
+ * that are not tracked, which are transferred as a whole
+ */
+static struct virtio_gpu_damage *virtio_gpu_vma_damage(struct bo *bo, struct vma *vma)
+{
+	struct virtio_gpu_damage *damage = (struct virtio_gpu_damage *)vma->priv;
+
+	if (damage || bo->num_planes != 1 || !vma->addr)
+		return damage;
+
+	damage = calloc(1, sizeof(*damage));
+	vma->priv = damage;
+	return damage;
+}
+
+/**
+ * Android-EMU:
+ * whether two boxes overlap, or share an edge along which they make up a box
+ */
+static bool virtio_gpu_damage_merges(const struct rectangle *a, const struct rectangle *b)
+{
+	bool overlap_x = a->x < b->x + b->width && b->x < a->x + a->width;
+	bool overlap_y = a->y < b->y + b->height && b->y < a->y + a->height;
+
+	if (overlap_x && overlap_y)
+		return true;
+
+	if (a->y == b->y && a->height == b->height)
+		return a->x <= b->x + b->width && b->x <= a->x + a->width;
+
+	if (a->x == b->x && a->width == b->width)
+		return a->y <= b->y + b->height && b->y <= a->y + a->height;
+
+	return false;
+}
+
+static void virtio_gpu_rect_union(struct rectangle *a, const struct rectangle *b)
+{
+	uint32_t right = MAX(a->x + a->width, b->x + b->width);
+	uint32_t bottom = MAX(a->y + a->height, b->y + b->height);
+
+	a->x = MIN(a->x, b->x);
+	a->y = MIN(a->y, b->y);
+	a->width = right - a->x;
+	a->height = bottom - a->y;
+}
+
+/**
+ * Android-EMU:
+ * record a rectangle a write mapping may change; boxes it merges with are
+ * absorbed into it, and once the record is full every box is merged into one
+ */
+static void virtio_gpu_damage_add(struct virtio_gpu_damage *damage, const struct rectangle *rect)
+{
+	struct rectangle box = *rect;
+	uint32_t i;
+
+	if (!box.width || !box.height)
+		return;
+
+	for (i = 0; i < damage->num_boxes;) {
+		if (!virtio_gpu_damage_merges(&box, &damage->boxes[i])) {
+			i++;
+			continue;
+		}
+
+		// the grown box may now reach boxes it was checked against before
+		virtio_gpu_rect_union(&box, &damage->boxes[i]);
+		damage->boxes[i] = damage->boxes[--damage->num_boxes];
+		i = 0;
+	}
+
+	if (damage->num_boxes == VIRTIO_GPU_MAX_DAMAGE_BOXES) {
+		for (i = 0; i < damage->num_boxes; i++)
+			virtio_gpu_rect_union(&box, &damage->boxes[i]);
+		damage->num_boxes = 0;
+	}
+
+	damage->boxes[damage->num_boxes++] = box;
+}
+
+/**
+ * Android-EMU:
+ * record the rectangle of a write mapping as damaged; mappings of emulated
+ * formats and host-visible buffers keep no record, the former use vma->priv
+ * for their shadow and the latter are never transferred
+ */
+static void virtio_gpu_damage_map(struct bo *bo, struct mapping *mapping)
+{
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
+	struct virtio_gpu_damage *damage;
+
+	if (!(mapping->vma->map_flags & BO_MAP_WRITE) ||
+	    (bo->tiling & VIRTGPU_BLOB_FLAG_USE_MAPPABLE) ||
+	    virtio_gpu_emulated_format(priv, bo->format))
+		return;
+
+	damage = virtio_gpu_vma_damage(bo, mapping->vma);
+	if (damage)
+		virtio_gpu_damage_add(damage, &mapping->rect);
+}
+
+/**
+ * Android-EMU:
+ * transfer a box of a resource; both transfer ioctls take the same layout,
+ * and offset is where the box's plane starts in the resource's backing
+ */
+static int virtio_gpu_transfer(struct bo *bo, unsigned long request, uint32_t handle,
+			       const struct rectangle *box, uint32_t offset)
+{
+	int ret;
+	struct drm_virtgpu_3d_transfer_to_host xfer;
+
+	memset(&xfer, 0, sizeof(xfer));
+	xfer.bo_handle = handle;
+	xfer.box.x = box->x;
+	xfer.box.y = box->y;
+	xfer.box.w = box->width;
+	xfer.box.h = box->height;
+	xfer.box.d = 1;
+	xfer.offset = offset;
+
+	ret = drmIoctl(bo->drv->fd, request, &xfer);
+	if (ret) {
+		drv_log("%s failed with %s\n",
+			request == DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST ? "DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST"
+								     : "DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST",
+			strerror(errno));
+		return ret;
+	}
+
+	return 0;
+}
+
+static int virtio_gpu_transfer_to_host(struct bo *bo, uint32_t handle, const struct rectangle *box)
+{
+	return virtio_gpu_transfer(bo, DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST, handle, box, 0);
+}
+
+/**
+ * Android-EMU:
+ * the box of a plane that holds the pixels of a rectangle of the buffer;
+ * subsampled planes round the start down and the end up
+ */
+static void virtio_gpu_plane_box(uint32_t format, size_t plane, const struct rectangle *rect,
+				 struct rectangle *box)
+{
+	uint32_t x1 = drv_width_from_format(format, rect->x + rect->width, plane);
+	uint32_t y1 = drv_height_from_format(format, rect->y + rect->height, plane);
+
+	box->x = drv_width_from_format(format, rect->x + 1, plane) - 1;
+	box->y = drv_height_from_format(format, rect->y + 1, plane) - 1;
+	box->width = x1 - box->x;
+	box->height = y1 - box->y;
+}
+
+/**
+ * Android-EMU:
+ * transfer the mapped rectangle plane by plane, so subsampled chroma planes
+ * get boxes of their own size; planes sharing one resource are addressed by
+ * their offset, planes with resources of their own by their handle
+ */
+static int virtio_gpu_transfer_planes(struct bo *bo, struct mapping *mapping, unsigned long request)
+{
+	struct rectangle box;
+	size_t plane;
+	int ret;
+
+	for (plane = 0; plane < bo->num_planes; plane++) {
+		bool shared = (bo->handles[plane].u32 == bo->handles[0].u32);
+
+		virtio_gpu_plane_box(bo->format, plane, &mapping->rect, &box);
+		if (!box.width || !box.height)
+			continue;
+
+		ret = virtio_gpu_transfer(bo, request, bo->handles[plane].u32, &box,
+					  shared ? bo->offsets[plane] : 0);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * Android-EMU:
+ * transfer the whole host resource of an emulated format, plane by plane in
+ * the host format's layout; the shadow is converted as a whole as well
+ */
+static int virtio_gpu_emulated_transfer(struct bo *bo, struct virtio_gpu_emulation *emulation,
+					unsigned long request)
+{
+	struct rectangle rect = { 0, 0, bo->width, bo->height };
+	struct rectangle box;
+	size_t plane;
+	int ret;
+
+	for (plane = 0; plane < emulation->layout.num_planes; plane++) {
+		virtio_gpu_plane_box(emulation->format, plane, &rect, &box);
+		ret = virtio_gpu_transfer(bo, request, bo->handles[0].u32, &box,
+					  emulation->layout.offsets[plane]);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * Android-EMU:
+ * transfer the damaged boxes of a buffer, the flushed mapping's rectangle
+ * among them as the CPU may have written it since it was mapped; the boxes
+ * of write mappings that ended without a flush go along with it. A failed
+ * transfer keeps its box and the ones after it for the next flush.
+ */
+static int virtio_gpu_flush_damage(struct bo *bo, struct mapping *mapping,
+				   struct virtio_gpu_damage *damage)
+{
+	uint32_t i;
+	int ret = 0;
+
+	virtio_gpu_damage_add(damage, &mapping->rect);
+
+	for (i = 0; i < damage->num_boxes; i++) {
+		ret = virtio_gpu_transfer_to_host(bo, mapping->vma->handle, &damage->boxes[i]);
+		if (ret)
+			break;
+	}
+
+	memmove(damage->boxes, &damage->boxes[i],
+		(damage->num_boxes - i) * sizeof(damage->boxes[0]));
+	damage->num_boxes -= i;
+	return ret;
+}
+
+/* Android-EMU: end of modification */
+
+/* Android-EMU: start of modification */
+
+/**
+ * Android-EMU:
+ * queue the transfers that read the mapped rectangle back from the host,
+ * without waiting for them to complete
+ */
+static int virtio_gpu_transfer_from_host(struct bo *bo, struct mapping *mapping)
 {
 	int ret;
-	struct drm_virtgpu_map gem_map;
+	struct drm_virtgpu_3d_transfer_from_host xfer;
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
 
-	memset(&gem_map, 0, sizeof(gem_map));
-	gem_map.handle = bo->handles[0].u32;
+	// read the host resource of an emulated format back as a whole
+	if (virtio_gpu_emulated_format(priv, bo->format))
+		return virtio_gpu_emulated_transfer(bo, (struct virtio_gpu_emulation *)mapping->vma->priv,
+						    DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST);
 
-	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_MAP, &gem_map);
+	// read multi-planar buffers back plane by plane
+	if (bo->num_planes > 1)
+		return virtio_gpu_transfer_planes(bo, mapping, DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST);
+
+	memset(&xfer, 0, sizeof(xfer));
+	xfer.bo_handle = mapping->vma->handle;
+	xfer.box.x = mapping->rect.x;
+	xfer.box.y = mapping->rect.y;
+	xfer.box.w = mapping->rect.width;
+	xfer.box.h = mapping->rect.height;
+	xfer.box.d = 1;
+
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST, &xfer);
 	if (ret) {
-		drv_log("DRM_IOCTL_VIRTGPU_MAP failed with %s\n", strerror(errno));
-		return MAP_FAILED;
+		drv_log("DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST failed with %s\n", strerror(errno));
+		return ret;
 	}
 
-	vma->length = bo->total_size;
-	return mmap(0, bo->total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
-		    gem_map.offset);
+	return 0;
 }
 
-static int virtio_gpu_init(struct driver *drv)
+/**
+ * Android-EMU:
+ * a sync_file that signals when the host's pending writes to the buffer,
+ * including queued readbacks, have landed; -1 if the kernel cannot export one
+ */
+static int virtio_gpu_export_fence(struct bo *bo, uint32_t handle)
+{
+	int ret, prime_fd;
+	struct dma_buf_export_sync_file export_sync;
+
+	if (drmPrimeHandleToFD(bo->drv->fd, handle, DRM_CLOEXEC, &prime_fd))
+		return -1;
+
+	memset(&export_sync, 0, sizeof(export_sync));
+	export_sync.flags = DMA_BUF_SYNC_READ;
+	export_sync.fd = -1;
+
+	ret = drmIoctl(prime_fd, DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &export_sync);
+	close(prime_fd);
+
+	return ret ? -1 : export_sync.fd;
+}
+
+/* Android-EMU: end of modification */
+
+static int virtio_gpu_bo_invalidate(struct bo *bo, struct mapping *mapping)
 {
 	int ret;
-	struct virtio_gpu_priv *priv;
-	struct drm_virtgpu_getparam args;
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
 
-	priv = calloc(1, sizeof(*priv));
-	drv->priv = priv;
+	/* Android-EMU: start of modification */
 
-	memset(&args, 0, sizeof(args));
-	args.param = VIRTGPU_PARAM_3D_FEATURES;
-	args.value = (uint64_t)(uintptr_t)&priv->has_3d;
-	ret = drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_GETPARAM, &args);
-	if (ret) {
-		drv_log("virtio 3D acceleration is not available\n");
-		/* Be paranoid */
-		priv->has_3d = 0;
-	}
+	struct drm_virtgpu_3d_wait waitcmd;
+
+	/* Android-EMU: end of modification */
+
+	if (!priv->has_3d)
+		return 0;
 
 	/* Android-EMU: start of modification */
 
-	// Android-EMU: detect the host's graphics capabilities
-	virtio_gpu_get_caps(drv, &priv->caps);
+	// Android-EMU: every map invalidates, so a write mapping's rectangle is
+	// recorded here for the next flush of the buffer
+	virtio_gpu_damage_map(bo, mapping);
 
-	// Android-EMU: 
-	// replace drv_add_combination() calls with our virtio_gpu_add_combinations()
-	// enables synchronization of the host's graphics capabilities with the guest.
-	virtio_gpu_add_combinations(drv, render_target_formats, ARRAY_SIZE(render_target_formats),
-				    &LINEAR_METADATA, BO_USE_RENDER_MASK);
+	// Android-EMU: the host cannot have changed a buffer it never writes
+	if (!(bo->use_flags & VIRTIO_GPU_HOST_WRITE_MASK))
+		return 0;
 
-	if (priv->has_3d) {
-		virtio_gpu_add_combinations(drv, texture_source_formats,
-					    ARRAY_SIZE(texture_source_formats), &LINEAR_METADATA,
-					    BO_USE_TEXTURE_MASK);
-	} else {
-		virtio_gpu_add_combinations(drv, dumb_texture_source_formats,
-				     ARRAY_SIZE(dumb_texture_source_formats), &LINEAR_METADATA,
-				     BO_USE_TEXTURE_MASK);
+	// Android-EMU: a host-visible buffer only has to wait for the host's writes
+	if (bo->tiling & VIRTGPU_BLOB_FLAG_USE_MAPPABLE) {
+		memset(&waitcmd, 0, sizeof(waitcmd));
+		waitcmd.handle = mapping->vma->handle;
+		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_WAIT, &waitcmd);
+		if (ret)
+			drv_log("DRM_IOCTL_VIRTGPU_WAIT failed with %s\n", strerror(errno));
+
+		return ret;
+	}
+
+	// Android-EMU: a readback virtio_gpu_bo_invalidate_async() queued is only waited for
+	if (!virtio_gpu_readback_take(bo->drv, mapping)) {
+		ret = virtio_gpu_transfer_from_host(bo, mapping);
+		if (ret)
+			return ret;
+	}
+
+	// Android-EMU: the host's content must have arrived before the mapping is
+	// read, and it becomes the reference the next flush is compared against
+	memset(&waitcmd, 0, sizeof(waitcmd));
+	waitcmd.handle = mapping->vma->handle;
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_WAIT, &waitcmd);
+	if (ret) {
+		drv_log("DRM_IOCTL_VIRTGPU_WAIT failed with %s\n", strerror(errno));
+		return ret;
 	}
 
+	if (virtio_gpu_emulated_format(priv, bo->format))
+		return virtio_gpu_emulated_convert(bo, (struct virtio_gpu_emulation *)mapping->vma->priv,
+						   mapping->vma->addr, false);
+
 	/* Android-EMU: end of modification */
 
-	return drv_modify_linear_combinations(drv);
+	return 0;
 }
 
-static void virtio_gpu_close(struct driver *drv)
-{
-	free(drv->priv);
-	drv->priv = NULL;
-}
+/* Android-EMU: start of modification */
 
-static int virtio_gpu_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
-				uint64_t use_flags)
+/**
+ * Android-EMU:
+ * queue the readback of the mapped rectangle and return without waiting for
+ * it, so the host copies while the guest goes on; the next invalidate of the
+ * mapping waits for the readback instead of issuing one, and must precede
+ * any CPU access. fence_fd is a sync_file of the readback, or -1 if there is
+ * nothing to wait for or the kernel cannot export it.
+ */
+static int virtio_gpu_bo_invalidate_async(struct bo *bo, struct mapping *mapping, int *fence_fd)
 {
+	int ret;
 	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
-	if (priv->has_3d)
-		return virtio_virgl_bo_create(bo, width, height, format, use_flags);
-	else
-		return virtio_dumb_bo_create(bo, width, height, format, use_flags);
-}
 
-static int virtio_gpu_bo_destroy(struct bo *bo)
-{
-	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
-	if (priv->has_3d)
-		return drv_gem_bo_destroy(bo);
-	else
-		return drv_dumb_bo_destroy(bo);
-}
+	*fence_fd = -1;
 
-static void *virtio_gpu_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
-{
-	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
-	if (priv->has_3d)
-		return virtio_virgl_bo_map(bo, vma, plane, map_flags);
-	else
-		return drv_dumb_bo_map(bo, vma, plane, map_flags);
+	if (!priv->has_3d || !(bo->use_flags & VIRTIO_GPU_HOST_WRITE_MASK))
+		return 0;
+
+	// a host-visible buffer has nothing to read back, only the host's writes to wait for
+	if (!(bo->tiling & VIRTGPU_BLOB_FLAG_USE_MAPPABLE)) {
+		ret = virtio_gpu_transfer_from_host(bo, mapping);
+		if (ret)
+			return ret;
+
+		// without the record the next invalidate reads back again, which is still correct
+		virtio_gpu_readback_put(bo->drv, mapping);
+	}
+
+	*fence_fd = virtio_gpu_export_fence(bo, mapping->vma->handle);
+	return 0;
 }
 
-static int virtio_gpu_bo_invalidate(struct bo *bo, struct mapping *mapping)
+/* Android-EMU: end of modification */
+
+/* Android-EMU: start of modification */
+
+/**
+ * Android-EMU:
+ * read a rectangle of a buffer back from the host with one transfer and copy
+ * it into dst, converted and downscaled, through a mapping of our own that
+ * the map cache keeps for the next readback; emulated formats and planes of
+ * separate resources take the mapped path. The transfer lands in the guest
+ * backing of the buffer, so CPU writes to the rectangle must be flushed first.
+ */
+static int virtio_gpu_bo_readback(struct bo *bo, const struct rectangle *rect,
+				  const struct drv_image *dst)
 {
-	int ret;
-	struct drm_virtgpu_3d_transfer_from_host xfer;
 	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
+	struct drm_virtgpu_3d_wait waitcmd;
+	struct mapping mapping;
+	struct drv_image src;
+	struct vma vma;
+	size_t plane;
+	int ret = 0;
+
+	if (virtio_gpu_emulated_format(priv, bo->format))
+		return -ENOTSUP;
+
+	for (plane = 1; plane < bo->num_planes; plane++) {
+		if (bo->handles[plane].u32 != bo->handles[0].u32)
+			return -ENOTSUP;
+	}
 
-	if (!priv->has_3d)
-		return 0;
+	memset(&vma, 0, sizeof(vma));
+	vma.handle = bo->handles[0].u32;
+	vma.map_flags = BO_MAP_READ;
+	vma.addr = virtio_gpu_bo_map(bo, &vma, 0, BO_MAP_READ);
+	if (vma.addr == MAP_FAILED)
+		return -EFAULT;
+
+	// a host-visible buffer is the host's memory, it only has to wait for the host
+	if (priv->has_3d && (bo->use_flags & VIRTIO_GPU_HOST_WRITE_MASK)) {
+		if (!(bo->tiling & VIRTGPU_BLOB_FLAG_USE_MAPPABLE)) {
+			memset(&mapping, 0, sizeof(mapping));
+			mapping.vma = &vma;
+			mapping.rect = *rect;
+			ret = virtio_gpu_transfer_from_host(bo, &mapping);
+		}
 
-	memset(&xfer, 0, sizeof(xfer));
-	xfer.bo_handle = mapping->vma->handle;
-	xfer.box.x = mapping->rect.x;
-	xfer.box.y = mapping->rect.y;
-	xfer.box.w = mapping->rect.width;
-	xfer.box.h = mapping->rect.height;
-	xfer.box.d = 1;
+		if (!ret) {
+			memset(&waitcmd, 0, sizeof(waitcmd));
+			waitcmd.handle = vma.handle;
+			ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_WAIT, &waitcmd);
+			if (ret)
+				drv_log("DRM_IOCTL_VIRTGPU_WAIT failed with %s\n", strerror(errno));
+		}
+	}
 
-	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST, &xfer);
-	if (ret) {
-		drv_log("DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST failed with %s\n", strerror(errno));
-		return ret;
+	if (!ret) {
+		drv_image_init(&src, bo->format, bo->width, bo->height, vma.addr, bo->strides,
+			       bo->offsets);
+		ret = drv_image_crop(&src, rect);
+		if (!ret)
+			ret = drv_scale_image(&src, dst);
 	}
 
-	return 0;
+	if (!virtio_gpu_map_cache_put(bo, &vma))
+		drv_bo_munmap(bo, &vma);
+
+	return ret;
 }
 
+/* Android-EMU: end of modification */
+
 static int virtio_gpu_bo_flush(struct bo *bo, struct mapping *mapping)
 {
 	int ret;
 	struct drm_virtgpu_3d_transfer_to_host xfer;
 	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
 
+	/* Android-EMU: start of modification */
+
+	struct virtio_gpu_damage *damage;
+	struct virtio_gpu_emulation *emulation;
+
+	/* Android-EMU: end of modification */
+
 	if (!priv->has_3d)
 		return 0;
 
 	if (!(mapping->vma->map_flags & BO_MAP_WRITE))
 		return 0;
 
+	/* Android-EMU: start of modification */
+
+	// Android-EMU: the host already sees the writes to a host-visible buffer
+	if (bo->tiling & VIRTGPU_BLOB_FLAG_USE_MAPPABLE)
+		return 0;
+
+	// Android-EMU: convert the shadow of an emulated format into the host's format
+	if (virtio_gpu_emulated_format(priv, bo->format)) {
+		emulation = (struct virtio_gpu_emulation *)mapping->vma->priv;
+		ret = virtio_gpu_emulated_convert(bo, emulation, mapping->vma->addr, true);
+		if (ret)
+			return ret;
+
+		return virtio_gpu_emulated_transfer(bo, emulation,
+						    DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST);
+	}
+
+	// Android-EMU: write multi-planar buffers back plane by plane
+	if (bo->num_planes > 1)
+		return virtio_gpu_transfer_planes(bo, mapping, DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST);
+
+	// Android-EMU: transfer the rectangles of the write mappings, coalesced
+	damage = virtio_gpu_vma_damage(bo, mapping->vma);
+	if (damage)
+		return virtio_gpu_flush_damage(bo, mapping, damage);
+
+	/* Android-EMU: end of modification */
+
 	memset(&xfer, 0, sizeof(xfer));
 	xfer.bo_handle = mapping->vma->handle;
 	xfer.box.x = mapping->rect.x;
@@ -310,6 +2526,40 @@ static int virtio_gpu_bo_flush(struct bo *bo, struct mapping *mapping)
 	return 0;
 }
 
+/* Android-EMU: start of modification */
+
+/**
+ * Android-EMU:
+ * drop the damage record of a mapping along with it, and keep the mapping
+ * itself for the next map of the buffer
+ */
+static int virtio_gpu_bo_unmap(struct bo *bo, struct vma *vma)
+{
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
+
+	virtio_gpu_readback_drop(bo->drv, vma->handle);
+
+	// the shadow of an emulated format goes, with the host resource's mapping
+	if (virtio_gpu_emulated_format(priv, bo->format)) {
+		struct virtio_gpu_emulation *emulation = (struct virtio_gpu_emulation *)vma->priv;
+
+		munmap(emulation->addr, emulation->length);
+		free(emulation);
+		vma->priv = NULL;
+		return drv_bo_munmap(bo, vma);
+	}
+
+	free(vma->priv);
+	vma->priv = NULL;
+
+	if (virtio_gpu_map_cache_put(bo, vma))
+		return 0;
+
+	return drv_bo_munmap(bo, vma);
+}
+
+/* Android-EMU: end of modification */
+
 static uint32_t virtio_gpu_resolve_format(uint32_t format, uint64_t use_flags)
 {
 	switch (format) {
@@ -332,7 +2582,7 @@ static uint32_t virtio_gpu_resolve_format(uint32_t format, uint64_t use_flags)
 static bool virtio_gpu_supports_format(struct virgl_supported_format_mask *supported,
 				       uint32_t drm_format)
 {
-	return translate_format(drm_format) && (supported->bitmask[virgl_format / 32] & (1 << virgl_format % 32));
+	return virtio_gpu_caps_has_format(supported, translate_format(drm_format, 0));
 }
 
 /**
@@ -354,8 +2604,14 @@ static void virtio_gpu_add_combination(struct driver *drv, uint32_t drm_format,
 
 		if ((use_flags & BO_USE_TEXTURE) != 0 &&
 			!virtio_gpu_supports_format(&priv->caps.v1.sampler, drm_format)) {
-			drv_log("Skipping unsupported texture format: %d\n", drm_format);
-			return;
+			// convert what the host lacks from/to a format it has
+			if (!virtio_gpu_emulated_format(priv, drm_format)) {
+				drv_log("Skipping unsupported texture format: %d\n", drm_format);
+				return;
+			}
+
+			drv_log("Emulating texture format %d with format %d\n", drm_format,
+				virtio_gpu_emulated_format(priv, drm_format));
 		}
 	}
 
@@ -428,16 +2684,133 @@ static int virtio_gpu_get_caps(struct driver *drv, union virgl_caps *caps)
 
 /* Android-EMU: end of modification */
 
+/* Android-EMU: start of modification */
+
+/**
+ * Android-EMU:
+ * the size of the part of a buffer a mapping covers, for the trace
+ */
+static uint64_t virtio_gpu_trace_bytes(struct bo *bo, const struct rectangle *rect)
+{
+	if (!bo->width || !bo->height)
+		return 0;
+
+	return (uint64_t)bo->total_size * rect->width / bo->width * rect->height / bo->height;
+}
+
+static int virtio_gpu_trace_bo_create(struct bo *bo, uint32_t width, uint32_t height,
+				      uint32_t format, uint64_t use_flags)
+{
+	uint64_t start = drv_trace_begin();
+	int ret = virtio_gpu_bo_create(bo, width, height, format, use_flags);
+
+	drv_trace_end(start, DRV_TRACE_BO_CREATE, bo, width, height, bo->total_size, ret);
+	return ret;
+}
+
+static int virtio_gpu_trace_bo_create_array(struct bo **bos, uint32_t count, uint32_t width,
+					    uint32_t height, uint32_t format, uint64_t use_flags)
+{
+	uint64_t start = drv_trace_begin();
+	int ret = virtio_gpu_bo_create_array(bos, count, width, height, format, use_flags);
+
+	drv_trace_end(start, DRV_TRACE_BO_CREATE_ARRAY, bos[0], width, height,
+		      ret ? 0 : (uint64_t)bos[0]->total_size * count, ret);
+	return ret;
+}
+
+static int virtio_gpu_trace_bo_create_with_modifiers(struct bo *bo, uint32_t width,
+						     uint32_t height, uint32_t format,
+						     const uint64_t *modifiers, uint32_t count)
+{
+	uint64_t start = drv_trace_begin();
+	int ret = virtio_gpu_bo_create_with_modifiers(bo, width, height, format, modifiers, count);
+
+	drv_trace_end(start, DRV_TRACE_BO_CREATE, bo, width, height, bo->total_size, ret);
+	return ret;
+}
+
+static int virtio_gpu_trace_bo_destroy(struct bo *bo)
+{
+	uint64_t start = drv_trace_begin();
+	int ret = virtio_gpu_bo_destroy(bo);
+
+	drv_trace_end(start, DRV_TRACE_BO_DESTROY, bo, bo->width, bo->height, bo->total_size, ret);
+	return ret;
+}
+
+static void *virtio_gpu_trace_bo_map(struct bo *bo, struct vma *vma, size_t plane,
+				     uint32_t map_flags)
+{
+	uint64_t start = drv_trace_begin();
+	void *addr = virtio_gpu_bo_map(bo, vma, plane, map_flags);
+
+	drv_trace_end(start, DRV_TRACE_BO_MAP, bo, bo->width, bo->height,
+		      addr == MAP_FAILED ? 0 : vma->length, addr == MAP_FAILED ? -EINVAL : 0);
+	return addr;
+}
+
+static int virtio_gpu_trace_bo_invalidate(struct bo *bo, struct mapping *mapping)
+{
+	uint64_t start = drv_trace_begin();
+	int ret = virtio_gpu_bo_invalidate(bo, mapping);
+
+	drv_trace_end(start, DRV_TRACE_BO_INVALIDATE, bo, mapping->rect.width,
+		      mapping->rect.height, virtio_gpu_trace_bytes(bo, &mapping->rect), ret);
+	return ret;
+}
+
+static int virtio_gpu_trace_bo_invalidate_async(struct bo *bo, struct mapping *mapping,
+						 int *fence_fd)
+{
+	uint64_t start = drv_trace_begin();
+	int ret = virtio_gpu_bo_invalidate_async(bo, mapping, fence_fd);
+
+	drv_trace_end(start, DRV_TRACE_BO_INVALIDATE, bo, mapping->rect.width, mapping->rect.height,
+		      virtio_gpu_trace_bytes(bo, &mapping->rect), ret);
+	return ret;
+}
+
+static int virtio_gpu_trace_bo_readback(struct bo *bo, const struct rectangle *rect,
+					const struct drv_image *dst)
+{
+	uint64_t start = drv_trace_begin();
+	int ret = virtio_gpu_bo_readback(bo, rect, dst);
+
+	drv_trace_end(start, DRV_TRACE_BO_READBACK, bo, rect->width, rect->height,
+		      virtio_gpu_trace_bytes(bo, rect), ret);
+	return ret;
+}
+
+static int virtio_gpu_trace_bo_flush(struct bo *bo, struct mapping *mapping)
+{
+	uint64_t start = drv_trace_begin();
+	int ret = virtio_gpu_bo_flush(bo, mapping);
+
+	drv_trace_end(start, DRV_TRACE_BO_FLUSH, bo, mapping->rect.width, mapping->rect.height,
+		      virtio_gpu_trace_bytes(bo, &mapping->rect), ret);
+	return ret;
+}
+
+/* Android-EMU: end of modification */
+
 const struct backend backend_virtio_gpu = {
 	.name = "virtio_gpu",
 	.init = virtio_gpu_init,
 	.close = virtio_gpu_close,
-	.bo_create = virtio_gpu_bo_create,
-	.bo_destroy = virtio_gpu_bo_destroy,
+	/* Android-EMU: start of modification */
+	// Android-EMU: the entry points are timed into the trace
+	.bo_create = virtio_gpu_trace_bo_create,
+	.bo_create_array = virtio_gpu_trace_bo_create_array,
+	.bo_create_with_modifiers = virtio_gpu_trace_bo_create_with_modifiers,
+	.bo_destroy = virtio_gpu_trace_bo_destroy,
 	.bo_import = drv_prime_bo_import,
-	.bo_map = virtio_gpu_bo_map,
-	.bo_unmap = drv_bo_munmap,
-	.bo_invalidate = virtio_gpu_bo_invalidate,
-	.bo_flush = virtio_gpu_bo_flush,
+	.bo_map = virtio_gpu_trace_bo_map,
+	.bo_unmap = virtio_gpu_bo_unmap,
+	.bo_invalidate = virtio_gpu_trace_bo_invalidate,
+	.bo_invalidate_async = virtio_gpu_trace_bo_invalidate_async,
+	.bo_readback = virtio_gpu_trace_bo_readback,
+	.bo_flush = virtio_gpu_trace_bo_flush,
+	/* Android-EMU: end of modification */
 	.resolve_format = virtio_gpu_resolve_format,
 };
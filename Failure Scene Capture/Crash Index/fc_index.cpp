@@ -0,0 +1,850 @@
+// Host-side columnar index over the crash bundles written by xcd_process_record().
+//
+// On-disk layout of a store directory:
+//   manifest      text header: version, row count, block size and column list
+//   <col>.data    one little-endian 32-bit value per row (int value or dictionary code)
+//   <col>.zone    per-block min/max pairs of the values in <col>.data
+//   <col>.dict    string columns only: sorted dictionary, so codes preserve string order
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include "fc_index.h"
+
+namespace fc
+{
+
+#define FC_INDEX_VERSION 1
+
+const fc_column_desc_t fc_index_schema[] =
+{
+    {"signal",       FC_COLUMN_INT},
+    {"signal_code",  FC_COLUMN_INT},
+    {"api_level",    FC_COLUMN_INT},
+    {"thread_count", FC_COLUMN_INT},
+    {"crash_type",   FC_COLUMN_STR},
+    {"os_version",   FC_COLUMN_STR},
+    {"manufacturer", FC_COLUMN_STR},
+    {"brand",        FC_COLUMN_STR},
+    {"model",        FC_COLUMN_STR},
+    {"abi",          FC_COLUMN_STR},
+    {"process_name", FC_COLUMN_STR},
+    {"fault_module", FC_COLUMN_STR},
+    {"frame_0",      FC_COLUMN_STR},
+    {"frame_1",      FC_COLUMN_STR},
+    {"frame_2",      FC_COLUMN_STR},
+};
+const size_t fc_index_schema_size = sizeof(fc_index_schema) / sizeof(fc_index_schema[0]);
+
+// positions inside fc_bundle_record_t::ints / ::strs
+enum
+{
+    FC_INT_SIGNAL = 0,
+    FC_INT_SIGNAL_CODE,
+    FC_INT_API_LEVEL,
+    FC_INT_THREAD_COUNT,
+    FC_INT_NUM
+};
+
+enum
+{
+    FC_STR_CRASH_TYPE = 0,
+    FC_STR_OS_VERSION,
+    FC_STR_MANUFACTURER,
+    FC_STR_BRAND,
+    FC_STR_MODEL,
+    FC_STR_ABI,
+    FC_STR_PROCESS_NAME,
+    FC_STR_FAULT_MODULE,
+    FC_STR_FRAME_0,
+    FC_STR_NUM = FC_STR_FRAME_0 + FC_INDEX_TOP_FRAMES
+};
+
+//
+// bundle parsing
+//
+
+static int fc_parse_int(std::string_view s, int32_t *v)
+{
+    char buf[32];
+    char *end;
+    long  l;
+
+    if(s.empty() || s.size() >= sizeof(buf)) return -1;
+    memcpy(buf, s.data(), s.size());
+    buf[s.size()] = '\0';
+
+    errno = 0;
+    l = strtol(buf, &end, 10);
+    if(0 != errno || end == buf) return -1;
+    *v = (int32_t)l;
+    return 0;
+}
+
+static int fc_starts_with(std::string_view s, const char *prefix)
+{
+    size_t n = strlen(prefix);
+    return s.size() >= n && 0 == memcmp(s.data(), prefix, n);
+}
+
+// "Key: 'value'" header lines written by xcc_util_get_dump_header()
+static int fc_parse_quoted(std::string_view line, const char *key, std::string *out)
+{
+    if(!fc_starts_with(line, key)) return 0;
+    line.remove_prefix(strlen(key));
+    if(line.size() < 2 || '\'' != line.front() || '\'' != line.back()) return 0;
+    out->assign(line.data() + 1, line.size() - 2);
+    return 1;
+}
+
+// "    #00 pc 000000000001e6c4  /system/lib64/libc.so (abort+120) (BuildId: ...)"
+static void fc_parse_frame(std::string_view line, std::string *module, std::string *frame)
+{
+    size_t pos;
+
+    if(std::string_view::npos == (pos = line.find(" pc "))) return;
+    line.remove_prefix(pos + 4);
+    if(std::string_view::npos == (pos = line.find(' '))) return;
+    line.remove_prefix(pos);
+    while(!line.empty() && ' ' == line.front()) line.remove_prefix(1);
+
+    //module path ends at the first " (" (symbol or build id) or the end of line
+    pos = line.find(" (");
+    *module = std::string(line.substr(0, pos));
+    *frame = *module;
+    if(std::string_view::npos == pos) return;
+
+    //keep the symbol but drop the "+offset" so equal frames share a dictionary entry
+    line.remove_prefix(pos + 2);
+    if(fc_starts_with(line, "BuildId:")) return;
+    size_t end = line.find_first_of("+)");
+    if(std::string_view::npos == end) return;
+    frame->append(" (");
+    frame->append(line.substr(0, end));
+    frame->append(")");
+}
+
+int fc_bundle_parse(const char *buf, size_t len, fc_bundle_record_t *rec)
+{
+    std::string_view text(buf, len);
+    size_t           pos = 0;
+    size_t           nframes = 0;
+    int              in_backtrace = 0;
+    int              got_signal = 0;
+    int32_t          v;
+
+    rec->ints.assign(FC_INT_NUM, 0);
+    rec->strs.assign(FC_STR_NUM, std::string());
+
+    while(pos < len)
+    {
+        size_t eol = text.find('\n', pos);
+        if(std::string_view::npos == eol) eol = len;
+        std::string_view line = text.substr(pos, eol - pos);
+        pos = eol + 1;
+        if(!line.empty() && '\r' == line.back()) line.remove_suffix(1);
+
+        if(in_backtrace)
+        {
+            if(fc_starts_with(line, "    #"))
+            {
+                if(nframes < FC_INDEX_TOP_FRAMES)
+                {
+                    std::string module;
+                    fc_parse_frame(line, &module, &(rec->strs[FC_STR_FRAME_0 + nframes]));
+                    if(0 == nframes) rec->strs[FC_STR_FAULT_MODULE] = module;
+                }
+                nframes++;
+                continue;
+            }
+            in_backtrace = 0;
+        }
+
+        //the crashed thread's backtrace comes first; other threads are not indexed
+        if(0 == nframes && line == "backtrace:")
+        {
+            in_backtrace = 1;
+            continue;
+        }
+
+        if(fc_parse_quoted(line, "Crash type: ", &(rec->strs[FC_STR_CRASH_TYPE]))) continue;
+        if(fc_parse_quoted(line, "OS version: ", &(rec->strs[FC_STR_OS_VERSION]))) continue;
+        if(fc_parse_quoted(line, "Manufacturer: ", &(rec->strs[FC_STR_MANUFACTURER]))) continue;
+        if(fc_parse_quoted(line, "Brand: ", &(rec->strs[FC_STR_BRAND]))) continue;
+        if(fc_parse_quoted(line, "Model: ", &(rec->strs[FC_STR_MODEL]))) continue;
+        if(fc_parse_quoted(line, "ABI: ", &(rec->strs[FC_STR_ABI]))) continue;
+        if(fc_starts_with(line, "API level: "))
+        {
+            std::string s;
+            if(fc_parse_quoted(line, "API level: ", &s) && 0 == fc_parse_int(s, &v))
+                rec->ints[FC_INT_API_LEVEL] = v;
+            continue;
+        }
+
+        //"pid: %d, tid: %d, name: %s  >>> %s <<<"
+        if(fc_starts_with(line, "pid: ") && rec->strs[FC_STR_PROCESS_NAME].empty())
+        {
+            size_t b = line.find(">>> ");
+            size_t e = line.rfind(" <<<");
+            if(std::string_view::npos != b && std::string_view::npos != e && e > b + 4)
+                rec->strs[FC_STR_PROCESS_NAME] = std::string(line.substr(b + 4, e - b - 4));
+            continue;
+        }
+
+        //"signal %d (%s), code %d (%s%s), fault addr %s"
+        if(!got_signal && fc_starts_with(line, "signal "))
+        {
+            std::string_view s = line.substr(7);
+            if(0 == fc_parse_int(s.substr(0, s.find(' ')), &v)) rec->ints[FC_INT_SIGNAL] = v;
+            size_t c = s.find("code ");
+            if(std::string_view::npos != c)
+            {
+                s.remove_prefix(c + 5);
+                if(0 == fc_parse_int(s.substr(0, s.find(' ')), &v)) rec->ints[FC_INT_SIGNAL_CODE] = v;
+            }
+            got_signal = 1;
+            continue;
+        }
+
+        //"total threads (exclude the crashed thread): %zu"
+        if(fc_starts_with(line, "total threads (exclude the crashed thread): "))
+        {
+            if(0 == fc_parse_int(line.substr(44), &v)) rec->ints[FC_INT_THREAD_COUNT] = v + 1;
+            continue;
+        }
+    }
+
+    //a bundle without any of the execution context is not worth indexing
+    if(!got_signal && rec->strs[FC_STR_CRASH_TYPE].empty()) return -1;
+    return 0;
+}
+
+//
+// read-only file mapping
+//
+
+class fc_mapped_file
+{
+public:
+    fc_mapped_file() : addr_(NULL), size_(0) {}
+    ~fc_mapped_file() { this->close(); }
+    fc_mapped_file(const fc_mapped_file &) = delete;
+    fc_mapped_file &operator=(const fc_mapped_file &) = delete;
+
+    int open(const std::string &path)
+    {
+        struct stat st;
+        int         fd;
+
+        if(0 > (fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC))) return -1;
+        if(0 != fstat(fd, &st))
+        {
+            ::close(fd);
+            return -1;
+        }
+        size_ = (size_t)st.st_size;
+        if(size_ > 0)
+        {
+            addr_ = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(MAP_FAILED == addr_)
+            {
+                addr_ = NULL;
+                size_ = 0;
+                ::close(fd);
+                return -1;
+            }
+        }
+        ::close(fd);
+        return 0;
+    }
+
+    void close()
+    {
+        if(NULL != addr_) munmap(addr_, size_);
+        addr_ = NULL;
+        size_ = 0;
+    }
+
+    const uint8_t *data() const { return (const uint8_t *)addr_; }
+    size_t size() const { return size_; }
+
+private:
+    void   *addr_;
+    size_t  size_;
+};
+
+int fc_bundle_parse_file(const char *path, fc_bundle_record_t *rec)
+{
+    fc_mapped_file f;
+
+    if(0 != f.open(path)) return -1;
+    return fc_bundle_parse((const char *)f.data(), f.size(), rec);
+}
+
+//
+// store reading
+//
+
+typedef struct fc_store_column
+{
+    fc_column_type            type;
+    fc_mapped_file            data;
+    fc_mapped_file            zone;
+    std::vector<std::string>  dict;
+} fc_store_column_t;
+
+typedef struct fc_store
+{
+    size_t                                          nrows;
+    size_t                                          block_rows;
+    std::vector<std::unique_ptr<fc_store_column_t>> cols;
+    std::unordered_map<std::string, size_t>         by_name;
+} fc_store_t;
+
+static std::string fc_store_path(const char *dir, const char *name, const char *suffix)
+{
+    std::string p(dir);
+    p += "/";
+    p += name;
+    p += suffix;
+    return p;
+}
+
+static int fc_store_load_dict(const std::string &path, std::vector<std::string> *dict)
+{
+    fc_mapped_file f;
+    const uint8_t *p, *end;
+    uint32_t       n, len, i;
+
+    if(0 != f.open(path)) return -1;
+    p = f.data();
+    end = p + f.size();
+    if(end - p < 4) return -1;
+    memcpy(&n, p, 4);
+    p += 4;
+    dict->clear();
+    dict->reserve(n);
+    for(i = 0; i < n; i++)
+    {
+        if(end - p < 4) return -1;
+        memcpy(&len, p, 4);
+        p += 4;
+        if((size_t)(end - p) < len) return -1;
+        dict->emplace_back((const char *)p, len);
+        p += len;
+    }
+    return 0;
+}
+
+static int fc_store_open(const char *dir, fc_store_t *st)
+{
+    std::ifstream in(fc_store_path(dir, "manifest", ""));
+    std::string   magic, key, name, type;
+    int           version;
+    size_t        i;
+
+    if(!in) return -1;
+    if(!(in >> magic >> version) || magic != "fc_index" || FC_INDEX_VERSION != version) return -1;
+    if(!(in >> key >> st->nrows) || key != "rows") return -1;
+    if(!(in >> key >> st->block_rows) || key != "block_rows" || 0 == st->block_rows) return -1;
+
+    while(in >> key >> name >> type)
+    {
+        if(key != "column") return -1;
+
+        std::unique_ptr<fc_store_column_t> col(new fc_store_column_t);
+        col->type = (type == "str" ? FC_COLUMN_STR : FC_COLUMN_INT);
+        if(0 != col->data.open(fc_store_path(dir, name.c_str(), ".data"))) return -1;
+        if(0 != col->zone.open(fc_store_path(dir, name.c_str(), ".zone"))) return -1;
+        if(col->data.size() != st->nrows * 4) return -1;
+        if(FC_COLUMN_STR == col->type &&
+           0 != fc_store_load_dict(fc_store_path(dir, name.c_str(), ".dict"), &(col->dict))) return -1;
+
+        st->by_name[name] = st->cols.size();
+        st->cols.push_back(std::move(col));
+    }
+
+    //the schema is fixed; refuse stores written by a different column list
+    if(st->cols.size() != fc_index_schema_size) return -1;
+    for(i = 0; i < fc_index_schema_size; i++)
+        if(st->by_name.find(fc_index_schema[i].name) == st->by_name.end()) return -1;
+
+    return 0;
+}
+
+static int32_t fc_store_value(const fc_store_column_t *col, size_t row)
+{
+    int32_t v;
+    memcpy(&v, col->data.data() + row * 4, 4);
+    return v;
+}
+
+//
+// ingest
+//
+
+static int fc_collect_paths(const std::vector<std::string> &inputs, std::vector<std::string> *files)
+{
+    std::error_code ec;
+
+    for(const std::string &in : inputs)
+    {
+        if(std::filesystem::is_directory(in, ec))
+        {
+            std::filesystem::recursive_directory_iterator it(in, ec), end;
+            if(ec) return -1;
+            for(; it != end; it.increment(ec))
+            {
+                if(ec) return -1;
+                if(it->is_regular_file(ec)) files->push_back(it->path().string());
+            }
+        }
+        else
+        {
+            files->push_back(in);
+        }
+    }
+    return 0;
+}
+
+static int fc_write_file(const std::string &path, const void *buf, size_t len)
+{
+    FILE *fp;
+
+    if(NULL == (fp = fopen(path.c_str(), "wb"))) return -1;
+    if(len > 0 && 1 != fwrite(buf, len, 1, fp))
+    {
+        fclose(fp);
+        return -1;
+    }
+    return 0 == fclose(fp) ? 0 : -1;
+}
+
+// writes <path>.tmp and records path in staged; fc_commit_staged() renames it into place
+static int fc_write_staged(const std::string &path, const void *buf, size_t len,
+                           std::vector<std::string> *staged)
+{
+    staged->push_back(path);
+    return fc_write_file(path + ".tmp", buf, len);
+}
+
+static void fc_discard_staged(const std::vector<std::string> &staged)
+{
+    for(const std::string &path : staged) unlink((path + ".tmp").c_str());
+}
+
+//the old manifest goes first, so a store with some files renamed and others not is never opened
+static int fc_commit_staged(const char *dir, const std::vector<std::string> &staged)
+{
+    if(0 != unlink(fc_store_path(dir, "manifest", "").c_str()) && ENOENT != errno) return -1;
+    for(const std::string &path : staged)
+        if(0 != rename((path + ".tmp").c_str(), path.c_str())) return -1;
+    return 0;
+}
+
+static int fc_write_column(const char *dir, const char *name, const std::vector<int32_t> &vals,
+                           size_t block_rows, std::vector<std::string> *staged)
+{
+    std::vector<int32_t> zone;
+    size_t               b, i;
+
+    for(b = 0; b < vals.size(); b += block_rows)
+    {
+        size_t  e = std::min(vals.size(), b + block_rows);
+        int32_t lo = vals[b], hi = vals[b];
+        for(i = b + 1; i < e; i++)
+        {
+            lo = std::min(lo, vals[i]);
+            hi = std::max(hi, vals[i]);
+        }
+        zone.push_back(lo);
+        zone.push_back(hi);
+    }
+
+    if(0 != fc_write_staged(fc_store_path(dir, name, ".data"), vals.data(), vals.size() * 4, staged)) return -1;
+    return fc_write_staged(fc_store_path(dir, name, ".zone"), zone.data(), zone.size() * 4, staged);
+}
+
+static int fc_write_dict(const char *dir, const char *name, const std::vector<std::string> &dict,
+                         std::vector<std::string> *staged)
+{
+    std::string buf;
+    uint32_t    n = (uint32_t)dict.size();
+
+    buf.append((const char *)&n, 4);
+    for(const std::string &s : dict)
+    {
+        uint32_t len = (uint32_t)s.size();
+        buf.append((const char *)&len, 4);
+        buf.append(s);
+    }
+    return fc_write_staged(fc_store_path(dir, name, ".dict"), buf.data(), buf.size(), staged);
+}
+
+static int fc_load_existing(const char *dir, std::vector<fc_bundle_record_t> *recs)
+{
+    fc_store_t st;
+    size_t     r, c, ni, ns;
+
+    if(0 != fc_store_open(dir, &st)) return -1;
+
+    recs->reserve(recs->size() + st.nrows);
+    for(r = 0; r < st.nrows; r++)
+    {
+        fc_bundle_record_t rec;
+        rec.ints.resize(FC_INT_NUM);
+        rec.strs.resize(FC_STR_NUM);
+        for(c = 0, ni = 0, ns = 0; c < fc_index_schema_size; c++)
+        {
+            const fc_store_column_t *col = st.cols[st.by_name[fc_index_schema[c].name]].get();
+            int32_t v = fc_store_value(col, r);
+            if(FC_COLUMN_INT == fc_index_schema[c].type)
+                rec.ints[ni++] = v;
+            else
+                rec.strs[ns++] = ((uint32_t)v < col->dict.size() ? col->dict[(uint32_t)v] : std::string());
+        }
+        recs->push_back(std::move(rec));
+    }
+    return 0;
+}
+
+int fc_index_ingest(const char *store_dir, const std::vector<std::string> &paths,
+                    unsigned int nthreads, int append, size_t *nrows)
+{
+    std::vector<std::string>                     files;
+    std::vector<fc_bundle_record_t>              recs;
+    std::vector<std::vector<fc_bundle_record_t>> parts;
+    std::vector<std::thread>                     workers;
+    std::vector<std::string>                     staged;
+    std::atomic<size_t>                          next(0);
+    std::error_code                              ec;
+    size_t                                       c, r, ni, ns;
+    unsigned int                                 t;
+
+    if(0 != fc_collect_paths(paths, &files)) return -1;
+
+    //appending re-encodes every row: a new string shifts the codes of all the strings after it
+    if(append && std::filesystem::exists(fc_store_path(store_dir, "manifest", ""), ec))
+        if(0 != fc_load_existing(store_dir, &recs)) return -1;
+
+    //parse in parallel; bundles are independent and parsing dominates the ingest
+    if(0 == nthreads) nthreads = std::max(1u, std::thread::hardware_concurrency());
+    parts.resize(nthreads);
+    for(t = 0; t < nthreads; t++)
+    {
+        workers.emplace_back([&, t]()
+        {
+            size_t i;
+            while((i = next.fetch_add(1)) < files.size())
+            {
+                fc_bundle_record_t rec;
+                if(0 == fc_bundle_parse_file(files[i].c_str(), &rec))
+                    parts[t].push_back(std::move(rec));
+            }
+        });
+    }
+    for(std::thread &w : workers) w.join();
+    for(std::vector<fc_bundle_record_t> &p : parts)
+        for(fc_bundle_record_t &rec : p)
+            recs.push_back(std::move(rec));
+
+    std::filesystem::create_directories(store_dir, ec);
+    if(ec) return -1;
+
+    std::ostringstream manifest;
+    manifest << "fc_index " << FC_INDEX_VERSION << "\n";
+    manifest << "rows " << recs.size() << "\n";
+    manifest << "block_rows " << FC_INDEX_BLOCK_ROWS << "\n";
+
+    for(c = 0, ni = 0, ns = 0; c < fc_index_schema_size; c++)
+    {
+        const char           *name = fc_index_schema[c].name;
+        std::vector<int32_t>  vals(recs.size());
+
+        if(FC_COLUMN_INT == fc_index_schema[c].type)
+        {
+            for(r = 0; r < recs.size(); r++) vals[r] = recs[r].ints[ni];
+            ni++;
+            manifest << "column " << name << " int\n";
+        }
+        else
+        {
+            //sorted dictionary: codes keep string order so range predicates work on codes
+            std::vector<std::string> dict;
+            for(r = 0; r < recs.size(); r++) dict.push_back(recs[r].strs[ns]);
+            std::sort(dict.begin(), dict.end());
+            dict.erase(std::unique(dict.begin(), dict.end()), dict.end());
+            for(r = 0; r < recs.size(); r++)
+                vals[r] = (int32_t)(std::lower_bound(dict.begin(), dict.end(), recs[r].strs[ns]) - dict.begin());
+            if(0 != fc_write_dict(store_dir, name, dict, &staged))
+            {
+                fc_discard_staged(staged);
+                return -1;
+            }
+            ns++;
+            manifest << "column " << name << " str\n";
+        }
+
+        if(0 != fc_write_column(store_dir, name, vals, FC_INDEX_BLOCK_ROWS, &staged))
+        {
+            fc_discard_staged(staged);
+            return -1;
+        }
+    }
+
+    //every file is written aside first, so an interruption up to here keeps the old store intact
+    std::string m = manifest.str();
+    std::string mpath = fc_store_path(store_dir, "manifest", "");
+    if(0 != fc_write_file(mpath + ".tmp", m.data(), m.size()))
+    {
+        unlink((mpath + ".tmp").c_str());
+        fc_discard_staged(staged);
+        return -1;
+    }
+
+    //the manifest goes last so a half-renamed store is never opened
+    if(0 != fc_commit_staged(store_dir, staged) || 0 != rename((mpath + ".tmp").c_str(), mpath.c_str()))
+        return -1;
+
+    if(NULL != nrows) *nrows = recs.size();
+    return 0;
+}
+
+//
+// query
+//
+
+int fc_predicate_parse(const char *expr, fc_predicate_t *pred)
+{
+    static const struct { const char *s; fc_pred_op op; } ops[] =
+    {
+        {"!=", FC_PRED_NE}, {"<=", FC_PRED_LE}, {">=", FC_PRED_GE},
+        {"=",  FC_PRED_EQ}, {"<",  FC_PRED_LT}, {">",  FC_PRED_GT},
+    };
+    const char *p;
+    size_t      i;
+
+    for(p = expr; *p; p++)
+    {
+        for(i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+        {
+            size_t n = strlen(ops[i].s);
+            if(0 == strncmp(p, ops[i].s, n))
+            {
+                if(p == expr) return -1;
+                pred->column.assign(expr, (size_t)(p - expr));
+                pred->op = ops[i].op;
+                pred->value = p + n;
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+// a predicate lowered onto the 32-bit column values: value in [lo, hi], or not in it when negate
+typedef struct fc_range
+{
+    const fc_store_column_t *col;
+    int64_t                  lo;
+    int64_t                  hi;
+    int                      negate;
+} fc_range_t;
+
+static int fc_lower_predicate(const fc_store_t &st, const fc_predicate_t &p, fc_range_t *r)
+{
+    auto it = st.by_name.find(p.column);
+    if(it == st.by_name.end()) return -1;
+    r->col = st.cols[it->second].get();
+    r->lo = 1;
+    r->hi = 0;
+    r->negate = 0;
+
+    int64_t lb, ub; //[lb, ub) is the set of values equal to p.value
+    if(FC_COLUMN_INT == r->col->type)
+    {
+        int32_t v;
+        if(0 != fc_parse_int(p.value, &v)) return -1;
+        lb = v;
+        ub = (int64_t)v + 1;
+    }
+    else
+    {
+        const std::vector<std::string> &d = r->col->dict;
+        lb = std::lower_bound(d.begin(), d.end(), p.value) - d.begin();
+        ub = std::upper_bound(d.begin(), d.end(), p.value) - d.begin();
+    }
+
+    switch(p.op)
+    {
+    case FC_PRED_EQ: r->lo = lb;        r->hi = ub - 1;    break;
+    case FC_PRED_NE: r->lo = lb;        r->hi = ub - 1;    r->negate = 1; break;
+    case FC_PRED_LT: r->lo = INT64_MIN; r->hi = lb - 1;    break;
+    case FC_PRED_LE: r->lo = INT64_MIN; r->hi = ub - 1;    break;
+    case FC_PRED_GT: r->lo = ub;        r->hi = INT64_MAX; break;
+    case FC_PRED_GE: r->lo = lb;        r->hi = INT64_MAX; break;
+    }
+    return 0;
+}
+
+static int fc_range_may_match(const fc_range_t &r, int32_t zmin, int32_t zmax)
+{
+    if(r.negate) return !(zmin == zmax && r.lo <= zmin && zmax <= r.hi);
+    return !(zmax < r.lo || zmin > r.hi);
+}
+
+typedef std::unordered_map<std::string, uint64_t> fc_group_map_t;
+
+int fc_index_query(const char *store_dir, const fc_query_t &q,
+                   std::vector<fc_query_row_t> *rows, fc_query_stats_t *stats)
+{
+    fc_store_t                              st;
+    std::vector<fc_range_t>                 ranges;
+    std::vector<const fc_store_column_t *>  groups;
+    size_t                                  nblocks, i;
+    unsigned int                            nthreads, t;
+
+    if(0 != fc_store_open(store_dir, &st)) return -1;
+
+    for(const fc_predicate_t &p : q.where)
+    {
+        fc_range_t r;
+        if(0 != fc_lower_predicate(st, p, &r)) return -1;
+        ranges.push_back(r);
+    }
+    for(const std::string &g : q.group_by)
+    {
+        auto it = st.by_name.find(g);
+        if(it == st.by_name.end()) return -1;
+        groups.push_back(st.cols[it->second].get());
+    }
+
+    nblocks = (st.nrows + st.block_rows - 1) / st.block_rows;
+    nthreads = std::max(1u, std::min((unsigned int)nblocks, std::thread::hardware_concurrency()));
+
+    std::vector<fc_group_map_t>  maps(nthreads);
+    std::vector<size_t>          matched(nthreads, 0), skipped(nthreads, 0);
+    std::vector<std::thread>     workers;
+    std::atomic<size_t>          next(0);
+
+    for(t = 0; t < nthreads; t++)
+    {
+        workers.emplace_back([&, t]()
+        {
+            std::vector<uint8_t> sel(st.block_rows);
+            std::string          key;
+            size_t               b;
+
+            while((b = next.fetch_add(1)) < nblocks)
+            {
+                size_t first = b * st.block_rows;
+                size_t n = std::min(st.block_rows, st.nrows - first);
+                size_t r;
+                int    skip = 0;
+
+                //zone maps: drop the whole block when any predicate cannot hold
+                for(const fc_range_t &rg : ranges)
+                {
+                    int32_t z[2];
+                    memcpy(z, rg.col->zone.data() + b * 8, 8);
+                    if(!fc_range_may_match(rg, z[0], z[1])) { skip = 1; break; }
+                }
+                if(skip)
+                {
+                    skipped[t]++;
+                    continue;
+                }
+
+                //predicate-at-a-time over contiguous values keeps the loops vectorizable
+                memset(sel.data(), 1, n);
+                for(const fc_range_t &rg : ranges)
+                {
+                    const int32_t *v = (const int32_t *)(rg.col->data.data()) + first;
+                    for(r = 0; r < n; r++)
+                    {
+                        uint8_t in = (uint8_t)(v[r] >= rg.lo && v[r] <= rg.hi);
+                        sel[r] &= (uint8_t)(in ^ (uint8_t)rg.negate);
+                    }
+                }
+
+                for(r = 0; r < n; r++)
+                {
+                    if(!sel[r]) continue;
+                    matched[t]++;
+                    if(groups.empty()) continue;
+                    key.clear();
+                    for(const fc_store_column_t *g : groups)
+                    {
+                        int32_t v = fc_store_value(g, first + r);
+                        key.append((const char *)&v, 4);
+                    }
+                    maps[t][key]++;
+                }
+            }
+        });
+    }
+    for(std::thread &w : workers) w.join();
+
+    fc_group_map_t merged;
+    size_t         total_matched = 0, total_skipped = 0;
+    for(t = 0; t < nthreads; t++)
+    {
+        total_matched += matched[t];
+        total_skipped += skipped[t];
+        for(auto &kv : maps[t]) merged[kv.first] += kv.second;
+    }
+
+    rows->clear();
+    if(groups.empty())
+    {
+        rows->push_back(fc_query_row_t{std::vector<std::string>(), (uint64_t)total_matched});
+    }
+    else
+    {
+        for(auto &kv : merged)
+        {
+            fc_query_row_t row;
+            row.count = kv.second;
+            for(i = 0; i < groups.size(); i++)
+            {
+                int32_t v;
+                memcpy(&v, kv.first.data() + i * 4, 4);
+                if(FC_COLUMN_STR == groups[i]->type)
+                    row.keys.push_back((uint32_t)v < groups[i]->dict.size() ? groups[i]->dict[(uint32_t)v] : std::string());
+                else
+                    row.keys.push_back(std::to_string(v));
+            }
+            rows->push_back(std::move(row));
+        }
+        std::sort(rows->begin(), rows->end(), [](const fc_query_row_t &a, const fc_query_row_t &b)
+        {
+            return a.count != b.count ? a.count > b.count : a.keys < b.keys;
+        });
+        if(q.top > 0 && rows->size() > q.top) rows->resize(q.top);
+    }
+
+    if(NULL != stats)
+    {
+        stats->rows_total = st.nrows;
+        stats->rows_matched = total_matched;
+        stats->blocks_total = nblocks;
+        stats->blocks_skipped = total_skipped;
+    }
+    return 0;
+}
+
+}
@@ -0,0 +1,98 @@
+// Host-side columnar index over the crash bundles written by xcd_process_record().
+
+#ifndef FC_INDEX_H
+#define FC_INDEX_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace fc
+{
+
+// rows per zone-map block
+static const size_t FC_INDEX_BLOCK_ROWS = 65536;
+
+// number of symbolized frames kept from the crashed thread's backtrace
+static const size_t FC_INDEX_TOP_FRAMES = 3;
+
+enum fc_column_type
+{
+    FC_COLUMN_INT,  // raw int32 values
+    FC_COLUMN_STR   // uint32 codes into a sorted dictionary
+};
+
+typedef struct fc_column_desc
+{
+    const char     *name;
+    fc_column_type  type;
+} fc_column_desc_t;
+
+// fixed schema of the index, in on-disk column order
+extern const fc_column_desc_t fc_index_schema[];
+extern const size_t           fc_index_schema_size;
+
+// one parsed crash bundle; ints[] and strs[] follow fc_index_schema order per type
+typedef struct fc_bundle_record
+{
+    std::vector<int32_t>     ints;
+    std::vector<std::string> strs;
+} fc_bundle_record_t;
+
+// parse one xCrash tombstone, returns 0 on success
+int fc_bundle_parse(const char *buf, size_t len, fc_bundle_record_t *rec);
+int fc_bundle_parse_file(const char *path, fc_bundle_record_t *rec);
+
+// build the on-disk store from bundle files; append rewrites the existing rows along with the new ones
+int fc_index_ingest(const char *store_dir, const std::vector<std::string> &paths,
+                    unsigned int nthreads, int append, size_t *nrows);
+
+enum fc_pred_op
+{
+    FC_PRED_EQ,
+    FC_PRED_NE,
+    FC_PRED_LT,
+    FC_PRED_LE,
+    FC_PRED_GT,
+    FC_PRED_GE
+};
+
+typedef struct fc_predicate
+{
+    std::string column;
+    fc_pred_op  op;
+    std::string value;
+} fc_predicate_t;
+
+typedef struct fc_query
+{
+    std::vector<fc_predicate_t> where;
+    std::vector<std::string>    group_by;
+    size_t                      top; // 0 means unlimited
+} fc_query_t;
+
+typedef struct fc_query_row
+{
+    std::vector<std::string> keys;
+    uint64_t                 count;
+} fc_query_row_t;
+
+typedef struct fc_query_stats
+{
+    size_t rows_total;
+    size_t rows_matched;
+    size_t blocks_total;
+    size_t blocks_skipped;
+} fc_query_stats_t;
+
+// parse "column<op>value", returns 0 on success
+int fc_predicate_parse(const char *expr, fc_predicate_t *pred);
+
+// run a count / group-by query against the store
+int fc_index_query(const char *store_dir, const fc_query_t &q,
+                   std::vector<fc_query_row_t> *rows, fc_query_stats_t *stats);
+
+}
+
+#endif
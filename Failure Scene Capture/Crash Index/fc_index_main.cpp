@@ -0,0 +1,128 @@
+// Command line front end of the crash bundle index.
+//
+//   fc_index ingest [-j threads] [-a] <store_dir> <bundle file or dir>...
+//   fc_index query <store_dir> [-w column<op>value]... [-g column]... [-n top]
+//
+// e.g. which vendor libraries fault most on Android 11:
+//   fc_index query store -w os_version=11 -w fault_module>=/vendor/ -w fault_module</vendor0 -g fault_module -n 20
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fc_index.h"
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: fc_index ingest [-j threads] [-a] <store_dir> <bundle file or dir>...\n"
+            "       fc_index query <store_dir> [-w column<op>value]... [-g column]... [-n top]\n"
+            "ops: = != < <= > >=, string columns compare lexicographically\n"
+            "columns:");
+    for(size_t i = 0; i < fc::fc_index_schema_size; i++)
+        fprintf(stderr, " %s", fc::fc_index_schema[i].name);
+    fprintf(stderr, "\n");
+}
+
+static int cmd_ingest(int argc, char **argv)
+{
+    std::vector<std::string> paths;
+    unsigned int             nthreads = 0;
+    int                      append = 0;
+    size_t                   nrows = 0;
+    int                      c;
+
+    while(-1 != (c = getopt(argc, argv, "j:a")))
+    {
+        switch(c)
+        {
+        case 'j': nthreads = (unsigned int)atoi(optarg); break;
+        case 'a': append = 1; break;
+        default: usage(); return 1;
+        }
+    }
+    if(argc - optind < 2)
+    {
+        usage();
+        return 1;
+    }
+
+    for(int i = optind + 1; i < argc; i++) paths.push_back(argv[i]);
+    if(0 != fc::fc_index_ingest(argv[optind], paths, nthreads, append, &nrows))
+    {
+        fprintf(stderr, "fc_index: ingest into %s failed\n", argv[optind]);
+        return 1;
+    }
+
+    printf("%zu bundles indexed in %s\n", nrows, argv[optind]);
+    return 0;
+}
+
+static int cmd_query(int argc, char **argv)
+{
+    fc::fc_query_t                  q;
+    fc::fc_query_stats_t            stats;
+    std::vector<fc::fc_query_row_t> rows;
+    int                             c;
+
+    q.top = 0;
+    if(argc < 2)
+    {
+        usage();
+        return 1;
+    }
+    const char *store_dir = argv[1];
+    optind = 2;
+
+    while(-1 != (c = getopt(argc, argv, "w:g:n:")))
+    {
+        switch(c)
+        {
+        case 'w':
+        {
+            fc::fc_predicate_t p;
+            if(0 != fc::fc_predicate_parse(optarg, &p))
+            {
+                fprintf(stderr, "fc_index: bad predicate '%s'\n", optarg);
+                return 1;
+            }
+            q.where.push_back(p);
+            break;
+        }
+        case 'g': q.group_by.push_back(optarg); break;
+        case 'n': q.top = (size_t)strtoul(optarg, NULL, 10); break;
+        default: usage(); return 1;
+        }
+    }
+
+    if(0 != fc::fc_index_query(store_dir, q, &rows, &stats))
+    {
+        fprintf(stderr, "fc_index: query on %s failed (bad store or unknown column)\n", store_dir);
+        return 1;
+    }
+
+    for(const fc::fc_query_row_t &row : rows)
+    {
+        printf("%10llu", (unsigned long long)row.count);
+        for(const std::string &k : row.keys) printf("\t%s", k.empty() ? "-" : k.c_str());
+        printf("\n");
+    }
+    fprintf(stderr, "matched %zu of %zu rows, skipped %zu of %zu blocks\n",
+            stats.rows_matched, stats.rows_total, stats.blocks_skipped, stats.blocks_total);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc < 2)
+    {
+        usage();
+        return 1;
+    }
+
+    if(0 == strcmp(argv[1], "ingest")) return cmd_ingest(argc - 1, argv + 1);
+    if(0 == strcmp(argv[1], "query")) return cmd_query(argc - 1, argv + 1);
+
+    usage();
+    return 1;
+}
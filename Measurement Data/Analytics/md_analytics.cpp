@@ -0,0 +1,239 @@
+// Command line front end of the failure event analytics.
+//
+//   md_analytics count <csv> [-w column=value]... [-g column]... [-n top] [-j threads]
+//   md_analytics ratio <csv> [-w column=value]... [-g column]... [-n top] [-j threads]
+//   md_analytics discrepancy <csv>... [-n top] [-m min_events] [-z quantile] [-c] [-t similarity] [-v] [-j threads]
+//   md_analytics cluster <csv> [-n top] [-t similarity] [-j threads]
+//
+// "ratio" reports the physical-vs-virtualized failure frequency ratio per group
+// (default: per error), each device type normalized by its own number of events.
+// "discrepancy" folds every csv in as one batch and ranks (error, scene) signatures
+// by how confidently their frequency differs between the device types; with -c, scenes
+// are clustered first so that near-duplicate scenes share a signature.
+// "cluster" lists the scene clusters by number of events.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include "md_cluster.h"
+#include "md_discrepancy.h"
+#include "md_table.h"
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: md_analytics count <csv> [-w column=value]... [-g column]... [-n top] [-j threads]\n"
+            "       md_analytics ratio <csv> [-w column=value]... [-g column]... [-n top] [-j threads]\n"
+            "       md_analytics discrepancy <csv>... [-n top] [-m min_events] [-z quantile] [-c] [-t similarity] [-v] [-j threads]\n"
+            "       md_analytics cluster <csv> [-n top] [-t similarity] [-j threads]\n"
+            "columns:");
+    for(int c = 0; c < md::MD_COL_NUM; c++)
+        fprintf(stderr, " %s", md::md_column_names[c]);
+    fprintf(stderr, "\n");
+}
+
+static void print_keys(const md::md_table_t &t, const std::vector<int> &group_by,
+                       const std::vector<uint32_t> &codes)
+{
+    for(size_t i = 0; i < group_by.size(); i++)
+        printf("\t%s", t.dicts[group_by[i]].value(codes[i]).c_str());
+    printf("\n");
+}
+
+static void print_discrepancy(const md::md_discrepancy &d, size_t top)
+{
+    std::vector<md::md_discrepancy_row_t> rows;
+
+    d.top(top, &rows);
+    printf("%8s %10s %10s %10s %10s %10s\n", "score", "ratio", "ratio_lo", "ratio_hi", "physical", "virtual");
+    for(const md::md_discrepancy_row_t &r : rows)
+        printf("%8.3f %10.4g %10.4g %10.4g %10llu %10llu\t%s\t%s\n", r.score, r.ratio, r.ratio_lo,
+               r.ratio_hi, (unsigned long long)r.physical, (unsigned long long)r.virtualized,
+               r.error.c_str(), r.scene.c_str());
+}
+
+static int cmd_discrepancy(int argc, char **argv)
+{
+    md::md_discrepancy_config_t cfg;
+    md::md_cluster_config_t     cluster_cfg;
+    std::vector<const char *>   paths(1, argv[2]);
+    size_t                      top = 20;
+    unsigned int                nthreads = 0;
+    int                         c, verbose = 0, cluster = 0;
+
+    md::md_discrepancy_config_init(&cfg);
+    md::md_cluster_config_init(&cluster_cfg);
+    optind = 3;
+    while(-1 != (c = getopt(argc, argv, "n:m:z:ct:vj:")))
+    {
+        switch(c)
+        {
+        case 'n': top = (size_t)strtoul(optarg, NULL, 10); break;
+        case 'm': cfg.min_events = strtoull(optarg, NULL, 10); break;
+        case 'z': cfg.z = atof(optarg); break;
+        case 'c': cluster = 1; break;
+        case 't': cluster_cfg.threshold = atof(optarg); break;
+        case 'v': verbose = 1; break;
+        case 'j': nthreads = (unsigned int)atoi(optarg); break;
+        default: usage(); return 1;
+        }
+    }
+    for(; optind < argc; optind++) paths.push_back(argv[optind]);
+
+    md::md_discrepancy d(cfg);
+    md::md_clusterer   clusterer(cluster_cfg);
+    if(cluster) d.set_clusterer(&clusterer);
+    for(const char *path : paths)
+    {
+        md::md_table_t t;
+        md::md_table_init(&t);
+        if(0 != md::md_table_load_csv(&t, path, nthreads) || 0 != d.add_batch(t, nthreads))
+        {
+            fprintf(stderr, "md_analytics: batch %s failed\n", path);
+            return 1;
+        }
+        if(verbose)
+        {
+            printf("after %s: %zu signatures, %llu physical, %llu virtualized events\n", path,
+                   d.num_signatures(), (unsigned long long)d.total_physical(),
+                   (unsigned long long)d.total_virtualized());
+            print_discrepancy(d, top);
+        }
+    }
+
+    if(!verbose) print_discrepancy(d, top);
+    return 0;
+}
+
+static int cmd_cluster(int argc, char **argv)
+{
+    md::md_cluster_config_t cfg;
+    md::md_table_t          t;
+    md::md_codes_t          clusters;
+    size_t                  top = 20, i;
+    unsigned int            nthreads = 0;
+    int                     c;
+
+    md::md_cluster_config_init(&cfg);
+    optind = 3;
+    while(-1 != (c = getopt(argc, argv, "n:t:j:")))
+    {
+        switch(c)
+        {
+        case 'n': top = (size_t)strtoul(optarg, NULL, 10); break;
+        case 't': cfg.threshold = atof(optarg); break;
+        case 'j': nthreads = (unsigned int)atoi(optarg); break;
+        default: usage(); return 1;
+        }
+    }
+
+    md::md_clusterer clusterer(cfg);
+    md::md_table_init(&t);
+    if(0 != md::md_table_load_csv(&t, argv[2], nthreads) || 0 != clusterer.assign_table(t, nthreads, &clusters))
+    {
+        fprintf(stderr, "md_analytics: cluster %s failed\n", argv[2]);
+        return 1;
+    }
+
+    std::vector<uint64_t> events(clusters.size() > 0 ? clusterer.num_clusters() : 0, 0);
+    std::vector<uint32_t> order(events.size());
+    for(uint32_t cl : clusters) events[cl]++;
+    for(i = 0; i < order.size(); i++) order[i] = (uint32_t)i;
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return events[a] > events[b]; });
+
+    printf("%zu scenes, %zu clusters\n", t.dicts[md::MD_COL_SCENE].size(), clusterer.num_clusters());
+    printf("%10s %10s\n", "events", "templates");
+    for(i = 0; i < order.size() && (0 == top || i < top); i++)
+        printf("%10llu %10zu\t%s\t%s\n", (unsigned long long)events[order[i]], clusterer.num_templates(order[i]),
+               clusterer.error(order[i]).c_str(), clusterer.representative(order[i]).c_str());
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    md::md_table_t               t;
+    std::vector<const char*>     where;
+    std::vector<md::md_filter_t> filters;
+    std::vector<int>             group_by;
+    size_t                       top = 0, i;
+    unsigned int                 nthreads = 0;
+    int                          c, ratio;
+
+    if(argc >= 3 && 0 == strcmp(argv[1], "discrepancy")) return cmd_discrepancy(argc, argv);
+    if(argc >= 3 && 0 == strcmp(argv[1], "cluster")) return cmd_cluster(argc, argv);
+    if(argc < 3 || (0 != strcmp(argv[1], "count") && 0 != strcmp(argv[1], "ratio")))
+    {
+        usage();
+        return 1;
+    }
+    ratio = (0 == strcmp(argv[1], "ratio"));
+    const char *path = argv[2];
+    optind = 3;
+
+    while(-1 != (c = getopt(argc, argv, "w:g:n:j:")))
+    {
+        switch(c)
+        {
+        case 'w': where.push_back(optarg); break;
+        case 'g':
+            if(0 > (c = md::md_column_from_name(optarg)))
+            {
+                fprintf(stderr, "md_analytics: unknown column '%s'\n", optarg);
+                return 1;
+            }
+            group_by.push_back(c);
+            break;
+        case 'n': top = (size_t)strtoul(optarg, NULL, 10); break;
+        case 'j': nthreads = (unsigned int)atoi(optarg); break;
+        default: usage(); return 1;
+        }
+    }
+    if(ratio && group_by.empty()) group_by.push_back(md::MD_COL_ERROR);
+
+    md::md_table_init(&t);
+    if(0 != md::md_table_load_csv(&t, path, nthreads))
+    {
+        fprintf(stderr, "md_analytics: load %s failed\n", path);
+        return 1;
+    }
+
+    for(const char *w : where)
+    {
+        md::md_filter_t f;
+        if(0 != md::md_filter_parse(t, w, &f))
+        {
+            fprintf(stderr, "md_analytics: bad filter '%s'\n", w);
+            return 1;
+        }
+        filters.push_back(f);
+    }
+
+    if(ratio)
+    {
+        std::vector<md::md_type_ratio_t> rows;
+        if(0 != md::md_table_type_ratio(t, filters, group_by, nthreads, &rows)) return 1;
+        printf("%10s %10s %10s\n", "ratio", "physical", "virtual");
+        for(i = 0; i < rows.size() && (0 == top || i < top); i++)
+        {
+            printf("%10.3f %10llu %10llu", rows[i].ratio, (unsigned long long)rows[i].physical,
+                   (unsigned long long)rows[i].virtualized);
+            print_keys(t, group_by, rows[i].codes);
+        }
+    }
+    else
+    {
+        std::vector<md::md_group_count_t> rows;
+        if(0 != md::md_table_group_count(t, filters, group_by, nthreads, &rows)) return 1;
+        for(i = 0; i < rows.size() && (0 == top || i < top); i++)
+        {
+            printf("%10llu", (unsigned long long)rows[i].count);
+            print_keys(t, group_by, rows[i].codes);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,352 @@
+// Scene text normalization and near-duplicate clustering of failure signatures.
+
+#include <ctype.h>
+#include <string.h>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include "md_cluster.h"
+
+namespace md
+{
+
+void md_scene_normalize(std::string_view scene, std::string *out)
+{
+    size_t i = 0, n = scene.size();
+
+    out->clear();
+    while(i < n)
+    {
+        unsigned char ch = (unsigned char)scene[i];
+
+        //runs of whitespace become a single space, leading/trailing ones are dropped
+        if(isspace(ch))
+        {
+            while(i < n && isspace((unsigned char)scene[i])) i++;
+            if(!out->empty() && i < n) out->push_back(' ');
+            continue;
+        }
+
+        //numbers and addresses only count when they do not continue an identifier
+        int word_start = (out->empty() || !(isalnum((unsigned char)out->back()) || '_' == out->back()));
+        if(word_start && '0' == ch && i + 1 < n && ('x' == scene[i + 1] || 'X' == scene[i + 1]) &&
+           i + 2 < n && isxdigit((unsigned char)scene[i + 2]))
+        {
+            i += 2;
+            while(i < n && isxdigit((unsigned char)scene[i])) i++;
+            out->append("<hex>");
+            continue;
+        }
+        if(word_start && isdigit(ch))
+        {
+            size_t j = i;
+            while(j < n && isdigit((unsigned char)scene[j])) j++;
+            if(j >= n || !(isalpha((unsigned char)scene[j]) || '_' == scene[j]))
+            {
+                out->append("<num>");
+                i = j;
+                continue;
+            }
+        }
+
+        out->push_back((char)ch);
+        i++;
+    }
+}
+
+static int md_is_separator(char ch)
+{
+    return (NULL != strchr("()[]{},;:='\"", ch));
+}
+
+static void md_template_token(std::string_view token, std::string *out)
+{
+    if(!out->empty()) out->push_back(' ');
+
+    //identifiers that embed digits (ids, hashes, generated names) vary between instances
+    for(char ch : token)
+    {
+        if(isdigit((unsigned char)ch))
+        {
+            out->append("<*>");
+            return;
+        }
+    }
+    out->append(token.data(), token.size());
+}
+
+void md_scene_template(std::string_view scene, std::string *out)
+{
+    std::string norm;
+    size_t      i = 0, j;
+
+    md_scene_normalize(scene, &norm);
+    out->clear();
+    while(i < norm.size())
+    {
+        if(' ' == norm[i])
+        {
+            i++;
+        }
+        else if(md_is_separator(norm[i]))
+        {
+            md_template_token(std::string_view(norm.data() + i, 1), out);
+            i++;
+        }
+        else
+        {
+            for(j = i; j < norm.size() && ' ' != norm[j] && !md_is_separator(norm[j]); j++);
+            md_template_token(std::string_view(norm.data() + i, j - i), out);
+            i = j;
+        }
+    }
+}
+
+void md_cluster_config_init(md_cluster_config_t *cfg)
+{
+    cfg->threshold = 0.6;
+}
+
+static inline uint64_t md_mix64(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static uint64_t md_hash_str(std::string_view s)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for(char ch : s)
+    {
+        h ^= (unsigned char)ch;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static uint64_t md_band_key(uint64_t error_hash, int band, const uint64_t *minhash)
+{
+    uint64_t h = md_mix64(error_hash ^ (uint64_t)band);
+
+    for(int r = 0; r < MD_MINHASH_ROWS; r++)
+        h = md_mix64(h ^ minhash[band * MD_MINHASH_ROWS + r]);
+    return h;
+}
+
+static double md_similarity(const uint64_t *a, const uint64_t *b)
+{
+    int same = 0;
+
+    for(int i = 0; i < MD_MINHASH_SIZE; i++)
+        same += (a[i] == b[i]);
+    return (double)same / MD_MINHASH_SIZE;
+}
+
+md_clusterer::md_clusterer(const md_cluster_config_t &cfg)
+    : cfg_(cfg)
+{
+}
+
+void md_clusterer::minhash(std::string_view tmpl, uint64_t *out)
+{
+    static uint64_t        seeds[MD_MINHASH_SIZE];
+    static std::once_flag  seeds_once;
+    std::vector<uint64_t>  tokens, shingles;
+    size_t                 i = 0, j;
+
+    std::call_once(seeds_once, []() {
+        for(int k = 0; k < MD_MINHASH_SIZE; k++) seeds[k] = md_mix64((uint64_t)k + 1);
+    });
+
+    while(i <= tmpl.size())
+    {
+        for(j = i; j < tmpl.size() && ' ' != tmpl[j]; j++);
+        if(j > i) tokens.push_back(md_hash_str(tmpl.substr(i, j - i)));
+        i = j + 1;
+    }
+
+    //shingles are token bigrams; a scene of at most one token is its own shingle
+    if(tokens.size() < 2)
+        shingles.push_back(tokens.empty() ? 0 : tokens[0]);
+    for(i = 0; i + 1 < tokens.size(); i++)
+        shingles.push_back(md_mix64(tokens[i] ^ ((tokens[i + 1] << 29) | (tokens[i + 1] >> 35))));
+    std::sort(shingles.begin(), shingles.end());
+    shingles.erase(std::unique(shingles.begin(), shingles.end()), shingles.end());
+
+    for(int k = 0; k < MD_MINHASH_SIZE; k++) out[k] = UINT64_MAX;
+    for(uint64_t sh : shingles)
+    {
+        for(int k = 0; k < MD_MINHASH_SIZE; k++)
+        {
+            uint64_t v = md_mix64(sh ^ seeds[k]);
+            if(v < out[k]) out[k] = v;
+        }
+    }
+}
+
+uint32_t md_clusterer::insert(std::string_view error, const std::string &key, const uint64_t *minhash)
+{
+    uint64_t bands[MD_MINHASH_BANDS];
+    uint64_t error_hash = md_hash_str(error);
+    uint32_t best = UINT32_MAX;
+    double   best_sim = cfg_.threshold;
+
+    //candidates share at least one band with a member of the same error,
+    //they are accepted by their similarity to the cluster representative
+    for(int b = 0; b < MD_MINHASH_BANDS; b++)
+    {
+        bands[b] = md_band_key(error_hash, b, minhash);
+        auto bit = buckets_[b].find(bands[b]);
+        if(bit == buckets_[b].end()) continue;
+        for(uint32_t c : bit->second)
+        {
+            if(c == best || clusters_[c].error != error) continue;
+            double sim = md_similarity(minhash, clusters_[c].minhash);
+            if(sim >= best_sim)
+            {
+                best = c;
+                best_sim = sim;
+            }
+        }
+    }
+
+    if(UINT32_MAX == best)
+    {
+        best = (uint32_t)clusters_.size();
+        clusters_.push_back(cluster_t());
+        cluster_t &c = clusters_.back();
+        c.error.assign(error);
+        c.representative = key.substr(error.size() + 1);
+        memcpy(c.minhash, minhash, sizeof(c.minhash));
+        c.ntemplates = 0;
+    }
+    clusters_[best].ntemplates++;
+    by_template_.emplace(key, best);
+
+    //index every member, so later templates close to it are proposed as well
+    for(int b = 0; b < MD_MINHASH_BANDS; b++)
+    {
+        std::vector<uint32_t> &bucket = buckets_[b][bands[b]];
+        if(bucket.empty() || bucket.back() != best) bucket.push_back(best);
+    }
+
+    return best;
+}
+
+static void md_template_key(std::string_view error, std::string_view scene, std::string *key)
+{
+    std::string tmpl;
+
+    md_scene_template(scene, &tmpl);
+    key->assign(error);
+    key->push_back('\x1f');
+    key->append(tmpl);
+}
+
+uint32_t md_clusterer::assign(std::string_view error, std::string_view scene)
+{
+    std::string key;
+    uint64_t    mh[MD_MINHASH_SIZE];
+
+    md_template_key(error, scene, &key);
+    auto it = by_template_.find(key);
+    if(it != by_template_.end()) return it->second;
+
+    minhash(std::string_view(key).substr(error.size() + 1), mh);
+    return this->insert(error, key, mh);
+}
+
+// run fn(i) for i in [0, n) on up to nthreads threads, one contiguous range each
+template <typename F>
+static void md_parallel_for(size_t n, unsigned int nthreads, F fn)
+{
+    size_t chunk, th;
+
+    if(0 == nthreads) nthreads = std::max(1u, std::thread::hardware_concurrency());
+    chunk = std::max((size_t)1, (n + nthreads - 1) / nthreads);
+
+    std::vector<std::thread> workers;
+    for(th = 0; th * chunk < n; th++)
+    {
+        workers.emplace_back([&, th]() {
+            size_t end = std::min(n, (th + 1) * chunk);
+            for(size_t i = th * chunk; i < end; i++) fn(i);
+        });
+    }
+    for(std::thread &w : workers) w.join();
+}
+
+int md_clusterer::assign_pairs(const md_table_t &t, const std::vector<uint64_t> &pairs,
+                               unsigned int nthreads, std::vector<uint32_t> *clusters)
+{
+    std::vector<std::string>                     keys(pairs.size());
+    std::vector<size_t>                          fresh; // first pair of each template not clustered yet
+    std::unordered_map<std::string_view, size_t> batch_templates; // key -> index into fresh
+    std::vector<uint64_t>                        minhashes;
+
+    //distinct scenes mostly differ in ids and numbers only: template them in parallel,
+    //and MinHash each template that is new to the clusterer once
+    md_parallel_for(pairs.size(), nthreads, [&](size_t i) {
+        md_template_key(t.dicts[MD_COL_ERROR].value((uint32_t)(pairs[i] >> 32)),
+                        t.dicts[MD_COL_SCENE].value((uint32_t)pairs[i]), &keys[i]);
+    });
+
+    clusters->assign(pairs.size(), UINT32_MAX);
+    for(size_t i = 0; i < pairs.size(); i++)
+    {
+        auto it = by_template_.find(keys[i]);
+        if(it != by_template_.end())
+            (*clusters)[i] = it->second;
+        else if(batch_templates.emplace(keys[i], fresh.size()).second)
+            fresh.push_back(i);
+    }
+
+    minhashes.resize(fresh.size() * MD_MINHASH_SIZE);
+    md_parallel_for(fresh.size(), nthreads, [&](size_t f) {
+        const std::string &key = keys[fresh[f]];
+        minhash(std::string_view(key).substr(key.find('\x1f') + 1), &minhashes[f * MD_MINHASH_SIZE]);
+    });
+
+    //the LSH index is updated sequentially, in pair order, so cluster ids are deterministic
+    for(size_t f = 0; f < fresh.size(); f++)
+    {
+        size_t i = fresh[f];
+        (*clusters)[i] = this->insert(t.dicts[MD_COL_ERROR].value((uint32_t)(pairs[i] >> 32)), keys[i],
+                                      &minhashes[f * MD_MINHASH_SIZE]);
+    }
+    for(size_t i = 0; i < pairs.size(); i++)
+        if(UINT32_MAX == (*clusters)[i]) (*clusters)[i] = by_template_.find(keys[i])->second;
+
+    return 0;
+}
+
+int md_clusterer::assign_table(const md_table_t &t, unsigned int nthreads, md_codes_t *clusters)
+{
+    std::vector<md_group_count_t>          counts;
+    std::vector<int>                       cols = { MD_COL_ERROR, MD_COL_SCENE };
+    std::vector<uint64_t>                  pairs;
+    std::vector<uint32_t>                  pair_clusters;
+    std::unordered_map<uint64_t, uint32_t> by_pair; // (error code, scene code) -> cluster
+
+    //cluster the distinct (error, scene) pairs, then map the rows onto them
+    if(0 != md_table_group_count(t, std::vector<md_filter_t>(), cols, nthreads, &counts)) return -1;
+    for(const md_group_count_t &g : counts)
+        pairs.push_back(((uint64_t)g.codes[0] << 32) | g.codes[1]);
+    if(0 != this->assign_pairs(t, pairs, nthreads, &pair_clusters)) return -1;
+    by_pair.reserve(pairs.size());
+    for(size_t i = 0; i < pairs.size(); i++) by_pair.emplace(pairs[i], pair_clusters[i]);
+
+    clusters->resize(t.nrows);
+    const uint32_t *errors = t.codes[MD_COL_ERROR].data();
+    const uint32_t *scenes = t.codes[MD_COL_SCENE].data();
+    md_parallel_for(t.nrows, nthreads, [&](size_t r) {
+        (*clusters)[r] = by_pair.find(((uint64_t)errors[r] << 32) | scenes[r])->second;
+    });
+
+    return 0;
+}
+
+}
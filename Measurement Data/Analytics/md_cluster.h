@@ -0,0 +1,84 @@
+// Scene text normalization and near-duplicate clustering of failure signatures.
+//
+// Scenes are normalized (whitespace, numbers, addresses), split into tokens and
+// templated (tokens carrying digits become "<*>"). Token bigrams are MinHashed,
+// and an LSH index over bands of the MinHash signature proposes candidate clusters,
+// which are accepted when the estimated Jaccard similarity reaches the threshold.
+// Clustering is incremental: a new template joins the most similar existing
+// cluster of the same error or starts a new one, so cluster ids stay stable as
+// batches arrive.
+
+#ifndef MD_CLUSTER_H
+#define MD_CLUSTER_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "md_table.h"
+
+namespace md
+{
+
+#define MD_MINHASH_BANDS 16
+#define MD_MINHASH_ROWS  4
+#define MD_MINHASH_SIZE  (MD_MINHASH_BANDS * MD_MINHASH_ROWS)
+
+// collapse whitespace and replace numbers/addresses in a scene text with placeholders
+void md_scene_normalize(std::string_view scene, std::string *out);
+
+// normalize, tokenize and template a scene; tokens are joined by single spaces
+void md_scene_template(std::string_view scene, std::string *out);
+
+typedef struct md_cluster_config
+{
+    double threshold; // minimum estimated Jaccard similarity of token bigrams to join a cluster
+} md_cluster_config_t;
+
+void md_cluster_config_init(md_cluster_config_t *cfg);
+
+class md_clusterer
+{
+public:
+    explicit md_clusterer(const md_cluster_config_t &cfg);
+
+    // cluster of one event
+    uint32_t assign(std::string_view error, std::string_view scene);
+
+    // cluster of each (error code << 32 | scene code) pair of t's dictionaries;
+    // templating and MinHashing run in parallel, each new template is MinHashed once
+    int assign_pairs(const md_table_t &t, const std::vector<uint64_t> &pairs,
+                     unsigned int nthreads, std::vector<uint32_t> *clusters);
+
+    // cluster of every row of t; templates and MinHashes of new (error, scene)
+    // pairs are computed in parallel, rows are mapped in parallel
+    int assign_table(const md_table_t &t, unsigned int nthreads, md_codes_t *clusters);
+
+    const std::string &error(uint32_t cluster) const { return clusters_[cluster].error; }
+    const std::string &representative(uint32_t cluster) const { return clusters_[cluster].representative; }
+    size_t num_templates(uint32_t cluster) const { return clusters_[cluster].ntemplates; }
+    size_t num_clusters() const { return clusters_.size(); }
+
+private:
+    typedef struct cluster
+    {
+        std::string error;
+        std::string representative; // template of the first member
+        uint64_t    minhash[MD_MINHASH_SIZE];
+        size_t      ntemplates;
+    } cluster_t;
+
+    static void minhash(std::string_view tmpl, uint64_t *out);
+    uint32_t insert(std::string_view error, const std::string &key, const uint64_t *minhash);
+
+    md_cluster_config_t                                     cfg_;
+    std::vector<cluster_t>                                  clusters_;
+    std::unordered_map<std::string, uint32_t>               by_template_; // error \x1f template -> cluster
+    std::unordered_map<uint64_t, std::vector<uint32_t>>     buckets_[MD_MINHASH_BANDS];
+};
+
+}
+
+#endif
@@ -0,0 +1,313 @@
+// Streaming, mmap-based RFC 4180 csv reader.
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <thread>
+#include "md_csv.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#if defined(__PCLMUL__)
+#include <wmmintrin.h>
+#endif
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace md
+{
+
+#define MD_CSV_BLOCK 64
+
+//
+// file mapping
+//
+
+int md_csv_file::open(const char *path)
+{
+    struct stat st;
+    int         fd;
+
+    this->close();
+    if(0 > (fd = ::open(path, O_RDONLY | O_CLOEXEC))) return -1;
+    if(0 != fstat(fd, &st))
+    {
+        ::close(fd);
+        return -1;
+    }
+
+    size_ = (size_t)st.st_size;
+    if(size_ > 0)
+    {
+        addr_ = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(MAP_FAILED == addr_)
+        {
+            addr_ = NULL;
+            size_ = 0;
+            ::close(fd);
+            return -1;
+        }
+        madvise(addr_, size_, MADV_SEQUENTIAL);
+    }
+
+    ::close(fd);
+    return 0;
+}
+
+void md_csv_file::close()
+{
+    if(NULL != addr_) munmap(addr_, size_);
+    addr_ = NULL;
+    size_ = 0;
+}
+
+//
+// 64-byte block classification
+//
+
+typedef struct md_csv_masks
+{
+    uint64_t quote;
+    uint64_t comma;
+    uint64_t newline;
+} md_csv_masks_t;
+
+#if defined(__SSE2__)
+
+static inline uint64_t md_csv_eq_mask(const __m128i v[4], char c)
+{
+    const __m128i k = _mm_set1_epi8(c);
+    uint64_t      m0 = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[0], k));
+    uint64_t      m1 = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[1], k));
+    uint64_t      m2 = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[2], k));
+    uint64_t      m3 = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[3], k));
+    return m0 | (m1 << 16) | (m2 << 32) | (m3 << 48);
+}
+
+static inline void md_csv_classify(const char *p, md_csv_masks_t *m)
+{
+    __m128i v[4];
+    for(int i = 0; i < 4; i++) v[i] = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+    m->quote = md_csv_eq_mask(v, '"');
+    m->comma = md_csv_eq_mask(v, ',');
+    m->newline = md_csv_eq_mask(v, '\n');
+}
+
+#elif defined(__ARM_NEON)
+
+static inline uint64_t md_csv_eq_mask(const uint8x16_t v[4], uint8_t c)
+{
+    static const uint8_t weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    const uint8x16_t     w = vld1q_u8(weights);
+    const uint8x16_t     k = vdupq_n_u8(c);
+    uint8x16_t           t0 = vandq_u8(vceqq_u8(v[0], k), w);
+    uint8x16_t           t1 = vandq_u8(vceqq_u8(v[1], k), w);
+    uint8x16_t           t2 = vandq_u8(vceqq_u8(v[2], k), w);
+    uint8x16_t           t3 = vandq_u8(vceqq_u8(v[3], k), w);
+    uint8x16_t           s = vpaddq_u8(vpaddq_u8(t0, t1), vpaddq_u8(t2, t3));
+    s = vpaddq_u8(s, s);
+    return vgetq_lane_u64(vreinterpretq_u64_u8(s), 0);
+}
+
+static inline void md_csv_classify(const char *p, md_csv_masks_t *m)
+{
+    uint8x16_t v[4];
+    for(int i = 0; i < 4; i++) v[i] = vld1q_u8((const uint8_t *)p + 16 * i);
+    m->quote = md_csv_eq_mask(v, '"');
+    m->comma = md_csv_eq_mask(v, ',');
+    m->newline = md_csv_eq_mask(v, '\n');
+}
+
+#else
+
+static inline void md_csv_classify(const char *p, md_csv_masks_t *m)
+{
+    m->quote = m->comma = m->newline = 0;
+    for(int i = 0; i < MD_CSV_BLOCK; i++)
+    {
+        uint64_t bit = 1ULL << i;
+        if('"' == p[i]) m->quote |= bit;
+        else if(',' == p[i]) m->comma |= bit;
+        else if('\n' == p[i]) m->newline |= bit;
+    }
+}
+
+#endif
+
+// bit i of the result is the xor of bits [0, i] of x, i.e. set inside quotes
+static inline uint64_t md_csv_prefix_xor(uint64_t x)
+{
+#if defined(__SSE2__) && defined(__PCLMUL__)
+    return (uint64_t)_mm_cvtsi128_si64(_mm_clmulepi64_si128(_mm_set_epi64x(0, (long long)x),
+                                                           _mm_set1_epi8((char)0xFF), 0));
+#else
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+#endif
+}
+
+// classify the block at buf + off, zero padding whatever lies at or beyond end
+static inline void md_csv_classify_at(const char *buf, size_t off, size_t end, md_csv_masks_t *m)
+{
+    if(off + MD_CSV_BLOCK <= end)
+    {
+        md_csv_classify(buf + off, m);
+        return;
+    }
+
+    char tmp[MD_CSV_BLOCK];
+    memset(tmp, 0, sizeof(tmp));
+    memcpy(tmp, buf + off, end - off);
+    md_csv_classify(tmp, m);
+}
+
+//
+// fields
+//
+
+std::string_view md_csv_field::value(std::string *scratch) const
+{
+    if(raw.empty() || '"' != raw.front()) return raw;
+
+    //strip the enclosing quotes, keeping anything after the closing one verbatim
+    std::string_view in = raw.substr(1);
+    if(!in.empty() && '"' == in.back()) in.remove_suffix(1);
+    if(std::string_view::npos == in.find('"')) return in;
+
+    scratch->clear();
+    for(size_t i = 0; i < in.size(); i++)
+    {
+        scratch->push_back(in[i]);
+        if('"' == in[i] && i + 1 < in.size() && '"' == in[i + 1]) i++;
+    }
+    return *scratch;
+}
+
+//
+// reader
+//
+
+md_csv_reader::md_csv_reader(const char *buf, size_t begin, size_t end)
+    : buf_(buf), end_(end), block_(begin), field_start_(begin), structurals_(0), in_quote_(0)
+{
+    if(block_ < end_) this->load_block();
+}
+
+void md_csv_reader::load_block()
+{
+    md_csv_masks_t m;
+
+    md_csv_classify_at(buf_, block_, end_, &m);
+    uint64_t quoted = md_csv_prefix_xor(m.quote) ^ in_quote_;
+    in_quote_ = (uint64_t)((int64_t)quoted >> 63);
+    structurals_ = (m.comma | m.newline) & ~quoted;
+    if(end_ - block_ < MD_CSV_BLOCK) structurals_ &= (1ULL << (end_ - block_)) - 1;
+}
+
+bool md_csv_reader::next(std::vector<md_csv_field_t> *fields)
+{
+    fields->clear();
+    if(field_start_ >= end_) return false;
+
+    for(;;)
+    {
+        while(0 == structurals_)
+        {
+            block_ += MD_CSV_BLOCK;
+            if(block_ >= end_)
+            {
+                //last row without a trailing newline
+                std::string_view f(buf_ + field_start_, end_ - field_start_);
+                if(!f.empty() && '\r' == f.back()) f.remove_suffix(1);
+                fields->push_back(md_csv_field_t{f});
+                field_start_ = end_;
+                return true;
+            }
+            this->load_block();
+        }
+
+        size_t pos = block_ + (size_t)__builtin_ctzll(structurals_);
+        structurals_ &= structurals_ - 1;
+
+        std::string_view f(buf_ + field_start_, pos - field_start_);
+        field_start_ = pos + 1;
+        if('\n' == buf_[pos])
+        {
+            if(!f.empty() && '\r' == f.back()) f.remove_suffix(1);
+            fields->push_back(md_csv_field_t{f});
+            return true;
+        }
+        fields->push_back(md_csv_field_t{f});
+    }
+}
+
+//
+// parallel split
+//
+
+static size_t md_csv_count_quotes(const char *buf, size_t begin, size_t end)
+{
+    md_csv_masks_t m;
+    size_t         n = 0, off;
+
+    for(off = begin; off < end; off += MD_CSV_BLOCK)
+    {
+        md_csv_classify_at(buf, off, end, &m);
+        n += (size_t)__builtin_popcountll(m.quote);
+    }
+    return n;
+}
+
+void md_csv_split(const char *buf, size_t begin, size_t end, unsigned int n,
+                  std::vector<md_csv_range_t> *ranges)
+{
+    std::vector<size_t>      cuts, quotes;
+    std::vector<std::thread> workers;
+    size_t                   len = end - begin, i, parity = 0;
+
+    ranges->clear();
+    if(0 == n) n = 1;
+    if(len < (size_t)n * 4096) n = 1; //not worth splitting
+
+    for(i = 0; i <= n; i++) cuts.push_back(begin + len / n * i);
+    cuts[n] = end;
+
+    //pass 1: quote counts per nominal chunk, in parallel
+    quotes.assign(n, 0);
+    for(i = 0; i < n; i++)
+        workers.emplace_back([&, i]() { quotes[i] = md_csv_count_quotes(buf, cuts[i], cuts[i + 1]); });
+    for(std::thread &w : workers) w.join();
+
+    //pass 2: move every cut forward to just past the first newline outside quotes
+    std::vector<size_t> starts(1, begin);
+    for(i = 1; i < n; i++)
+    {
+        size_t p = cuts[i];
+        int    in_quote;
+
+        parity += quotes[i - 1];
+        in_quote = (int)(parity & 1);
+        for(; p < end; p++)
+        {
+            if('"' == buf[p]) in_quote = !in_quote;
+            else if('\n' == buf[p] && !in_quote) break;
+        }
+        p = std::min(end, p + 1);
+        if(p > starts.back()) starts.push_back(p);
+    }
+    starts.push_back(end);
+
+    for(i = 0; i + 1 < starts.size(); i++)
+        if(starts[i] < starts[i + 1]) ranges->push_back(md_csv_range_t{starts[i], starts[i + 1]});
+}
+
+}
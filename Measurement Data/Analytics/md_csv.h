@@ -0,0 +1,83 @@
+// Streaming, mmap-based RFC 4180 csv reader.
+//
+// The input is classified 64 bytes at a time into quote/comma/newline bitmasks
+// (SSE2 or NEON, scalar otherwise); a prefix xor over the quote mask yields the
+// bytes inside quoted fields, so commas and newlines inside scene texts are not
+// taken as delimiters. Fields are handed out as views into the mapping.
+
+#ifndef MD_CSV_H
+#define MD_CSV_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace md
+{
+
+class md_csv_file
+{
+public:
+    md_csv_file() : addr_(NULL), size_(0) {}
+    ~md_csv_file() { this->close(); }
+    md_csv_file(const md_csv_file &) = delete;
+    md_csv_file &operator=(const md_csv_file &) = delete;
+
+    int open(const char *path);
+    void close();
+
+    const char *data() const { return (const char *)addr_; }
+    size_t size() const { return size_; }
+
+private:
+    void   *addr_;
+    size_t  size_;
+};
+
+typedef struct md_csv_field
+{
+    std::string_view raw; // bytes between the delimiters, enclosing quotes included
+
+    // the field value: a view into the file, or into scratch if "" escapes had to be undone
+    std::string_view value(std::string *scratch) const;
+} md_csv_field_t;
+
+class md_csv_reader
+{
+public:
+    // read rows in [begin, end) of buf; begin must be the start of a row
+    md_csv_reader(const char *buf, size_t begin, size_t end);
+
+    // next row into fields, false at the end of the range
+    bool next(std::vector<md_csv_field_t> *fields);
+
+    // offset of the first byte not consumed yet
+    size_t tell() const { return field_start_; }
+
+private:
+    void load_block();
+
+    const char *buf_;
+    size_t      end_;
+    size_t      block_;        // offset of the current 64-byte block
+    size_t      field_start_;
+    uint64_t    structurals_;  // unconsumed delimiter bits of the current block
+    uint64_t    in_quote_;     // all ones when the next block starts inside quotes
+};
+
+typedef struct md_csv_range
+{
+    size_t begin;
+    size_t end;
+} md_csv_range_t;
+
+// split [begin, end) into up to n ranges that each start at a row boundary
+// (never inside a quoted field); quote parity is counted in parallel
+void md_csv_split(const char *buf, size_t begin, size_t end, unsigned int n,
+                  std::vector<md_csv_range_t> *ranges);
+
+}
+
+#endif
@@ -0,0 +1,184 @@
+// Incremental physical-vs-virtualized discrepancy detection over failure signatures.
+
+#include <math.h>
+#include <algorithm>
+#include "md_discrepancy.h"
+
+namespace md
+{
+
+void md_discrepancy_config_init(md_discrepancy_config_t *cfg)
+{
+    cfg->z = 1.959964;
+    cfg->min_events = 5;
+    cfg->drift = 0.01;
+}
+
+// Katz log interval of RR = (p / P) / (v / V), with a 0.5 correction on empty cells
+static void md_relative_risk(uint64_t p, uint64_t v, uint64_t P, uint64_t V, double z,
+                             double *log_rr, double *lo, double *hi)
+{
+    double c = (0 == p || 0 == v) ? 0.5 : 0.0;
+    double a = (double)p + c, b = (double)v + c;
+    double tp = (double)P + c, tv = (double)V + c;
+
+    if(tp <= 0.0 || tv <= 0.0)
+    {
+        *log_rr = *lo = *hi = 0.0;
+        return;
+    }
+
+    double var = 1.0 / a - 1.0 / tp + 1.0 / b - 1.0 / tv;
+    double se = var > 0.0 ? sqrt(var) : 0.0;
+    *log_rr = log(a / tp) - log(b / tv);
+    *lo = *log_rr - z * se;
+    *hi = *log_rr + z * se;
+}
+
+static double md_log_vp(uint64_t P, uint64_t V)
+{
+    return (P > 0 && V > 0) ? log((double)V / (double)P) : 0.0;
+}
+
+md_discrepancy::md_discrepancy(const md_discrepancy_config_t &cfg)
+    : cfg_(cfg), clusterer_(NULL), total_phys_(0), total_virt_(0), scored_log_vp_(0.0)
+{
+}
+
+void md_discrepancy::rescore(uint32_t id)
+{
+    signature_t &s = sigs_[id];
+    double       log_rr, lo, hi;
+
+    if(s.ranked) ranking_.erase(std::make_pair(-s.score, id));
+
+    md_relative_risk(s.physical, s.virtualized, total_phys_, total_virt_, cfg_.z, &log_rr, &lo, &hi);
+    s.score = (lo > 0.0 ? lo : (hi < 0.0 ? -hi : 0.0));
+    s.ranked = (s.physical + s.virtualized >= cfg_.min_events);
+
+    if(s.ranked) ranking_.insert(std::make_pair(-s.score, id));
+}
+
+int md_discrepancy::add_batch(const md_table_t &t, unsigned int nthreads)
+{
+    std::vector<md_group_count_t>          counts;
+    std::vector<int>                       cols = { MD_COL_ERROR, MD_COL_SCENE, MD_COL_DEVICE_TYPE };
+    std::unordered_map<uint64_t, uint32_t> batch_ids; // (error code, scene code) -> signature
+    std::unordered_map<uint64_t, uint32_t> batch_clusters; // (error code, scene code) -> cluster
+    std::vector<uint64_t>                  pairs;
+    std::vector<uint32_t>                  touched, clusters;
+    std::string                            key, scene;
+    uint32_t                               phys, virt;
+
+    //the batch is already dictionary encoded: normalize per distinct pair, not per row
+    if(0 != md_table_group_count(t, std::vector<md_filter_t>(), cols, nthreads, &counts)) return -1;
+
+    const md_dict &types = t.dicts[MD_COL_DEVICE_TYPE];
+    if(0 != types.find("physical", &phys)) phys = (uint32_t)types.size();
+    if(0 != types.find("virtualized", &virt)) virt = (uint32_t)types.size();
+
+    //with a clusterer, near-duplicate scenes share the signature of their cluster
+    if(NULL != clusterer_)
+    {
+        for(const md_group_count_t &g : counts)
+            if(g.codes[2] == phys || g.codes[2] == virt)
+                pairs.push_back(((uint64_t)g.codes[0] << 32) | g.codes[1]);
+        std::sort(pairs.begin(), pairs.end());
+        pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+        if(0 != clusterer_->assign_pairs(t, pairs, nthreads, &clusters)) return -1;
+        for(size_t i = 0; i < pairs.size(); i++) batch_clusters.emplace(pairs[i], clusters[i]);
+    }
+
+    for(const md_group_count_t &g : counts)
+    {
+        if(g.codes[2] != phys && g.codes[2] != virt) continue;
+
+        uint64_t pair = ((uint64_t)g.codes[0] << 32) | g.codes[1];
+        uint32_t id;
+        auto     bit = batch_ids.find(pair);
+        if(bit != batch_ids.end())
+        {
+            id = bit->second;
+        }
+        else
+        {
+            const std::string &error = t.dicts[MD_COL_ERROR].value(g.codes[0]);
+            if(NULL != clusterer_)
+                scene = clusterer_->representative(batch_clusters[pair]);
+            else
+                md_scene_normalize(t.dicts[MD_COL_SCENE].value(g.codes[1]), &scene);
+            key = error;
+            key.push_back('\x1f');
+            key.append(scene);
+
+            auto it = by_key_.find(key);
+            if(it == by_key_.end())
+            {
+                id = (uint32_t)sigs_.size();
+                sigs_.push_back(signature_t{error, scene, 0, 0, 0.0, 0});
+                by_key_.emplace(key, id);
+            }
+            else
+            {
+                id = it->second;
+            }
+            batch_ids.emplace(pair, id);
+            touched.push_back(id);
+        }
+
+        if(g.codes[2] == phys)
+        {
+            sigs_[id].physical += g.count;
+            total_phys_ += g.count;
+        }
+        else
+        {
+            sigs_[id].virtualized += g.count;
+            total_virt_ += g.count;
+        }
+    }
+
+    //RR of untouched signatures only moves with log(V / P); rescore all of them once
+    //that drifted noticeably, otherwise just the signatures this batch touched
+    double log_vp = md_log_vp(total_phys_, total_virt_);
+    if(fabs(log_vp - scored_log_vp_) > cfg_.drift)
+    {
+        for(uint32_t id = 0; id < (uint32_t)sigs_.size(); id++) this->rescore(id);
+        scored_log_vp_ = log_vp;
+    }
+    else
+    {
+        for(uint32_t id : touched) this->rescore(id);
+    }
+
+    return 0;
+}
+
+void md_discrepancy::fill_row(const signature_t &s, md_discrepancy_row_t *row) const
+{
+    double log_rr, lo, hi;
+
+    md_relative_risk(s.physical, s.virtualized, total_phys_, total_virt_, cfg_.z, &log_rr, &lo, &hi);
+    row->error = s.error;
+    row->scene = s.scene;
+    row->physical = s.physical;
+    row->virtualized = s.virtualized;
+    row->ratio = exp(log_rr);
+    row->ratio_lo = exp(lo);
+    row->ratio_hi = exp(hi);
+    row->score = s.score;
+}
+
+void md_discrepancy::top(size_t n, std::vector<md_discrepancy_row_t> *rows) const
+{
+    rows->clear();
+    for(const std::pair<double, uint32_t> &r : ranking_)
+    {
+        if(n > 0 && rows->size() >= n) break;
+        md_discrepancy_row_t row;
+        this->fill_row(sigs_[r.second], &row);
+        rows->push_back(std::move(row));
+    }
+}
+
+}
@@ -0,0 +1,94 @@
+// Incremental physical-vs-virtualized discrepancy detection over failure signatures.
+//
+// Events are grouped by a normalized (error, scene) signature, or by an (error, scene
+// cluster) signature when a clusterer is set. For every signature the relative risk
+// RR = (p / P) / (v / V) of failing on a physical vs a virtualized device is estimated
+// with a 95% (by default) Katz log confidence interval, where p, v are the signature's
+// events and P, V the totals per device type. Candidates are ranked by the lower
+// confidence bound of |log RR|, so a large ratio backed by few events ranks below a
+// moderate one backed by many.
+
+#ifndef MD_DISCREPANCY_H
+#define MD_DISCREPANCY_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "md_cluster.h"
+#include "md_table.h"
+
+namespace md
+{
+
+typedef struct md_discrepancy_config
+{
+    double   z;          // two-sided normal quantile of the confidence interval
+    uint64_t min_events; // signatures with fewer events are tracked but not ranked
+    double   drift;      // rescore everything once log(V / P) moved by more than this
+} md_discrepancy_config_t;
+
+void md_discrepancy_config_init(md_discrepancy_config_t *cfg);
+
+typedef struct md_discrepancy_row
+{
+    std::string error;
+    std::string scene;    // normalized
+    uint64_t    physical;
+    uint64_t    virtualized;
+    double      ratio;    // point estimate of RR
+    double      ratio_lo; // confidence interval of RR
+    double      ratio_hi;
+    double      score;    // lower confidence bound of |log RR|, 0 when the interval spans 1
+} md_discrepancy_row_t;
+
+class md_discrepancy
+{
+public:
+    explicit md_discrepancy(const md_discrepancy_config_t &cfg);
+
+    // key signatures by the scene cluster instead of the normalized scene text;
+    // set before the first batch, the clusterer must outlive this object
+    void set_clusterer(md_clusterer *clusterer) { clusterer_ = clusterer; }
+
+    // fold a batch of events in; only the signatures present in the batch are rescored
+    int add_batch(const md_table_t &t, unsigned int nthreads);
+
+    // the n highest ranked candidates (all when n is 0)
+    void top(size_t n, std::vector<md_discrepancy_row_t> *rows) const;
+
+    size_t num_signatures() const { return sigs_.size(); }
+    uint64_t total_physical() const { return total_phys_; }
+    uint64_t total_virtualized() const { return total_virt_; }
+
+private:
+    typedef struct signature
+    {
+        std::string error;
+        std::string scene;
+        uint64_t    physical;
+        uint64_t    virtualized;
+        double      score;
+        int         ranked;
+    } signature_t;
+
+    void rescore(uint32_t id);
+    void fill_row(const signature_t &s, md_discrepancy_row_t *row) const;
+
+    md_discrepancy_config_t                   cfg_;
+    md_clusterer                             *clusterer_;
+    std::vector<signature_t>                  sigs_;
+    std::unordered_map<std::string, uint32_t> by_key_;
+    std::set<std::pair<double, uint32_t>>     ranking_; // (-score, id), best first
+    uint64_t                                  total_phys_;
+    uint64_t                                  total_virt_;
+    double                                    scored_log_vp_; // log(V / P) the scores were computed with
+};
+
+}
+
+#endif
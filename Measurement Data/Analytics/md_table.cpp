@@ -0,0 +1,379 @@
+// Dictionary-encoded columnar table over the failure event schema of measurement_data.csv.
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+#include "md_csv.h"
+#include "md_table.h"
+
+namespace md
+{
+
+// rows handled per inner loop; sized so the key and mask buffers stay in L1
+#define MD_SCAN_BLOCK_ROWS 4096
+
+// group-by keys up to this many bits are counted in a dense array instead of a hash map
+#define MD_DENSE_KEY_BITS 20
+
+const char *const md_column_names[MD_COL_NUM] =
+{
+    "error",
+    "scene",
+    "os_version",
+    "device_brand",
+    "device_model",
+    "device_type",
+    "failure_layer",
+};
+
+int md_column_from_name(std::string_view name)
+{
+    for(int c = 0; c < MD_COL_NUM; c++)
+        if(name == md_column_names[c]) return c;
+    return -1;
+}
+
+uint32_t md_dict::intern(std::string_view s)
+{
+    auto it = index_.find(s);
+    if(it != index_.end()) return it->second;
+
+    uint32_t code = (uint32_t)values_.size();
+    values_.emplace_back(s);
+    index_.emplace(std::string_view(values_.back()), code);
+    return code;
+}
+
+int md_dict::find(std::string_view s, uint32_t *code) const
+{
+    auto it = index_.find(s);
+    if(it == index_.end()) return -1;
+    *code = it->second;
+    return 0;
+}
+
+void md_table_init(md_table_t *t)
+{
+    t->nrows = 0;
+    for(int c = 0; c < MD_COL_NUM; c++)
+    {
+        t->dicts[c] = md_dict();
+        t->codes[c].clear();
+    }
+}
+
+void md_table_append(md_table_t *t, const std::string_view fields[MD_COL_NUM])
+{
+    for(int c = 0; c < MD_COL_NUM; c++)
+        t->codes[c].push_back(t->dicts[c].intern(fields[c]));
+    t->nrows++;
+}
+
+//
+// csv loading
+//
+
+// rows of one split range, encoded against range-local dictionaries
+typedef struct md_load_part
+{
+    md_table_t part;
+    int        ret;
+} md_load_part_t;
+
+static void md_load_range(const char *buf, md_csv_range_t range, const int *map, int ncols,
+                          md_load_part_t *out)
+{
+    md_csv_reader                reader(buf, range.begin, range.end);
+    std::vector<md_csv_field_t>  fields;
+    std::string                  scratch[MD_COL_NUM];
+    std::string_view             views[MD_COL_NUM];
+    int                          c;
+
+    md_table_init(&(out->part));
+    out->ret = 0;
+    while(reader.next(&fields))
+    {
+        if(1 == fields.size() && fields[0].raw.empty()) continue; //blank line
+        if((int)fields.size() != ncols)
+        {
+            out->ret = -1;
+            return;
+        }
+
+        for(c = 0; c < ncols; c++)
+            if(map[c] >= 0) views[map[c]] = fields[c].value(&scratch[map[c]]);
+        md_table_append(&(out->part), views);
+    }
+}
+
+int md_table_load_csv(md_table_t *t, const char *path, unsigned int nthreads)
+{
+    md_csv_file                  file;
+    std::vector<md_csv_field_t>  header;
+    std::vector<md_csv_range_t>  ranges;
+    std::string                  scratch;
+    std::vector<int>             map;
+    size_t                       i, r;
+    int                          c;
+
+    if(0 != file.open(path)) return -1;
+
+    //header: map file columns onto the schema, so reordered exports still load
+    md_csv_reader head(file.data(), 0, file.size());
+    if(!head.next(&header)) return -1;
+    for(const md_csv_field_t &f : header)
+        map.push_back(md_column_from_name(f.value(&scratch)));
+    for(c = 0; c < MD_COL_NUM; c++)
+        if(std::find(map.begin(), map.end(), c) == map.end()) return -1;
+
+    //parse row-aligned ranges in parallel against local dictionaries
+    if(0 == nthreads) nthreads = std::max(1u, std::thread::hardware_concurrency());
+    md_csv_split(file.data(), head.tell(), file.size(), nthreads, &ranges);
+
+    std::vector<md_load_part_t> parts(ranges.size());
+    std::vector<std::thread>    workers;
+    for(i = 0; i < ranges.size(); i++)
+        workers.emplace_back(md_load_range, file.data(), ranges[i], map.data(), (int)map.size(), &parts[i]);
+    for(std::thread &w : workers) w.join();
+
+    //merge in file order, so global codes keep first-seen order
+    for(i = 0; i < parts.size(); i++)
+    {
+        const md_table_t &p = parts[i].part;
+        if(0 != parts[i].ret) return -1;
+
+        for(c = 0; c < MD_COL_NUM; c++)
+        {
+            std::vector<uint32_t> remap(p.dicts[c].size());
+            for(r = 0; r < remap.size(); r++) remap[r] = t->dicts[c].intern(p.dicts[c].value((uint32_t)r));
+
+            md_codes_t &dst = t->codes[c];
+            size_t      base = dst.size();
+            dst.resize(base + p.nrows);
+            for(r = 0; r < p.nrows; r++) dst[base + r] = remap[p.codes[c][r]];
+        }
+        t->nrows += p.nrows;
+    }
+
+    return 0;
+}
+
+int md_filter_parse(const md_table_t &t, const char *expr, md_filter_t *f)
+{
+    const char *eq = strchr(expr, '=');
+    if(NULL == eq || eq == expr) return -1;
+
+    f->negate = ('!' == eq[-1]);
+    std::string_view name(expr, (size_t)(eq - expr) - (f->negate ? 1 : 0));
+    if(0 > (f->column = md_column_from_name(name))) return -1;
+
+    //codes are dense, so size() is a code no row carries
+    if(0 != t.dicts[f->column].find(eq + 1, &(f->code)))
+        f->code = (uint32_t)t.dicts[f->column].size();
+    return 0;
+}
+
+//
+// scans
+//
+
+static unsigned int md_bits_for(size_t n)
+{
+    unsigned int bits = 0;
+    while(((size_t)1 << bits) < n) bits++;
+    return bits;
+}
+
+typedef struct md_scan_plan
+{
+    std::vector<int>          cols;
+    std::vector<unsigned int> shifts;
+    unsigned int              bits;
+} md_scan_plan_t;
+
+typedef struct md_scan_result
+{
+    std::vector<uint64_t>                  dense;
+    std::unordered_map<uint64_t, uint64_t> sparse;
+} md_scan_result_t;
+
+// count rows [first, last) into res; group keys are the codes bit-packed per plan
+static void md_scan_range(const md_table_t &t, const std::vector<md_filter_t> &filters,
+                          const md_scan_plan_t &plan, size_t first, size_t last,
+                          md_scan_result_t *res)
+{
+    alignas(64) uint64_t keys[MD_SCAN_BLOCK_ROWS];
+    alignas(64) uint8_t  mask[MD_SCAN_BLOCK_ROWS];
+    size_t               b, n, r, i;
+
+    for(b = first; b < last; b += MD_SCAN_BLOCK_ROWS)
+    {
+        n = std::min((size_t)MD_SCAN_BLOCK_ROWS, last - b);
+
+        //column-at-a-time passes over contiguous codes; each loop auto-vectorizes
+        memset(mask, 1, n);
+        for(const md_filter_t &f : filters)
+        {
+            const uint32_t *v = t.codes[f.column].data() + b;
+            const uint8_t   neg = (uint8_t)f.negate;
+            for(r = 0; r < n; r++)
+                mask[r] &= (uint8_t)((v[r] == f.code) ^ neg);
+        }
+
+        memset(keys, 0, n * sizeof(uint64_t));
+        for(i = 0; i < plan.cols.size(); i++)
+        {
+            const uint32_t *v = t.codes[plan.cols[i]].data() + b;
+            const unsigned  s = plan.shifts[i];
+            for(r = 0; r < n; r++)
+                keys[r] |= (uint64_t)v[r] << s;
+        }
+
+        if(!res->dense.empty())
+        {
+            uint64_t *d = res->dense.data();
+            for(r = 0; r < n; r++)
+                d[keys[r]] += mask[r];
+        }
+        else
+        {
+            for(r = 0; r < n; r++)
+                if(mask[r]) res->sparse[keys[r]]++;
+        }
+    }
+}
+
+int md_table_group_count(const md_table_t &t, const std::vector<md_filter_t> &filters,
+                         const std::vector<int> &group_by, unsigned int nthreads,
+                         std::vector<md_group_count_t> *out)
+{
+    md_scan_plan_t plan;
+    size_t         i, chunk;
+    unsigned int   th;
+
+    plan.bits = 0;
+    for(int c : group_by)
+    {
+        if(c < 0 || c >= MD_COL_NUM) return -1;
+        plan.cols.push_back(c);
+        plan.shifts.push_back(plan.bits);
+        plan.bits += md_bits_for(std::max((size_t)1, t.dicts[c].size()));
+    }
+    if(plan.bits > 63) return -1;
+    for(const md_filter_t &f : filters)
+        if(f.column < 0 || f.column >= MD_COL_NUM) return -1;
+
+    //split the rows into one contiguous range per thread; ranges are block aligned
+    if(0 == nthreads) nthreads = std::max(1u, std::thread::hardware_concurrency());
+    chunk = (t.nrows + nthreads - 1) / nthreads;
+    chunk = ((chunk + MD_SCAN_BLOCK_ROWS - 1) / MD_SCAN_BLOCK_ROWS) * MD_SCAN_BLOCK_ROWS;
+    if(0 == chunk) chunk = MD_SCAN_BLOCK_ROWS;
+    nthreads = (unsigned int)std::max((size_t)1, (t.nrows + chunk - 1) / chunk);
+
+    std::vector<md_scan_result_t> results(nthreads);
+    std::vector<std::thread>      workers;
+    for(th = 0; th < nthreads; th++)
+    {
+        if(plan.bits <= MD_DENSE_KEY_BITS) results[th].dense.assign((size_t)1 << plan.bits, 0);
+        size_t first = std::min(t.nrows, th * chunk);
+        size_t last = std::min(t.nrows, first + chunk);
+        workers.emplace_back(md_scan_range, std::cref(t), std::cref(filters), std::cref(plan),
+                             first, last, &results[th]);
+    }
+    for(std::thread &w : workers) w.join();
+
+    //merge the per-thread partial counts
+    std::unordered_map<uint64_t, uint64_t> merged;
+    for(th = 0; th < nthreads; th++)
+    {
+        for(i = 0; i < results[th].dense.size(); i++)
+            if(results[th].dense[i]) merged[i] += results[th].dense[i];
+        for(auto &kv : results[th].sparse) merged[kv.first] += kv.second;
+    }
+
+    out->clear();
+    for(auto &kv : merged)
+    {
+        md_group_count_t g;
+        for(i = 0; i < plan.cols.size(); i++)
+        {
+            unsigned int w = (i + 1 < plan.cols.size() ? plan.shifts[i + 1] : plan.bits) - plan.shifts[i];
+            uint64_t     m = (1ULL << w) - 1;
+            g.codes.push_back((uint32_t)((kv.first >> plan.shifts[i]) & m));
+        }
+        g.count = kv.second;
+        out->push_back(std::move(g));
+    }
+    std::sort(out->begin(), out->end(), [](const md_group_count_t &a, const md_group_count_t &b)
+    {
+        return a.count != b.count ? a.count > b.count : a.codes < b.codes;
+    });
+    return 0;
+}
+
+int md_table_type_ratio(const md_table_t &t, const std::vector<md_filter_t> &filters,
+                        const std::vector<int> &group_by, unsigned int nthreads,
+                        std::vector<md_type_ratio_t> *out)
+{
+    std::vector<md_group_count_t> counts;
+    std::vector<int>              cols(group_by);
+    uint32_t                      phys, virt;
+    uint64_t                      total_phys = 0, total_virt = 0;
+
+    //a type that never occurs gets a code no row carries, so its totals stay 0
+    const md_dict &types = t.dicts[MD_COL_DEVICE_TYPE];
+    if(0 != types.find("physical", &phys)) phys = (uint32_t)types.size();
+    if(0 != types.find("virtualized", &virt)) virt = (uint32_t)types.size();
+
+    cols.push_back(MD_COL_DEVICE_TYPE);
+    if(0 != md_table_group_count(t, filters, cols, nthreads, &counts)) return -1;
+
+    std::unordered_map<std::string, size_t> slot;
+    out->clear();
+    for(const md_group_count_t &g : counts)
+    {
+        uint32_t type = g.codes.back();
+        if(type != phys && type != virt) continue;
+
+        std::string key((const char *)g.codes.data(), (g.codes.size() - 1) * sizeof(uint32_t));
+        auto it = slot.find(key);
+        if(it == slot.end())
+        {
+            md_type_ratio_t r;
+            r.codes.assign(g.codes.begin(), g.codes.end() - 1);
+            r.physical = 0;
+            r.virtualized = 0;
+            r.ratio = 0;
+            it = slot.emplace(key, out->size()).first;
+            out->push_back(std::move(r));
+        }
+
+        if(type == phys)
+        {
+            (*out)[it->second].physical += g.count;
+            total_phys += g.count;
+        }
+        else
+        {
+            (*out)[it->second].virtualized += g.count;
+            total_virt += g.count;
+        }
+    }
+
+    for(md_type_ratio_t &r : *out)
+    {
+        double fp = total_phys ? (double)r.physical / (double)total_phys : 0.0;
+        double fv = total_virt ? (double)r.virtualized / (double)total_virt : 0.0;
+        r.ratio = (fv > 0.0 ? fp / fv : (fp > 0.0 ? INFINITY : 0.0));
+    }
+    std::sort(out->begin(), out->end(), [](const md_type_ratio_t &a, const md_type_ratio_t &b)
+    {
+        if(a.ratio != b.ratio) return a.ratio > b.ratio;
+        return a.physical + a.virtualized > b.physical + b.virtualized;
+    });
+    return 0;
+}
+
+}
@@ -0,0 +1,131 @@
+// Dictionary-encoded columnar table over the failure event schema of measurement_data.csv.
+
+#ifndef MD_TABLE_H
+#define MD_TABLE_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <deque>
+#include <new>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace md
+{
+
+enum md_column
+{
+    MD_COL_ERROR = 0,
+    MD_COL_SCENE,
+    MD_COL_OS_VERSION,
+    MD_COL_DEVICE_BRAND,
+    MD_COL_DEVICE_MODEL,
+    MD_COL_DEVICE_TYPE,
+    MD_COL_FAILURE_LAYER,
+    MD_COL_NUM
+};
+
+// header names, in the column order of the csv file
+extern const char *const md_column_names[MD_COL_NUM];
+
+// returns the column for a header name, or -1
+int md_column_from_name(std::string_view name);
+
+// cache-line aligned storage, so column scans start on a vector boundary
+template <typename T>
+struct md_aligned_allocator
+{
+    typedef T value_type;
+
+    md_aligned_allocator() = default;
+    template <typename U> md_aligned_allocator(const md_aligned_allocator<U> &) {}
+
+    T *allocate(size_t n)
+    {
+        void *p = aligned_alloc(64, ((n * sizeof(T) + 63) / 64) * 64);
+        if(NULL == p) throw std::bad_alloc();
+        return (T *)p;
+    }
+    void deallocate(T *p, size_t) { free(p); }
+
+    template <typename U> bool operator==(const md_aligned_allocator<U> &) const { return true; }
+    template <typename U> bool operator!=(const md_aligned_allocator<U> &) const { return false; }
+};
+
+typedef std::vector<uint32_t, md_aligned_allocator<uint32_t>> md_codes_t;
+
+// string <-> code dictionary; codes are dense and assigned in first-seen order
+class md_dict
+{
+public:
+    md_dict() = default;
+    md_dict(const md_dict &) = delete; // index_ points into values_
+    md_dict &operator=(const md_dict &) = delete;
+    md_dict(md_dict &&) = default;
+    md_dict &operator=(md_dict &&) = default;
+
+    uint32_t intern(std::string_view s);
+    int find(std::string_view s, uint32_t *code) const;
+
+    const std::string &value(uint32_t code) const { return values_[code]; }
+    size_t size() const { return values_.size(); }
+
+private:
+    std::deque<std::string>                        values_; // stable addresses for index_ keys
+    std::unordered_map<std::string_view, uint32_t> index_;
+};
+
+typedef struct md_table
+{
+    size_t      nrows;
+    md_dict     dicts[MD_COL_NUM];
+    md_codes_t  codes[MD_COL_NUM];
+} md_table_t;
+
+void md_table_init(md_table_t *t);
+void md_table_append(md_table_t *t, const std::string_view fields[MD_COL_NUM]);
+
+// load a measurement_data.csv style file (header row required), returns 0 on success;
+// the file is parsed in nthreads row-aligned ranges, 0 means all cores
+int md_table_load_csv(md_table_t *t, const char *path, unsigned int nthreads);
+
+typedef struct md_filter
+{
+    int      column;
+    uint32_t code;
+    int      negate;
+} md_filter_t;
+
+// resolve "column=value" / "column!=value"; a value absent from the dictionary matches nothing
+int md_filter_parse(const md_table_t &t, const char *expr, md_filter_t *f);
+
+typedef struct md_group_count
+{
+    std::vector<uint32_t> codes; // one per group-by column
+    uint64_t              count;
+} md_group_count_t;
+
+// count rows passing all filters, grouped by the given columns; nthreads 0 means all cores
+int md_table_group_count(const md_table_t &t, const std::vector<md_filter_t> &filters,
+                         const std::vector<int> &group_by, unsigned int nthreads,
+                         std::vector<md_group_count_t> *out);
+
+typedef struct md_type_ratio
+{
+    std::vector<uint32_t> codes;
+    uint64_t              physical;
+    uint64_t              virtualized;
+    double                ratio; // physical frequency / virtualized frequency, inf when virtualized is 0
+} md_type_ratio_t;
+
+// physical-vs-virtualized failure frequency ratio per group, each side normalized by its own total
+int md_table_type_ratio(const md_table_t &t, const std::vector<md_filter_t> &filters,
+                        const std::vector<int> &group_by, unsigned int nthreads,
+                        std::vector<md_type_ratio_t> *out);
+
+}
+
+#endif